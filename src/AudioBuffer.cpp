@@ -0,0 +1,65 @@
+#include "AudioBuffer.h"
+
+AudioBuffer::AudioBuffer(int MinimumCapacity) : WritePos(0), ReadPos(0)
+{
+	// Round up to a power of two so positions can be masked.
+	Capacity = 1;
+	while (Capacity < MinimumCapacity)
+	{
+		Capacity <<= 1;
+	}
+	Mask = Capacity - 1;
+	Data = new short[Capacity];
+}
+
+AudioBuffer::~AudioBuffer()
+{
+	delete[] Data;
+}
+
+int AudioBuffer::Write(const short* Samples, int Count)
+{
+	unsigned int write = WritePos.load(std::memory_order_relaxed);
+	unsigned int read = ReadPos.load(std::memory_order_acquire);
+
+	int space = Capacity - (int)(write - read);
+	if (Count > space)
+	{
+		Count = space;
+	}
+	for (int i = 0; i < Count; i++)
+	{
+		Data[(write + i) & Mask] = Samples[i];
+	}
+
+	// Publish the samples only after they have been stored.
+	WritePos.store(write + Count, std::memory_order_release);
+	return Count;
+}
+
+int AudioBuffer::Read(short* Samples, int Count)
+{
+	unsigned int read = ReadPos.load(std::memory_order_relaxed);
+	unsigned int write = WritePos.load(std::memory_order_acquire);
+
+	int available = (int)(write - read);
+	if (Count > available)
+	{
+		Count = available;
+	}
+	for (int i = 0; i < Count; i++)
+	{
+		Samples[i] = Data[(read + i) & Mask];
+	}
+
+	// Hand the space back to the producer only after the samples have been copied out.
+	ReadPos.store(read + Count, std::memory_order_release);
+	return Count;
+}
+
+int AudioBuffer::Fill()
+{
+	unsigned int write = WritePos.load(std::memory_order_acquire);
+	unsigned int read = ReadPos.load(std::memory_order_acquire);
+	return (int)(write - read);
+}
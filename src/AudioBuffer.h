@@ -0,0 +1,34 @@
+#ifndef _AUDIOBUFFER_H
+#define _AUDIOBUFFER_H
+
+#include <atomic>
+
+// Single producer / single consumer lock-free ring buffer of 16 bit audio samples.
+// The emulation thread writes, the SDL audio callback reads. Neither side ever blocks.
+class AudioBuffer
+{
+public:
+	AudioBuffer(int MinimumCapacity);
+	~AudioBuffer();
+
+	// Producer side. Returns the number of samples written; samples that don't fit are dropped.
+	int Write(const short* Samples, int Count);
+
+	// Consumer side. Returns the number of samples read.
+	int Read(short* Samples, int Count);
+
+	// Number of samples currently buffered. Safe to call from either side.
+	int Fill();
+
+	int Capacity;
+
+protected:
+	short* Data;
+	unsigned int Mask;
+
+	// Free-running positions, only masked when indexing Data. Each is written by one side only.
+	std::atomic<unsigned int> WritePos;
+	std::atomic<unsigned int> ReadPos;
+};
+
+#endif
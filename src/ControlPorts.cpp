@@ -0,0 +1,72 @@
+#include "ControlPorts.h"
+
+ControlPorts::ControlPorts()
+{
+	for (int i = 0; i < 2; i++)
+	{
+		Port[i].Type = DeviceNone;
+		Port[i].Joystick = 0;
+		Port[i].Paddle[0] = Port[i].Paddle[1] = 0;
+		Port[i].PaddleFire[0] = Port[i].PaddleFire[1] = false;
+	}
+	Reset();
+}
+
+void ControlPorts::Reset()
+{
+	// CIA port A lines float high after reset, which connects both ports.
+	Selection = PreviousSelection = 3;
+	SelectionCycle = 0;
+}
+
+unsigned char ControlPorts::Lines(int PortIndex)
+{
+	ControlDevice& device = Port[PortIndex];
+	switch (device.Type)
+	{
+	case DeviceJoystick:
+		return ~(device.Joystick & 0x1F);
+	case DevicePaddles:
+		return ~((device.PaddleFire[0] ? JoyLeft : 0) | (device.PaddleFire[1] ? JoyRight : 0));
+	default:
+		return 0xFF;
+	}
+}
+
+void ControlPorts::SelectPaddles(unsigned char PortALines, long long Cycle)
+{
+	int select = (PortALines >> 6) & 3;
+	if (select != Selection)
+	{
+		PreviousSelection = Selection;
+		Selection = select;
+		SelectionCycle = Cycle;
+	}
+}
+
+unsigned char ControlPorts::ReadPot(int Axis, long long Cycle)
+{
+	// The last window to finish began one window before the current one, and started charging half way through.
+	long long windowStart = (Cycle - Cycle % PotWindowCycles) - PotWindowCycles;
+	if (windowStart < 0)
+	{
+		return 0xFF;
+	}
+	long long chargeStart = windowStart + PotWindowCycles / 2;
+	return PotValue(SelectionCycle <= chargeStart ? Selection : PreviousSelection, Axis);
+}
+
+unsigned char ControlPorts::PotValue(int Selected, int Axis)
+{
+	// An unconnected pot never charges to the threshold, and reads $FF. With both ports selected the pots are in
+	// parallel, and the lower resistance wins.
+	unsigned char value = 0xFF;
+	for (int i = 0; i < 2; i++)
+	{
+		if ((Selected & (1 << i)) && Port[i].Type == DevicePaddles && Port[i].Paddle[Axis] < value)
+		{
+			value = Port[i].Paddle[Axis];
+		}
+	}
+	return value;
+}
@@ -0,0 +1,64 @@
+#ifndef _CONTROLPORTS_H
+#define _CONTROLPORTS_H
+
+// Joystick direction and fire bits, set while pressed. The same as the CIA port bits they pull low.
+enum JoystickBits
+{
+	JoyUp = 1,
+	JoyDown = 2,
+	JoyLeft = 4,
+	JoyRight = 8,
+	JoyFire = 16
+};
+
+enum ControlDeviceType
+{
+	DeviceNone,
+	DeviceJoystick,
+	DevicePaddles
+};
+
+// What's plugged into one control port.
+struct ControlDevice
+{
+	int Type; // ControlDeviceType
+	unsigned char Joystick; // JoystickBits
+	// Paddle positions, 0-255 (POTX and POTY), and fire buttons. The buttons use the joystick left and right lines.
+	unsigned char Paddle[2];
+	bool PaddleFire[2];
+};
+
+// The two control ports. Port 1 is wired to CIA1 port B, port 2 to CIA1 port A, and both share the keyboard
+// matrix lines. Paddles are read through the SID POTX/POTY registers, from the port selected by CIA1 PA6 (port 1)
+// and PA7 (port 2).
+// The SID measures the pots in 512 cycle windows: 256 cycles discharging, then it counts how long the capacitor
+// takes to charge, and latches the count at the end of the window. Nothing is clocked here; a POT read works out
+// which window last finished and which port was selected while it was charging.
+class ControlPorts
+{
+public:
+	ControlPorts();
+
+	void Reset();
+
+	ControlDevice Port[2];
+
+	// Lines pulled low by the device in a port, as a mask to AND with the CIA port (0xFF when nothing is pressed).
+	unsigned char Lines(int PortIndex);
+
+	// Called on CIA1 port A writes, with the PA line levels.
+	void SelectPaddles(unsigned char PortALines, long long Cycle);
+
+	// POTX (Axis 0) or POTY (Axis 1) as of the last completed measurement window.
+	unsigned char ReadPot(int Axis, long long Cycle);
+
+	static const int PotWindowCycles = 512;
+
+protected:
+	int Selection, PreviousSelection; // PA6-7 as bits 0-1
+	long long SelectionCycle;
+
+	unsigned char PotValue(int Selected, int Axis);
+};
+
+#endif
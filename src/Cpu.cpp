@@ -1,5 +1,6 @@
 #include "Cpu.h"
 #include "Memory.h"
+#include "Debugger.h"
 #include <stdio.h>
 
 // Print out every CPU instruction (debug purposes)
@@ -63,6 +64,11 @@ static void ignore_args(...)
 
 Cpu::Cpu()
 {
+	AttachedDebugger = nullptr;
+	CoverageMap = nullptr;
+	CoveragePrev = 0;
+	Fault = CpuFaultNone;
+	FaultPC = 0;
 }
 
 
@@ -82,6 +88,23 @@ void Cpu::Reset()
 	Running = true;
 	HandleInterrupt = false;
 	RequestedInterrupts = 0;
+	IdleLoopCycles = 0;
+	InterruptCount = 0;
+	StealCount = 0;
+	IdleBranchPC = 0;
+	IdleCycle = 0;
+	Fault = CpuFaultNone;
+	FaultPC = 0;
+	CoveragePrev = 0;
+}
+
+void Cpu::SetFault(int NewFault)
+{
+	if (Fault == CpuFaultNone)
+	{
+		Fault = NewFault;
+		FaultPC = SavedPC;
+	}
 }
 
 unsigned short Cpu::InstructionPC()
@@ -102,6 +125,26 @@ void Cpu::UnrequestIrq(int sourceIndex)
 	CheckHandleInterrupt();
 }
 
+void Cpu::GetRegisters(CpuRegisters& Regs)
+{
+	Regs.PC = PC;
+	Regs.S = S;
+	Regs.P = P;
+	Regs.A = A;
+	Regs.X = X;
+	Regs.Y = Y;
+}
+void Cpu::SetRegisters(const CpuRegisters& Regs)
+{
+	PC = Regs.PC;
+	S = Regs.S;
+	P = Regs.P;
+	A = Regs.A;
+	X = Regs.X;
+	Y = Regs.Y;
+	CheckHandleInterrupt();
+}
+
 
 
 bool Cpu::Step()
@@ -129,6 +172,7 @@ bool Cpu::Step()
 		printf("PC=%04X: Interrupt A=%02X P=%02X S=%02X X=%02X Y=%02X (%lld)\n", PC, A, P, S, X, Y, Cycle);
 
 		HandleInterrupt = false;
+		InterruptCount++;
 		Push(High(PC));
 		Push(Low(PC));
 		Push(P & (~BFlag));
@@ -136,9 +180,23 @@ bool Cpu::Step()
 		PC = Load16(0xFFFE);
 	}
 
+	if (AttachedDebugger != nullptr && !AttachedDebugger->BeforeInstruction(PC))
+	{
+		return false; // Stopped by the debugger, the CPU is still running.
+	}
+
 	instructionPC = PC;
 	SavedPC = PC;
 
+	if (CoverageMap != nullptr)
+	{
+		// Hash the PC so nearby addresses spread over the map, and shift the previous location so A->B and B->A
+		// are different edges.
+		unsigned int location = (instructionPC * 0x9E3779B1u) >> 16;
+		CoverageMap[(location ^ CoveragePrev) & (CoverageMapSize - 1)]++;
+		CoveragePrev = location >> 1;
+	}
+
 	instruction = LoadInstructionByte(); 
 
 	switch (instruction)
@@ -161,6 +219,7 @@ bool Cpu::Step()
 		temp2 = Pop();
 		SetLow(PC, temp);
 		SetHigh(PC, temp2);
+		CheckHandleInterrupt(); // The IRQ line may still be held by another source.
 		break;
 
 	case 0x60: TRACE_INSTRUCTION("RTS"); // Return from subroutine
@@ -412,6 +471,7 @@ bool Cpu::Step()
 
 	case 0x28: TRACE_INSTRUCTION("PLP"); // Pull P
 		P = Pop() | OneFlag | BFlag;
+		CheckHandleInterrupt();
 		break;
 
 	case 0x48: TRACE_INSTRUCTION("PHA"); // Push A
@@ -951,7 +1011,12 @@ bool Cpu::Step()
 		break;
 
 	default:
-		TRACE_UNDEFINED("Unrecognized Instruction");
+		// While fuzzing the fuzzer reports faults itself, once per crash site.
+		if (CoverageMap == nullptr)
+		{
+			TRACE_UNDEFINED("Unrecognized Instruction");
+		}
+		SetFault(instruction == 0x00 ? CpuFaultBrk : CpuFaultUndefinedOpcode);
 		Running = false;
 		return false; // CPU does not recognize this instruction.
 
@@ -960,9 +1025,37 @@ bool Cpu::Step()
 
 	Cycle += 2; // All instructions take two cycles at least. Additional cycles are often due to memory access.
 
+	// Branches are xxx10000. A branch or JMP back to an earlier address closes a loop.
+	if (PC <= instructionPC && ((instruction & 0x1F) == 0x10 || instruction == 0x4C))
+	{
+		CheckIdleLoop(instructionPC);
+	}
+
 	return true;
 }
 
+void Cpu::CheckIdleLoop(unsigned short BranchPC)
+{
+	bool same = BranchPC == IdleBranchPC
+		&& PC == IdleRegs.PC && S == IdleRegs.S && P == IdleRegs.P && A == IdleRegs.A && X == IdleRegs.X && Y == IdleRegs.Y
+		&& AttachedMemory->ChangeCount == IdleChangeCount
+		&& AttachedMemory->IoAccessCount == IdleIoAccessCount
+		&& InterruptCount == IdleInterruptCount
+		&& StealCount == IdleStealCount;
+	if (same)
+	{
+		IdleLoopCycles = (int)(Cycle - IdleCycle);
+	}
+
+	IdleBranchPC = BranchPC;
+	GetRegisters(IdleRegs);
+	IdleCycle = Cycle;
+	IdleChangeCount = AttachedMemory->ChangeCount;
+	IdleIoAccessCount = AttachedMemory->IoAccessCount;
+	IdleInterruptCount = InterruptCount;
+	IdleStealCount = StealCount;
+}
+
 unsigned char Cpu::LoadIndirectX(unsigned char param)
 {
 	unsigned short ramLocation = Load16(param) + X;
@@ -1131,11 +1224,19 @@ void Cpu::SetHigh(unsigned short & Reg, unsigned char NewHigh)
 
 void Cpu::Push(unsigned char Value)
 {
+	if (S == 0x00)
+	{
+		SetFault(CpuFaultStackWrap);
+	}
 	AttachedMemory->Write8(0x100 | S, Value);
 	S--;
 }
 unsigned char Cpu::Pop()
 {
+	if (S == 0xFF)
+	{
+		SetFault(CpuFaultStackWrap);
+	}
 	S++;
 	return AttachedMemory->Read8(0x100 | S);
 }
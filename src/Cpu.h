@@ -2,12 +2,30 @@
 #define _CPU_H
 
 class Memory;
+class Debugger;
 
 
 enum CpuInterruptSource
 {
 	InterruptSourceCIA1,
-	InterruptSourceCIA2
+	InterruptSourceCIA2,
+	InterruptSourceVIC
+};
+
+// Things a working program shouldn't do, recorded for fuzzing.
+enum CpuFault
+{
+	CpuFaultNone,
+	CpuFaultUndefinedOpcode,
+	CpuFaultBrk, // BRK isn't emulated, running into one usually means execution ran off into zeroed memory.
+	CpuFaultStackWrap
+};
+
+// Programmer-visible CPU registers, for tools that need to inspect or replace the CPU state.
+struct CpuRegisters
+{
+	unsigned short PC;
+	unsigned char S, P, A, X, Y;
 };
 
 class Cpu
@@ -20,17 +38,51 @@ public:
 	bool Step();
 
 	Memory * AttachedMemory;
+	Debugger * AttachedDebugger; // Checked before every instruction when set.
 
 	bool Running;
 	long long Cycle;
 
 	unsigned short InstructionPC();
+	unsigned short NextPC() { return PC; } // Address of the next instruction to execute.
 
 	void RequestIrq(int sourceIndex);
 	void UnrequestIrq(int sourceIndex);
 
+	void GetRegisters(CpuRegisters& Regs);
+	void SetRegisters(const CpuRegisters& Regs);
+
+	// Idle loop detection. A backward branch or jump ends a loop iteration. If an iteration changed nothing (same
+	// registers, no RAM changes, no IO access and no interrupt), every later iteration will be the same until an
+	// interrupt arrives, so that time can be skipped. Set to the loop length in cycles when that's the case.
+	int IdleLoopCycles;
+	unsigned int InterruptCount;
+	bool InterruptPending() { return HandleInterrupt; }
+
+	// Take cycles from the CPU (VIC bad lines). An iteration that lost cycles isn't a measure of the loop length.
+	void StealCycles(int Count) { Cycle += Count; StealCount++; }
+	unsigned int StealCount;
+
+	// First fault since reset (CpuFault).
+	int Fault;
+	unsigned short FaultPC; // Instruction that caused it.
+
+	// Edge coverage, AFL style. When set, every instruction bumps the counter for its (previous PC, PC) pair,
+	// and undefined instructions fault without dumping the trace backlog.
+	unsigned char* CoverageMap;
+	static const int CoverageMapSize = 65536;
+
 protected:
 
+	void CheckIdleLoop(unsigned short BranchPC);
+	unsigned short IdleBranchPC;
+	CpuRegisters IdleRegs;
+	long long IdleCycle;
+	unsigned int IdleChangeCount, IdleIoAccessCount, IdleInterruptCount, IdleStealCount;
+
+	unsigned int CoveragePrev;
+	void SetFault(int NewFault);
+
 	int RequestedInterrupts;
 	bool HandleInterrupt;
 
@@ -73,14 +125,14 @@ protected:
 	unsigned short LoadInstructionShort();
 
 	// Bit flags
-	const unsigned char NFlag = 0x80; // Negative. Set to the top bit of the result of an operation.
-	const unsigned char VFlag = 0x40; // Overflow. Overflow is when the carry into the top bit != the carry out of the top bit (occurs when the resulting math operation wraps around)
-	const unsigned char OneFlag = 0x20;// 0x20 flag is always 1
-	const unsigned char BFlag = 0x10; // Break. Always set except when the P register is being pushed on stack to service a hardware interrupt (to distiguish from BRK instruction interrupts)
-	const unsigned char DFlag = 0x08; // Decimal Mode. When 1, add/sub will use BCD mode. Annoying to emulate :)
-	const unsigned char IFlag = 0x04; // Interrupt Disable. Set to 1 to prevent hardware interrupts.
-	const unsigned char ZFlag = 0x02; // Zero. Set to 1 only when the result of the last operation was zero
-	const unsigned char CFlag = 0x01; // Carry. The raw carry out of add/sub operations, or the ejected bit in bit shifts.
+	static const unsigned char NFlag = 0x80; // Negative. Set to the top bit of the result of an operation.
+	static const unsigned char VFlag = 0x40; // Overflow. Overflow is when the carry into the top bit != the carry out of the top bit (occurs when the resulting math operation wraps around)
+	static const unsigned char OneFlag = 0x20;// 0x20 flag is always 1
+	static const unsigned char BFlag = 0x10; // Break. Always set except when the P register is being pushed on stack to service a hardware interrupt (to distiguish from BRK instruction interrupts)
+	static const unsigned char DFlag = 0x08; // Decimal Mode. When 1, add/sub will use BCD mode. Annoying to emulate :)
+	static const unsigned char IFlag = 0x04; // Interrupt Disable. Set to 1 to prevent hardware interrupts.
+	static const unsigned char ZFlag = 0x02; // Zero. Set to 1 only when the result of the last operation was zero
+	static const unsigned char CFlag = 0x01; // Carry. The raw carry out of add/sub operations, or the ejected bit in bit shifts.
 
 };
 
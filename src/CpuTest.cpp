@@ -0,0 +1,434 @@
+#include "CpuTest.h"
+#include "LockstepCpu.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+// Just enough of a JSON reader to load the per-opcode test vector files.
+struct JsonNode
+{
+	enum NodeType { Null, Number, String, Array, Object };
+
+	NodeType Type;
+	double Value;
+	std::string Text;
+	std::vector<std::string> Keys; // Object keys, parallel to Items.
+	std::vector<JsonNode> Items;
+
+	JsonNode() : Type(Null), Value(0) {}
+
+	const JsonNode* Get(const char* Key) const
+	{
+		for (size_t i = 0; i < Keys.size(); i++)
+		{
+			if (Keys[i] == Key) return &Items[i];
+		}
+		return nullptr;
+	}
+	int GetInt(const char* Key) const
+	{
+		const JsonNode* node = Get(Key);
+		return node ? (int)node->Value : 0;
+	}
+};
+
+class JsonParser
+{
+public:
+	JsonParser(const char* Text) : Cur(Text), Error(false) {}
+
+	bool Parse(JsonNode& Node)
+	{
+		SkipSpace();
+		switch (*Cur)
+		{
+		case '{':
+			Node.Type = JsonNode::Object;
+			Cur++;
+			SkipSpace();
+			if (*Cur == '}') { Cur++; return true; }
+			while (!Error)
+			{
+				JsonNode key;
+				SkipSpace();
+				if (*Cur != '"' || !Parse(key)) return Fail();
+				SkipSpace();
+				if (*Cur++ != ':') return Fail();
+				Node.Keys.push_back(key.Text);
+				Node.Items.push_back(JsonNode());
+				if (!Parse(Node.Items.back())) return Fail();
+				SkipSpace();
+				if (*Cur == ',') { Cur++; continue; }
+				if (*Cur == '}') { Cur++; return true; }
+				return Fail();
+			}
+			return false;
+		case '[':
+			Node.Type = JsonNode::Array;
+			Cur++;
+			SkipSpace();
+			if (*Cur == ']') { Cur++; return true; }
+			while (!Error)
+			{
+				Node.Items.push_back(JsonNode());
+				if (!Parse(Node.Items.back())) return Fail();
+				SkipSpace();
+				if (*Cur == ',') { Cur++; continue; }
+				if (*Cur == ']') { Cur++; return true; }
+				return Fail();
+			}
+			return false;
+		case '"':
+			Node.Type = JsonNode::String;
+			Cur++;
+			while (*Cur && *Cur != '"')
+			{
+				if (*Cur == '\\' && Cur[1]) Cur++; // Escapes aren't needed by the test files, keep the raw character.
+				Node.Text += *Cur++;
+			}
+			if (*Cur != '"') return Fail();
+			Cur++;
+			return true;
+		case 'n':
+			Node.Type = JsonNode::Null;
+			return Literal("null");
+		case 't':
+			Node.Type = JsonNode::Number; Node.Value = 1;
+			return Literal("true");
+		case 'f':
+			Node.Type = JsonNode::Number; Node.Value = 0;
+			return Literal("false");
+		default:
+		{
+			char* end;
+			Node.Type = JsonNode::Number;
+			Node.Value = strtod(Cur, &end);
+			if (end == Cur) return Fail();
+			Cur = end;
+			return true;
+		}
+		}
+	}
+
+	const char* Cur;
+	bool Error;
+
+protected:
+	void SkipSpace()
+	{
+		while (*Cur == ' ' || *Cur == '\t' || *Cur == '\r' || *Cur == '\n') Cur++;
+	}
+	bool Literal(const char* Word)
+	{
+		size_t len = strlen(Word);
+		if (strncmp(Cur, Word, len) != 0) return Fail();
+		Cur += len;
+		return true;
+	}
+	bool Fail()
+	{
+		Error = true;
+		return false;
+	}
+};
+
+static char* ReadWholeFile(const char* Filename, long* Size)
+{
+	FILE* f = fopen(Filename, "rb");
+	if (!f)
+	{
+		return nullptr;
+	}
+	fseek(f, 0, SEEK_END);
+	long length = ftell(f);
+	fseek(f, 0, SEEK_SET);
+
+	char* data = new char[length + 1];
+	length = (long)fread(data, 1, length, f);
+	data[length] = 0;
+	fclose(f);
+
+	if (Size) *Size = length;
+	return data;
+}
+
+
+CpuTest::CpuTest() : TestMemory(), TestCpu()
+{
+	TestMemory.FlatMemory = true;
+	TestMemory.AttachedCpu = &TestCpu;
+	TestCpu.AttachedMemory = &TestMemory;
+
+	Passed = Failed = CycleMismatches = 0;
+	SetEngine("interpreter", InterpreterStep, nullptr);
+}
+
+void CpuTest::SetEngine(const char* Name, FnPtrCpuStep StepFn, void* Context)
+{
+	EngineName = Name;
+	EngineStep = StepFn;
+	EngineContext = Context;
+}
+
+bool CpuTest::InterpreterStep(Cpu* cpu, void* /*context*/)
+{
+	return cpu->Step();
+}
+
+bool CpuTest::RunFunctionalTest(const char* Filename, int LoadAddress, int StartPC, int SuccessPC, long long MaxInstructions)
+{
+	long size;
+	char* image = ReadWholeFile(Filename, &size);
+	if (!image)
+	{
+		printf("Unable to open %s\n", Filename);
+		return false;
+	}
+
+	for (int i = 0; i < 65536; i++)
+	{
+		TestMemory.WriteRam(i, 0);
+	}
+	for (long i = 0; i < size && LoadAddress + i < 65536; i++)
+	{
+		TestMemory.WriteRam((int)(LoadAddress + i), image[i]);
+	}
+	delete[] image;
+
+	TestCpu.Reset();
+	CpuRegisters regs;
+	TestCpu.GetRegisters(regs);
+	regs.PC = StartPC;
+	TestCpu.SetRegisters(regs);
+
+	long long instructions = 0;
+	while (instructions < MaxInstructions)
+	{
+		TestCpu.GetRegisters(regs);
+		unsigned short prevPC = regs.PC;
+
+		if (!EngineStep(&TestCpu, EngineContext))
+		{
+			printf("[%s] %s: CPU stopped at PC=%04X after %lld instructions\n", EngineName, Filename, TestCpu.InstructionPC(), instructions);
+			Failed++;
+			return false;
+		}
+		instructions++;
+
+		TestCpu.GetRegisters(regs);
+		if (regs.PC == prevPC)
+		{
+			// Trapped: the instruction jumped or branched to itself.
+			bool success = (regs.PC == SuccessPC);
+			printf("[%s] %s: trap at %04X after %lld instructions, %lld cycles - %s\n", EngineName, Filename, regs.PC, instructions, TestCpu.Cycle, success ? "PASS" : "FAIL");
+			if (success) Passed++; else Failed++;
+			return success;
+		}
+	}
+
+	printf("[%s] %s: no trap after %lld instructions - FAIL\n", EngineName, Filename, instructions);
+	Failed++;
+	return false;
+}
+
+static void LoadJsonState(const JsonNode& State, CpuRegisters& Regs, Memory& Mem)
+{
+	Regs.PC = State.GetInt("pc");
+	Regs.S = State.GetInt("s");
+	Regs.P = State.GetInt("p");
+	Regs.A = State.GetInt("a");
+	Regs.X = State.GetInt("x");
+	Regs.Y = State.GetInt("y");
+
+	const JsonNode* ram = State.Get("ram");
+	if (ram)
+	{
+		for (size_t i = 0; i < ram->Items.size(); i++)
+		{
+			const JsonNode& entry = ram->Items[i];
+			if (entry.Items.size() >= 2)
+			{
+				Mem.WriteRam((int)entry.Items[0].Value & 0xFFFF, (unsigned char)entry.Items[1].Value);
+			}
+		}
+	}
+}
+
+bool CpuTest::RunJsonTests(const char* Filename, bool CheckCycles)
+{
+	char* text = ReadWholeFile(Filename, nullptr);
+	if (!text)
+	{
+		printf("Unable to open %s\n", Filename);
+		return false;
+	}
+
+	JsonNode root;
+	JsonParser parser(text);
+	bool parsed = parser.Parse(root);
+	delete[] text;
+	if (!parsed || root.Type != JsonNode::Array)
+	{
+		printf("%s: not a JSON array of test vectors\n", Filename);
+		return false;
+	}
+
+	int filePassed = 0, fileFailed = 0, fileCycleMismatches = 0;
+	const int MaxReportedFailures = 10;
+
+	for (size_t t = 0; t < root.Items.size(); t++)
+	{
+		const JsonNode& test = root.Items[t];
+		const JsonNode* initial = test.Get("initial");
+		const JsonNode* final = test.Get("final");
+		const JsonNode* cycles = test.Get("cycles");
+		const JsonNode* name = test.Get("name");
+		if (!initial || !final)
+		{
+			continue;
+		}
+
+		CpuRegisters regs, expected, actual;
+		LoadJsonState(*initial, regs, TestMemory);
+		TestCpu.Reset();
+		TestCpu.SetRegisters(regs);
+
+		bool ok = EngineStep(&TestCpu, EngineContext);
+
+		// Load the expected register values (RAM values are compared below rather than loaded).
+		expected.PC = final->GetInt("pc");
+		expected.S = final->GetInt("s");
+		expected.P = final->GetInt("p");
+		expected.A = final->GetInt("a");
+		expected.X = final->GetInt("x");
+		expected.Y = final->GetInt("y");
+		TestCpu.GetRegisters(actual);
+
+		ok = ok && actual.PC == expected.PC && actual.S == expected.S && actual.P == expected.P
+			&& actual.A == expected.A && actual.X == expected.X && actual.Y == expected.Y;
+
+		int badAddress = -1;
+		const JsonNode* ram = final->Get("ram");
+		if (ram)
+		{
+			for (size_t i = 0; i < ram->Items.size(); i++)
+			{
+				const JsonNode& entry = ram->Items[i];
+				int address = (int)entry.Items[0].Value & 0xFFFF;
+				if (TestMemory.ReadRam(address) != (unsigned char)entry.Items[1].Value)
+				{
+					badAddress = address;
+					ok = false;
+					break;
+				}
+			}
+		}
+
+		bool cyclesOk = true;
+		if (CheckCycles && cycles && TestCpu.Cycle != (long long)cycles->Items.size())
+		{
+			cyclesOk = false;
+			fileCycleMismatches++;
+		}
+
+		if (ok)
+		{
+			filePassed++;
+		}
+		else
+		{
+			fileFailed++;
+		}
+
+		if ((!ok || !cyclesOk) && fileFailed + fileCycleMismatches <= MaxReportedFailures)
+		{
+			printf("[%s] %s \"%s\": %s\n", EngineName, Filename, name ? name->Text.c_str() : "?", ok ? "cycle count mismatch" : "FAIL");
+			printf("  expected PC=%04X A=%02X X=%02X Y=%02X P=%02X S=%02X cycles=%d\n", expected.PC, expected.A, expected.X, expected.Y, expected.P, expected.S, cycles ? (int)cycles->Items.size() : -1);
+			printf("  actual   PC=%04X A=%02X X=%02X Y=%02X P=%02X S=%02X cycles=%lld\n", actual.PC, actual.A, actual.X, actual.Y, actual.P, actual.S, TestCpu.Cycle);
+			if (badAddress >= 0)
+			{
+				printf("  memory mismatch at %04X\n", badAddress);
+			}
+		}
+	}
+
+	printf("[%s] %s: %d passed, %d failed, %d cycle count mismatches\n", EngineName, Filename, filePassed, fileFailed, fileCycleMismatches);
+
+	Passed += filePassed;
+	Failed += fileFailed;
+	CycleMismatches += fileCycleMismatches;
+	return fileFailed == 0 && fileCycleMismatches == 0;
+}
+
+static void PrintCpuTestUsage()
+{
+	printf("Usage:\n");
+	printf("  c64emu --cputest functional <image.bin> <success PC> [start PC (default 0400)] [load address (default 0000)]\n");
+	printf("  c64emu --cputest json [--nocycles] <test.json> [more.json ...]\n");
+	printf("Either can be preceded by --engine <interpreter|lockstep> to select the CPU engine.\n");
+	printf("Addresses are hexadecimal.\n");
+}
+
+int CpuTest::RunCommandLine(int argc, char* argv[])
+{
+	if (argc < 2)
+	{
+		PrintCpuTestUsage();
+		return 2;
+	}
+
+	CpuTest test;
+	bool allPassed = true;
+
+	LockstepCpu lockstep;
+	if (strcmp(argv[0], "--engine") == 0)
+	{
+		if (strcmp(argv[1], "lockstep") == 0)
+		{
+			test.SetEngine("lockstep", LockstepCpu::CpuTestStep, &lockstep);
+		}
+		else if (strcmp(argv[1], "interpreter") != 0)
+		{
+			printf("Unknown CPU engine %s\n", argv[1]);
+			return 2;
+		}
+		argc -= 2;
+		argv += 2;
+		if (argc < 2)
+		{
+			PrintCpuTestUsage();
+			return 2;
+		}
+	}
+
+	if (strcmp(argv[0], "functional") == 0 && argc >= 3)
+	{
+		int successPC = (int)strtol(argv[2], nullptr, 16);
+		int startPC = argc >= 4 ? (int)strtol(argv[3], nullptr, 16) : 0x0400;
+		int loadAddress = argc >= 5 ? (int)strtol(argv[4], nullptr, 16) : 0;
+		allPassed = test.RunFunctionalTest(argv[1], loadAddress, startPC, successPC, 200000000);
+	}
+	else if (strcmp(argv[0], "json") == 0)
+	{
+		bool checkCycles = true;
+		for (int i = 1; i < argc; i++)
+		{
+			if (strcmp(argv[i], "--nocycles") == 0)
+			{
+				checkCycles = false;
+				continue;
+			}
+			allPassed = test.RunJsonTests(argv[i], checkCycles) && allPassed;
+		}
+		printf("Total: %d passed, %d failed, %d cycle count mismatches\n", test.Passed, test.Failed, test.CycleMismatches);
+	}
+	else
+	{
+		PrintCpuTestUsage();
+		return 2;
+	}
+
+	return allPassed ? 0 : 1;
+}
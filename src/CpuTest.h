@@ -0,0 +1,45 @@
+#ifndef _CPUTEST_H
+#define _CPUTEST_H
+
+#include "Cpu.h"
+#include "Memory.h"
+
+// Function pointer type for a CPU engine under test. Execute one instruction, return false if the CPU stopped.
+typedef bool (*FnPtrCpuStep)(Cpu* cpu, void* context);
+
+// Headless CPU conformance harness.
+// Runs the CPU against a flat 64KB bus (no C64 banking or IO), either with a 6502 functional test image
+// that ends in a success trap, or with per-opcode JSON test vectors (initial state, final state and cycle count).
+class CpuTest
+{
+public:
+	CpuTest();
+
+	// Select the engine that executes instructions. The default is the interpreter, Cpu::Step.
+	void SetEngine(const char* Name, FnPtrCpuStep StepFn, void* Context);
+
+	// Load a binary image at LoadAddress, start at StartPC and run until the CPU traps (jumps or branches to itself).
+	// Passes if the trap address is SuccessPC.
+	bool RunFunctionalTest(const char* Filename, int LoadAddress, int StartPC, int SuccessPC, long long MaxInstructions);
+
+	// Run every test vector in a JSON file (array of { name, initial, final, cycles } objects).
+	// Returns true if all vectors passed. Cycle count mismatches are reported separately from state mismatches.
+	bool RunJsonTests(const char* Filename, bool CheckCycles);
+
+	// Entry point for "c64emu --cputest ..."
+	static int RunCommandLine(int argc, char* argv[]);
+
+	Memory TestMemory;
+	Cpu TestCpu;
+
+	int Passed, Failed, CycleMismatches;
+
+protected:
+	const char* EngineName;
+	FnPtrCpuStep EngineStep;
+	void* EngineContext;
+
+	static bool InterpreterStep(Cpu* cpu, void* context);
+};
+
+#endif
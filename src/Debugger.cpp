@@ -0,0 +1,545 @@
+#include "Debugger.h"
+#include "Emulation.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cctype>
+
+DebugCondition::DebugCondition()
+{
+	Error = NULL;
+	Pos = NULL;
+}
+
+bool DebugCondition::Compile(const char* Source)
+{
+	Code.clear();
+	Error = NULL;
+	Text = Source != NULL ? Source : "";
+	Pos = Text.c_str();
+	SkipSpaces();
+	if (*Pos == 0)
+	{
+		return true;
+	}
+	if (!ParseOr())
+	{
+		Code.clear();
+		return false;
+	}
+	SkipSpaces();
+	if (*Pos != 0)
+	{
+		Error = "Unexpected text after the condition";
+		Code.clear();
+		return false;
+	}
+	return true;
+}
+
+void DebugCondition::SkipSpaces()
+{
+	while (*Pos == ' ' || *Pos == '\t')
+	{
+		Pos++;
+	}
+}
+
+bool DebugCondition::Match(const char* Token)
+{
+	SkipSpaces();
+	size_t length = strlen(Token);
+	if (strncmp(Pos, Token, length) != 0)
+	{
+		return false;
+	}
+	Pos += length;
+	return true;
+}
+
+void DebugCondition::Emit(int Kind, int Value)
+{
+	Op op;
+	op.Kind = Kind;
+	op.Value = Value;
+	Code.push_back(op);
+}
+
+bool DebugCondition::ParseOr()
+{
+	if (!ParseAnd())
+	{
+		return false;
+	}
+	while (Match("||"))
+	{
+		if (!ParseAnd())
+		{
+			return false;
+		}
+		Emit(OpOr);
+	}
+	return true;
+}
+
+bool DebugCondition::ParseAnd()
+{
+	if (!ParseCompare())
+	{
+		return false;
+	}
+	while (Match("&&"))
+	{
+		if (!ParseCompare())
+		{
+			return false;
+		}
+		Emit(OpAnd);
+	}
+	return true;
+}
+
+bool DebugCondition::ParseCompare()
+{
+	if (!ParseBits())
+	{
+		return false;
+	}
+	// Longer operators first, so "<=" isn't taken as "<".
+	static const char* Operators[] = { "==", "!=", "<=", ">=", "<", ">" };
+	static const int Kinds[] = { OpEqual, OpNotEqual, OpLessEqual, OpGreaterEqual, OpLess, OpGreater };
+	for (int i = 0; i < 6; i++)
+	{
+		if (Match(Operators[i]))
+		{
+			if (!ParseBits())
+			{
+				return false;
+			}
+			Emit(Kinds[i]);
+			break;
+		}
+	}
+	return true;
+}
+
+bool DebugCondition::ParseBits()
+{
+	if (!ParseUnary())
+	{
+		return false;
+	}
+	while (true)
+	{
+		SkipSpaces();
+		int kind;
+		if (Pos[0] == '&' && Pos[1] != '&')
+		{
+			kind = OpBitAnd;
+		}
+		else if (Pos[0] == '|' && Pos[1] != '|')
+		{
+			kind = OpBitOr;
+		}
+		else if (Pos[0] == '^')
+		{
+			kind = OpBitXor;
+		}
+		else
+		{
+			return true;
+		}
+		Pos++;
+		if (!ParseUnary())
+		{
+			return false;
+		}
+		Emit(kind);
+	}
+}
+
+bool DebugCondition::ParseUnary()
+{
+	SkipSpaces();
+	if (Pos[0] == '!' && Pos[1] != '=')
+	{
+		Pos++;
+		if (!ParseUnary())
+		{
+			return false;
+		}
+		Emit(OpNot);
+		return true;
+	}
+	return ParsePrimary();
+}
+
+bool DebugCondition::ParsePrimary()
+{
+	SkipSpaces();
+	if (*Pos == '(')
+	{
+		Pos++;
+		if (!ParseOr())
+		{
+			return false;
+		}
+		if (!Match(")"))
+		{
+			Error = "Missing )";
+			return false;
+		}
+		return true;
+	}
+
+	if (*Pos == '$' || isdigit((unsigned char)*Pos))
+	{
+		char* end;
+		long value;
+		if (*Pos == '$')
+		{
+			value = strtol(Pos + 1, &end, 16);
+		}
+		else if (Pos[0] == '0' && (Pos[1] == 'x' || Pos[1] == 'X'))
+		{
+			value = strtol(Pos + 2, &end, 16);
+		}
+		else
+		{
+			value = strtol(Pos, &end, 10);
+		}
+		if (end == Pos || (end == Pos + 1 && *Pos == '$'))
+		{
+			Error = "Bad number";
+			return false;
+		}
+		Pos = end;
+		Emit(OpNumber, (int)value);
+		return true;
+	}
+
+	static const char* Names[] = { "VALUE", "ADDR", "PC", "A", "X", "Y", "S", "P" };
+	static const int Kinds[] = { OpValue, OpAddress, OpPC, OpA, OpX, OpY, OpS, OpP };
+	for (int i = 0; i < 8; i++)
+	{
+		size_t length = strlen(Names[i]);
+		if (strncmp(Pos, Names[i], length) == 0 && !isalnum((unsigned char)Pos[length]))
+		{
+			Pos += length;
+			Emit(Kinds[i]);
+			return true;
+		}
+	}
+	Error = "Expected a number, register, ADDR or VALUE";
+	return false;
+}
+
+int DebugCondition::Evaluate(const CpuRegisters& Regs, int Address, int Value) const
+{
+	if (Code.empty())
+	{
+		return 1;
+	}
+	int stack[64];
+	int depth = 0;
+	for (size_t i = 0; i < Code.size(); i++)
+	{
+		const Op& op = Code[i];
+		if (op.Kind <= OpValue)
+		{
+			if (depth == 64)
+			{
+				return 0; // Only a very deeply nested condition gets here.
+			}
+			int value = 0;
+			switch (op.Kind)
+			{
+			case OpNumber: value = op.Value; break;
+			case OpA: value = Regs.A; break;
+			case OpX: value = Regs.X; break;
+			case OpY: value = Regs.Y; break;
+			case OpS: value = Regs.S; break;
+			case OpP: value = Regs.P; break;
+			case OpPC: value = Regs.PC; break;
+			case OpAddress: value = Address; break;
+			case OpValue: value = Value; break;
+			}
+			stack[depth++] = value;
+			continue;
+		}
+		if (op.Kind == OpNot)
+		{
+			stack[depth - 1] = !stack[depth - 1];
+			continue;
+		}
+		int right = stack[--depth];
+		int left = stack[depth - 1];
+		int result = 0;
+		switch (op.Kind)
+		{
+		case OpOr: result = left || right; break;
+		case OpAnd: result = left && right; break;
+		case OpEqual: result = left == right; break;
+		case OpNotEqual: result = left != right; break;
+		case OpLess: result = left < right; break;
+		case OpLessEqual: result = left <= right; break;
+		case OpGreater: result = left > right; break;
+		case OpGreaterEqual: result = left >= right; break;
+		case OpBitAnd: result = left & right; break;
+		case OpBitOr: result = left | right; break;
+		case OpBitXor: result = left ^ right; break;
+		}
+		stack[depth - 1] = result;
+	}
+	return depth > 0 ? stack[depth - 1] : 1;
+}
+
+Debugger::Debugger()
+{
+	Target = NULL;
+	NextId = 1;
+	Stopped = false;
+	StopKind = DebugStopRequest;
+	StopId = -1;
+	StopAddress = 0;
+	StopValue = 0;
+	StopPC = 0;
+	PendingStop = false;
+	ResumePC = -1;
+	StepsLeft = 0;
+	CbStop = NULL;
+	CbContext = NULL;
+	memset(PcMap, 0, sizeof(PcMap));
+}
+
+Debugger::~Debugger()
+{
+	Detach();
+}
+
+void Debugger::Attach(Emulation* Machine)
+{
+	Detach();
+	Target = Machine;
+	Target->AttachDebugger(this);
+	RebuildMaps();
+}
+
+void Debugger::Detach()
+{
+	if (Target == NULL)
+	{
+		return;
+	}
+	for (int i = 0; i < 256; i++)
+	{
+		Target->SystemMemory.PageFlags[i] &= ~(Memory::PAGE_WATCH_READ | Memory::PAGE_WATCH_WRITE);
+	}
+	Target->AttachDebugger(NULL);
+	Target = NULL;
+	Stopped = false;
+	PendingStop = false;
+}
+
+int Debugger::AddBreakpoint(int Address, const char* Condition)
+{
+	return AddWatchpoint(Address, Address, DebugBreak, Condition);
+}
+
+int Debugger::AddWatchpoint(int Start, int End, int Kinds, const char* Condition)
+{
+	DebugPoint point;
+	if (!point.Condition.Compile(Condition))
+	{
+		printf("Debugger: %s in condition \"%s\"\n", point.Condition.Error, Condition);
+		return -1;
+	}
+	point.Id = NextId++;
+	point.Kind = Kinds;
+	point.Start = Start & 0xFFFF;
+	point.End = End < Start ? point.Start : End & 0xFFFF;
+	point.Hits = 0;
+	PointList.push_back(point);
+	RebuildMaps();
+	return point.Id;
+}
+
+bool Debugger::Remove(int Id)
+{
+	for (size_t i = 0; i < PointList.size(); i++)
+	{
+		if (PointList[i].Id == Id)
+		{
+			PointList.erase(PointList.begin() + i);
+			RebuildMaps();
+			return true;
+		}
+	}
+	return false;
+}
+
+void Debugger::RemoveAll()
+{
+	PointList.clear();
+	RebuildMaps();
+}
+
+// Set the PC bitmap and the watch flags of the pages in the memory map from the point list.
+void Debugger::RebuildMaps()
+{
+	memset(PcMap, 0, sizeof(PcMap));
+	unsigned char pageFlags[256];
+	memset(pageFlags, 0, sizeof(pageFlags));
+	for (size_t i = 0; i < PointList.size(); i++)
+	{
+		const DebugPoint& point = PointList[i];
+		for (int address = point.Start; address <= point.End; address++)
+		{
+			if (point.Kind & DebugBreak)
+			{
+				PcMap[address >> 3] |= (unsigned char)(1 << (address & 7));
+			}
+			if (point.Kind & DebugWatchRead)
+			{
+				pageFlags[address >> 8] |= Memory::PAGE_WATCH_READ;
+			}
+			if (point.Kind & DebugWatchWrite)
+			{
+				pageFlags[address >> 8] |= Memory::PAGE_WATCH_WRITE;
+			}
+		}
+	}
+	if (Target != NULL)
+	{
+		unsigned char* flags = Target->SystemMemory.PageFlags;
+		for (int i = 0; i < 256; i++)
+		{
+			flags[i] = (flags[i] & ~(Memory::PAGE_WATCH_READ | Memory::PAGE_WATCH_WRITE)) | pageFlags[i];
+		}
+	}
+}
+
+void Debugger::Stop()
+{
+	if (!Stopped)
+	{
+		RecordStop(DebugStopRequest, -1, 0, 0);
+	}
+}
+
+void Debugger::Continue()
+{
+	StepsLeft = 0;
+	Stopped = false;
+	PendingStop = false;
+	ResumePC = Target != NULL ? Target->SystemCpu.NextPC() : -1;
+}
+
+void Debugger::StepInstruction(int Count)
+{
+	Continue();
+	StepsLeft = Count;
+}
+
+void Debugger::RecordStop(int Kind, int Id, int Address, int Value)
+{
+	PendingStop = true;
+	StopKind = Kind;
+	StopId = Id;
+	StopAddress = Address;
+	StopValue = Value;
+}
+
+void Debugger::EnterStop()
+{
+	PendingStop = false;
+	Stopped = true;
+	StopPC = Target->SystemCpu.NextPC();
+	if (CbStop != NULL)
+	{
+		CbStop(this, CbContext);
+	}
+	else
+	{
+		PrintState();
+	}
+}
+
+bool Debugger::BeforeInstruction(unsigned short PC)
+{
+	if (Stopped)
+	{
+		return false;
+	}
+	if (PendingStop)
+	{
+		EnterStop();
+		return false;
+	}
+	if ((PcMap[PC >> 3] & (1 << (PC & 7))) != 0 && PC != ResumePC)
+	{
+		CpuRegisters regs;
+		Target->SystemCpu.GetRegisters(regs);
+		for (size_t i = 0; i < PointList.size(); i++)
+		{
+			DebugPoint& point = PointList[i];
+			if ((point.Kind & DebugBreak) && PC >= point.Start && PC <= point.End && point.Condition.Evaluate(regs, PC, 0))
+			{
+				point.Hits++;
+				RecordStop(DebugBreak, point.Id, PC, 0);
+				EnterStop();
+				return false;
+			}
+		}
+	}
+	ResumePC = -1;
+	if (StepsLeft > 0 && --StepsLeft == 0)
+	{
+		RecordStop(DebugStopRequest, -1, 0, 0);
+	}
+	return true;
+}
+
+void Debugger::CheckAccess(int Kind, int Address, unsigned char Value)
+{
+	if (PendingStop || Stopped)
+	{
+		return;
+	}
+	CpuRegisters regs;
+	Target->SystemCpu.GetRegisters(regs);
+	regs.PC = Target->SystemCpu.InstructionPC();
+	for (size_t i = 0; i < PointList.size(); i++)
+	{
+		DebugPoint& point = PointList[i];
+		if ((point.Kind & Kind) && Address >= point.Start && Address <= point.End && point.Condition.Evaluate(regs, Address, Value))
+		{
+			point.Hits++;
+			RecordStop(Kind, point.Id, Address, Value);
+			return;
+		}
+	}
+}
+
+void Debugger::PrintState()
+{
+	CpuRegisters regs;
+	Target->SystemCpu.GetRegisters(regs);
+	switch (StopKind)
+	{
+	case DebugBreak:
+		printf("Debugger: breakpoint %d at $%04X", StopId, StopAddress);
+		break;
+	case DebugWatchRead:
+		printf("Debugger: watchpoint %d, read $%02X from $%04X", StopId, StopValue, StopAddress);
+		break;
+	case DebugWatchWrite:
+		printf("Debugger: watchpoint %d, wrote $%02X to $%04X", StopId, StopValue, StopAddress);
+		break;
+	default:
+		printf("Debugger: stopped");
+		break;
+	}
+	printf(" (cycle %lld)\n", Target->SystemCpu.Cycle);
+	printf("  PC=%04X A=%02X X=%02X Y=%02X S=%02X P=%02X\n", regs.PC, regs.A, regs.X, regs.Y, regs.S, regs.P);
+}
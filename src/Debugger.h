@@ -0,0 +1,139 @@
+#ifndef _DEBUGGER_H
+#define _DEBUGGER_H
+
+#include "Cpu.h"
+#include <string>
+#include <vector>
+
+class Emulation;
+class Debugger;
+
+// Function pointer type for debugger callbacks.
+typedef void (*FnPtrDebuggerCallback)(Debugger* Source, void* Context);
+
+// Condition on a breakpoint or watchpoint, e.g. "A == $10 && (X > 3 || VALUE & $80)".
+// Names: A X Y S P PC, ADDR (address accessed) and VALUE (value read or written). Numbers are decimal, or hex with
+// $ or 0x. Operators, loosest first: || && (== != < <= > >=) (& | ^) !, and parentheses.
+// Compiled once to postfix, so evaluating it at a hit is cheap.
+class DebugCondition
+{
+public:
+	DebugCondition();
+
+	// Returns false on a syntax error, with Error set. An empty condition is always true.
+	bool Compile(const char* Text);
+	bool Empty() const { return Code.empty(); }
+	int Evaluate(const CpuRegisters& Regs, int Address, int Value) const;
+
+	std::string Text;
+	const char* Error;
+
+protected:
+	enum OpKinds
+	{
+		OpNumber, OpA, OpX, OpY, OpS, OpP, OpPC, OpAddress, OpValue,
+		OpOr, OpAnd, OpEqual, OpNotEqual, OpLess, OpLessEqual, OpGreater, OpGreaterEqual,
+		OpBitAnd, OpBitOr, OpBitXor, OpNot
+	};
+	struct Op
+	{
+		int Kind;
+		int Value;
+	};
+	std::vector<Op> Code;
+
+	const char* Pos;
+	void SkipSpaces();
+	bool Match(const char* Token);
+	bool ParseOr();
+	bool ParseAnd();
+	bool ParseCompare();
+	bool ParseBits();
+	bool ParseUnary();
+	bool ParsePrimary();
+	void Emit(int Kind, int Value = 0);
+};
+
+// Kinds of debug points, also the reason for a stop.
+enum DebugPointKind
+{
+	DebugStopRequest = 0, // Stop or single step requested
+	DebugBreak = 1,
+	DebugWatchRead = 2,
+	DebugWatchWrite = 4
+};
+
+struct DebugPoint
+{
+	int Id;
+	int Kind; // DebugBreak, or DebugWatchRead and/or DebugWatchWrite
+	int Start, End; // Address range, inclusive
+	DebugCondition Condition;
+	long long Hits;
+};
+
+// Breakpoints and watchpoints for one machine.
+// A machine without a debugger attached pays one pointer test per instruction. With one attached, breakpoints
+// are found through a bitmap with a bit per address, and watchpoints set flag bits on their pages in the memory
+// map, so only accesses to those pages go further than a flag test.
+// A hit stops the CPU between instructions (a watchpoint lets the accessing instruction finish), and
+// Emulation::RunCycles returns early. The machine stays stopped, with its state untouched, until Continue or
+// StepInstruction.
+class Debugger
+{
+public:
+	Debugger();
+	~Debugger();
+
+	void Attach(Emulation* Machine);
+	void Detach();
+	Emulation* Target;
+
+	// Add a point, with an optional condition (NULL or empty for none). Returns the id, or -1 if the condition
+	// didn't compile.
+	int AddBreakpoint(int Address, const char* Condition);
+	int AddWatchpoint(int Start, int End, int Kinds, const char* Condition);
+	bool Remove(int Id);
+	void RemoveAll();
+	const std::vector<DebugPoint>& Points() { return PointList; }
+
+	// Stop before the next instruction.
+	void Stop();
+	// Leave the stop. A breakpoint at the stop address doesn't hit again until the CPU has moved off it.
+	void Continue();
+	// Run a number of instructions, then stop again.
+	void StepInstruction(int Count);
+
+	bool Stopped;
+	int StopKind; // DebugPointKind
+	int StopId; // Point that hit, -1 for a requested stop
+	int StopAddress; // Breakpoint or accessed address
+	int StopValue; // Value read or written
+	unsigned short StopPC;
+
+	void PrintState();
+
+	// Called when the machine stops. Prints the state if not set.
+	FnPtrDebuggerCallback CbStop;
+	void* CbContext;
+
+	// Hooks for Cpu::Step and the Memory watch page flags.
+	bool BeforeInstruction(unsigned short PC);
+	void CheckAccess(int Kind, int Address, unsigned char Value);
+
+protected:
+	std::vector<DebugPoint> PointList;
+	int NextId;
+
+	unsigned char PcMap[65536 / 8];
+
+	bool PendingStop;
+	int ResumePC;
+	int StepsLeft;
+
+	void RebuildMaps();
+	void EnterStop();
+	void RecordStop(int Kind, int Id, int Address, int Value);
+};
+
+#endif
@@ -1,18 +1,116 @@
 #include "Emulation.h"
+#include <cstdio>
 
 
 Emulation::Emulation() : SystemCpu(), SystemMemory(), SystemVideo(), SystemKeyboard()
+{
+	AttachedDebugger = nullptr;
+	Connect();
+
+	Hibernated = false;
+	IdleSkipEnabled = true;
+	IdleCyclesSkipped = 0;
+	StopPC = -1;
+
+	SetModel(MachinePAL);
+}
+
+Emulation::Emulation(const Emulation& Parent) : SystemVideo(Parent.SystemVideo), SystemMemory(Parent.SystemMemory), SystemCpu(Parent.SystemCpu), SystemKeyboard(Parent.SystemKeyboard), SystemSid(Parent.SystemSid), SystemControlPorts(Parent.SystemControlPorts)
+{
+	AttachedDebugger = nullptr;
+	Connect();
+	CopyEventState(Parent);
+
+	// Buffers are allocated when the fork first runs.
+	Hibernated = true;
+}
+
+void Emulation::CopyEventState(const Emulation& Source)
+{
+	Model = Source.Model;
+	IdleSkipEnabled = Source.IdleSkipEnabled;
+	IdleCyclesSkipped = Source.IdleCyclesSkipped;
+	StopPC = Source.StopPC;
+	NextCallbackTime = Source.NextCallbackTime;
+
+	// The chips' event requests were copied along with them, so each queued request of the source has a twin at the
+	// same offset in this object.
+	QueuedRequests.clear();
+	for (std::list<EventRequest*>::const_iterator i = Source.QueuedRequests.begin(); i != Source.QueuedRequests.end(); i++)
+	{
+		ptrdiff_t offset = (const char*)(*i) - (const char*)&Source;
+		if (offset < 0 || offset >= (ptrdiff_t)sizeof(Emulation))
+		{
+			printf("Event request outside of the machine, not copied\n");
+			continue;
+		}
+		QueuedRequests.push_back((EventRequest*)((char*)this + offset));
+	}
+}
+
+void Emulation::RestoreFrom(Emulation& Snapshot)
+{
+	if (Hibernated)
+	{
+		Resume();
+	}
+	if (!Snapshot.HibernatedRam.Empty())
+	{
+		// RAM is compressed, bring it back so it can be shared.
+		Snapshot.Resume();
+	}
+
+	unsigned char* coverage = SystemCpu.CoverageMap;
+	SystemVideo.CopyState(Snapshot.SystemVideo);
+	SystemMemory.CopyState(Snapshot.SystemMemory);
+	SystemCpu = Snapshot.SystemCpu;
+	SystemCpu.CoverageMap = coverage;
+	SystemKeyboard = Snapshot.SystemKeyboard;
+	SystemControlPorts = Snapshot.SystemControlPorts;
+	SystemSid.CopyState(Snapshot.SystemSid);
+	Snapshot.SystemMemory.ShareRam(SystemMemory);
+	Connect();
+	CopyEventState(Snapshot);
+}
+
+void Emulation::Connect()
 {
 	// connect
 	SystemVideo.AttachedCpu = &SystemCpu;
 	SystemVideo.AttachedMemory = &SystemMemory;
+	SystemVideo.AttachedEmulation = this;
 	SystemMemory.AttachedVideo = &SystemVideo;
 	SystemMemory.AttachedCpu = &SystemCpu;
 	SystemMemory.AttachedKeyboard = &SystemKeyboard;
+	SystemMemory.AttachedSid = &SystemSid;
 	SystemMemory.AttachedEmulation = this;
 	SystemCpu.AttachedMemory = &SystemMemory;
+	SystemSid.AttachedCpu = &SystemCpu;
+	SystemSid.AttachedControlPorts = &SystemControlPorts;
+	SystemMemory.AttachedControlPorts = &SystemControlPorts;
+	SystemKeyboard.Setup(this);
+	SystemCpu.AttachedDebugger = AttachedDebugger;
+	SystemMemory.AttachedDebugger = AttachedDebugger;
+}
 
-	Reset();
+void Emulation::AttachDebugger(Debugger* Target)
+{
+	AttachedDebugger = Target;
+	Connect();
+}
+
+Emulation* Emulation::Fork()
+{
+	if (!HibernatedRam.Empty())
+	{
+		// RAM is compressed, bring it back so it can be shared.
+		Resume();
+	}
+	std::shared_ptr<const RamSnapshot> frame = SystemVideo.ShareFrame();
+	Emulation* fork = new Emulation(*this);
+	SystemMemory.ShareRam(fork->SystemMemory);
+	fork->SystemVideo.HibernatedFrame = frame;
+	return fork;
 }
 
 
@@ -23,18 +121,47 @@ Emulation::~Emulation()
 
 void Emulation::Reset()
 {
+	// Reset event system.
+	for (std::list<EventRequest*>::iterator i = QueuedRequests.begin(); i != QueuedRequests.end(); i++)
+	{
+		(*i)->Queued = false;
+	}
+	QueuedRequests.clear();
+	NextCallbackTime = 0;
+
+	SystemKeyboard.CancelTyping();
 	SystemMemory.Reset();
 	SystemVideo.Reset();
+	SystemSid.Reset();
+	SystemControlPorts.Reset();
 	// Reset CPU last, it loads from memory.
 	SystemCpu.Reset();
 
-	// Reset event system.
-	QueuedRequests.clear();
-	NextCallbackTime = 0;
+	// Components with periodic events queue them once the cycle counter is back at 0.
+	SystemVideo.ScheduleEvents();
+}
+
+void Emulation::SetModel(MachineModelType Type)
+{
+	if (Hibernated)
+	{
+		Resume();
+	}
+	Model = GetMachineModel(Type);
+	SystemVideo.SetModel(Model);
+	SystemMemory.CIA1.CpuClockHz = SystemMemory.CIA2.CpuClockHz = Model->CpuClockHz;
+	SystemMemory.CIA1.MainsHz = SystemMemory.CIA2.MainsHz = Model->MainsHz;
+	// The SID clock is set by the frontend along with the host sample rate.
+	Reset();
 }
 
 void Emulation::RunCycles(int CycleCount)
 {
+	if (Hibernated)
+	{
+		Resume();
+	}
+
 	long long targetCycle = SystemCpu.Cycle + CycleCount;
 	while (SystemCpu.Cycle < targetCycle)
 	{
@@ -46,12 +173,91 @@ void Emulation::RunCycles(int CycleCount)
 		bool success = SystemCpu.Step();
 		if (!success)
 		{
-			return;
+			break;
+		}
+		if (SystemCpu.NextPC() == StopPC)
+		{
+			SystemVideo.VideoStep();
+			break;
+		}
+		if (SystemCpu.IdleLoopCycles > 0)
+		{
+			SkipIdleLoop(targetCycle);
 		}
 
 		SystemVideo.VideoStep();
 	}
 
+	// Audio is synthesized in one block for everything that happened in this run.
+	SystemSid.Synthesize(SystemCpu.Cycle);
+}
+
+SharedRamImage Emulation::ReferenceImage;
+
+void Emulation::SetReferenceImage(const unsigned char* Ram)
+{
+	ReferenceImage = std::make_shared<const std::vector<unsigned char> >(Ram, Ram + 65536);
+}
+
+void Emulation::Hibernate()
+{
+	if (Hibernated)
+	{
+		return;
+	}
+	std::vector<unsigned char> ram(65536);
+	SystemMemory.SaveRam(&ram[0]);
+	HibernatedRam.Capture(&ram[0], ram.size(), ReferenceImage);
+	SystemMemory.ReleaseRam();
+	SystemVideo.Hibernate();
+	SystemSid.ReleaseBuffers();
+	Hibernated = true;
+}
+
+void Emulation::Resume()
+{
+	if (!Hibernated)
+	{
+		return;
+	}
+	if (!HibernatedRam.Empty())
+	{
+		// A fork starts hibernated with its RAM in place.
+		std::vector<unsigned char> ram(65536);
+		HibernatedRam.Restore(&ram[0]);
+		HibernatedRam.Clear();
+		SystemMemory.AllocateRam();
+		SystemMemory.LoadRam(&ram[0]);
+	}
+	SystemVideo.Resume();
+	SystemSid.AllocateBuffers();
+	Hibernated = false;
+}
+
+void Emulation::SkipIdleLoop(long long TargetCycle)
+{
+	// The CPU is at the top of a loop that repeats exactly until an interrupt. Interrupts only come from events
+	// (and from the VIC while drawing, which limits the skip to a line), so whole iterations can be skipped up to
+	// the next event. Video catches up on the skipped cycles in VideoStep, as after any instruction.
+	long long period = SystemCpu.IdleLoopCycles;
+	SystemCpu.IdleLoopCycles = 0;
+	if (!IdleSkipEnabled || SystemCpu.InterruptPending())
+	{
+		return;
+	}
+
+	long long limit = NextCallbackTime < TargetCycle ? NextCallbackTime : TargetCycle;
+	long long videoLimit = SystemVideo.IdleSkipLimit(SystemCpu.Cycle);
+	if (videoLimit < limit)
+	{
+		limit = videoLimit;
+	}
+	long long iterations = (limit - SystemCpu.Cycle) / period;
+	if (iterations > 0)
+	{
+		SystemCpu.Cycle += iterations * period;
+		IdleCyclesSkipped += iterations * period;
+	}
 }
 
 void Emulation::SetupRendering(SDL_Window* Target)
@@ -76,6 +282,7 @@ void Emulation::QueueEvent(long long CallbackTime, EventRequest* Request)
 		// Remove the request first if it's already in the queue.
 		QueuedRequests.remove(Request);
 	}
+	Request->CallbackTime = CallbackTime;
 
 	// Insert the request in sorted order into the list of requests - so the earliest events will fire first.
 	std::list<EventRequest*>::iterator i;
@@ -90,7 +297,6 @@ void Emulation::QueueEvent(long long CallbackTime, EventRequest* Request)
 	QueuedRequests.insert(i, Request);
 
 	Request->Queued = true;
-	Request->CallbackTime = CallbackTime;
 
 	SetNextCallbackTime();
 }
@@ -7,6 +7,11 @@
 #include "Memory.h"
 #include "Cpu.h"
 #include "Keyboard.h"
+#include "Sid.h"
+#include "ControlPorts.h"
+#include "Snapshot.h"
+
+class Debugger;
 
 #include <list>
 
@@ -19,14 +24,52 @@ public:
 	void Reset();
 	void RunCycles(int CycleCount);
 
+	// Select PAL or NTSC timing for all of the chips, then reset.
+	void SetModel(MachineModelType Type);
+	const MachineModel* Model;
+
 	void SetupRendering(SDL_Window* Target);
 	void TeardownRendering();
 	void UpdateVideo();
 
+	// Hibernation, for idle instances. RAM and the frame are compressed into snapshots, and RAM, frame buffers and SID buffers
+	// are freed. The rest of the machine state is small and stays in place. RunCycles resumes automatically.
+	void Hibernate();
+	void Resume();
+	bool IsHibernated() { return Hibernated; }
+	size_t HibernatedSize() { return HibernatedRam.Size() + (SystemVideo.HibernatedFrame ? SystemVideo.HibernatedFrame->Size() : 0); }
+
+	// Clone this machine for exploring several inputs from one state. RAM pages are shared copy-on-write, so only
+	// pages either side writes to are copied, and the rest of the state is small. The fork starts hibernated
+	// (without frame or audio buffers) until it first runs, so many forks can be held at once. Delete when done.
+	Emulation* Fork();
+
+	// Return to the state of another machine (typically a fork kept as a snapshot), sharing its RAM pages the same
+	// way. Unlike Fork, this machine's buffers are kept, which makes it the fast way to reset for repeated runs.
+	// The frame buffer contents aren't restored.
+	void RestoreFrom(Emulation& Snapshot);
+
+	// RAM pages that match the reference image take no space in a hibernated instance. Typically set once to the
+	// RAM of a freshly booted machine, and shared by all instances.
+	static void SetReferenceImage(const unsigned char* Ram);
+
+	// Skip ahead when the CPU is spinning in a loop that can only be left through an interrupt.
+	bool IdleSkipEnabled;
+	long long IdleCyclesSkipped;
+
+	// RunCycles returns early when the CPU reaches this address, -1 for none.
+	int StopPC;
+
+	// Set by Debugger::Attach. Forks and restores don't take the debugger along.
+	void AttachDebugger(Debugger* Target);
+	Debugger* AttachedDebugger;
+
 	Video SystemVideo;
 	Memory SystemMemory;
 	Cpu SystemCpu;
 	Keyboard SystemKeyboard;
+	Sid SystemSid;
+	ControlPorts SystemControlPorts;
 
 	// Request a callback at a certain cycle time
 	void QueueEvent(long long CallbackTime, EventRequest* Request);
@@ -34,10 +77,20 @@ public:
 	void CancelEvent(EventRequest* Request);
 
 protected:
+	// Used by Fork, copies everything except RAM.
+	Emulation(const Emulation& Parent);
+
 	long long NextCallbackTime;
 	std::list<EventRequest*> QueuedRequests;
+	void Connect();
+	void CopyEventState(const Emulation& Source);
 	void HandleCallbacks();
 	void SetNextCallbackTime();
+	void SkipIdleLoop(long long TargetCycle);
+
+	bool Hibernated;
+	RamSnapshot HibernatedRam;
+	static SharedRamImage ReferenceImage;
 };
 
 
@@ -14,6 +14,7 @@ public:
 	{
 		Callback = CallbackFunction;
 		Context = CallbackContext;
+		Queued = false;
 	}
 
 	long long CallbackTime; // Cycle to callback on.
@@ -0,0 +1,230 @@
+#include "FramePresenter.h"
+#include <cstdio>
+#include <cstring>
+
+FramePresenter::FramePresenter() : Quit(false), MiddleSlot(0)
+{
+	AttachedWindow = NULL;
+	Renderer = NULL;
+	Screen = NULL;
+	Thread = NULL;
+	FrameReady = NULL;
+	Width = Height = 0;
+	for (int i = 0; i < 3; i++)
+	{
+		Slots[i] = NULL;
+	}
+	WriteSlot = ReadSlot = 0;
+	DirtyRows = NULL;
+	DirtyWords = 0;
+}
+
+FramePresenter::~FramePresenter()
+{
+	Stop();
+}
+
+bool FramePresenter::Start(SDL_Window* Window, int FrameWidth, int FrameHeight)
+{
+	Stop();
+
+	AttachedWindow = Window;
+	Width = FrameWidth;
+	Height = FrameHeight;
+	for (int i = 0; i < 3; i++)
+	{
+		Slots[i] = new unsigned int[Width * Height];
+		memset(Slots[i], 0, Width * Height * sizeof(unsigned int));
+	}
+	WriteSlot = 0;
+	MiddleSlot = 1;
+	ReadSlot = 2;
+
+	DirtyWords = (Height + 31) / 32;
+	DirtyRows = new std::atomic<unsigned int>[DirtyWords];
+	for (int i = 0; i < DirtyWords; i++)
+	{
+		DirtyRows[i] = 0;
+	}
+
+	Quit = false;
+	FrameReady = SDL_CreateSemaphore(0);
+	Thread = SDL_CreateThread(ThreadMain, "Present", this);
+	if (Thread == NULL)
+	{
+		printf("Unable to start present thread: %s\n", SDL_GetError());
+		Stop();
+		return false;
+	}
+	return true;
+}
+
+void FramePresenter::Stop()
+{
+	if (Thread != NULL)
+	{
+		Quit = true;
+		SDL_SemPost(FrameReady);
+		SDL_WaitThread(Thread, NULL);
+		Thread = NULL;
+	}
+	if (FrameReady != NULL)
+	{
+		SDL_DestroySemaphore(FrameReady);
+		FrameReady = NULL;
+	}
+	for (int i = 0; i < 3; i++)
+	{
+		delete[] Slots[i];
+		Slots[i] = NULL;
+	}
+	delete[] DirtyRows;
+	DirtyRows = NULL;
+	DirtyWords = 0;
+}
+
+bool FramePresenter::IsRunning()
+{
+	return Thread != NULL;
+}
+
+void FramePresenter::Publish(const unsigned int* Pixels, const bool* DirtyLines)
+{
+	if (Thread == NULL)
+	{
+		return;
+	}
+
+	memcpy(Slots[WriteSlot], Pixels, Width * Height * sizeof(unsigned int));
+	WriteSlot = MiddleSlot.exchange(WriteSlot | FreshFrame) & 3;
+
+	for (int w = 0; w < DirtyWords; w++)
+	{
+		unsigned int bits = 0;
+		for (int b = 0; b < 32 && w * 32 + b < Height; b++)
+		{
+			if (DirtyLines[w * 32 + b])
+			{
+				bits |= 1u << b;
+			}
+		}
+		if (bits)
+		{
+			DirtyRows[w].fetch_or(bits);
+		}
+	}
+	SDL_SemPost(FrameReady);
+}
+
+int FramePresenter::ThreadMain(void* Context)
+{
+	((FramePresenter*)Context)->PresentLoop();
+	return 0;
+}
+
+void FramePresenter::PresentLoop()
+{
+	Renderer = SDL_CreateRenderer(AttachedWindow, -1, SDL_RENDERER_ACCELERATED);
+	if (Renderer == NULL)
+	{
+		printf("SDL_CreateRenderer Error. %s\n", SDL_GetError());
+		return;
+	}
+	Screen = SDL_CreateTexture(Renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, Width, Height);
+
+	unsigned int* rows = new unsigned int[DirtyWords];
+	while (!Quit)
+	{
+		SDL_SemWaitTimeout(FrameReady, 100);
+		if (Quit)
+		{
+			break;
+		}
+
+		// Take the dirty rows first, then the newest frame. Rows flagged after this are picked up next time.
+		bool any = false;
+		for (int w = 0; w < DirtyWords; w++)
+		{
+			rows[w] = DirtyRows[w].exchange(0);
+			any |= (rows[w] != 0);
+		}
+		if (!any)
+		{
+			continue;
+		}
+		if (MiddleSlot.load() & FreshFrame)
+		{
+			ReadSlot = MiddleSlot.exchange(ReadSlot) & 3;
+		}
+		PresentFrame(rows);
+	}
+	delete[] rows;
+
+	SDL_DestroyTexture(Screen);
+	SDL_DestroyRenderer(Renderer);
+	Screen = NULL;
+	Renderer = NULL;
+}
+
+void FramePresenter::PresentFrame(const unsigned int* Rows)
+{
+	// copy changed rows of the frame into the texture, one upload per run of dirty rows
+	const unsigned int* pixels = Slots[ReadSlot];
+	int y = 0;
+	while (y < Height)
+	{
+		if ((Rows[y >> 5] & (1u << (y & 31))) == 0)
+		{
+			y++;
+			continue;
+		}
+		int first = y;
+		while (y < Height && (Rows[y >> 5] & (1u << (y & 31))) != 0)
+		{
+			y++;
+		}
+
+		SDL_Rect rect;
+		rect.x = 0;
+		rect.y = first;
+		rect.w = Width;
+		rect.h = y - first;
+		if (0 != SDL_UpdateTexture(Screen, &rect, pixels + first * Width, Width * 4))
+		{
+			printf("SDL_UpdateTexture Error. %s\n", SDL_GetError());
+		}
+	}
+
+	// Draw texture to screen
+	SDL_RenderClear(Renderer);
+
+	SDL_Rect srcRect, screenRect;
+	srcRect.x = srcRect.y = 0;
+	srcRect.w = Width;
+	srcRect.h = Height;
+
+	screenRect.x = 0;
+	screenRect.y = 0;
+	screenRect.w = 800;
+	screenRect.h = 600;
+
+	if (0 != SDL_RenderCopy(Renderer, Screen, &srcRect, &screenRect))
+	{
+		printf("SDL_RenderCopy Error. %s\n", SDL_GetError());
+	}
+	SDL_RenderPresent(Renderer);
+}
+
+void FramePresenter::DumpRendererInfo()
+{
+	// For diagnostic purposes. Not currently active.
+
+	SDL_RendererInfo info;
+	SDL_GetRendererInfo(Renderer, &info);
+	printf("Renderer name: %s\n", info.name);
+	for (int i = 0; i < info.num_texture_formats; i++)
+	{
+		printf("  %s\n", SDL_GetPixelFormatName(info.texture_formats[i]));
+	}
+
+}
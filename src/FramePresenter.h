@@ -0,0 +1,55 @@
+#ifndef _FRAMEPRESENTER_H
+#define _FRAMEPRESENTER_H
+
+#include "c64emu.h"
+#include <atomic>
+
+// Uploads and presents frames on its own thread, so a slow upload or vsync never stalls the emulation.
+// Frames are handed over through 3 buffers: the emulation thread fills one, the present thread reads another,
+// and the third holds the latest completed frame. Handing over is an atomic swap with the middle buffer, and
+// neither side ever waits for the other.
+class FramePresenter
+{
+public:
+	FramePresenter();
+	~FramePresenter();
+
+	// Start the present thread. It creates the renderer, as SDL renderers belong to the thread that made them.
+	bool Start(SDL_Window* Window, int FrameWidth, int FrameHeight);
+	void Stop();
+	bool IsRunning();
+
+	// Emulation thread side: copy a completed frame and hand it to the present thread.
+	// DirtyLines flags the rows that changed since the last published frame.
+	void Publish(const unsigned int* Pixels, const bool* DirtyLines);
+
+	void DumpRendererInfo();
+
+protected:
+	static int ThreadMain(void* Context);
+	void PresentLoop();
+	void PresentFrame(const unsigned int* Rows);
+
+	SDL_Window* AttachedWindow;
+	SDL_Renderer* Renderer;
+	SDL_Texture* Screen;
+	SDL_Thread* Thread;
+	SDL_sem* FrameReady;
+	std::atomic<bool> Quit;
+
+	int Width, Height;
+	unsigned int* Slots[3];
+	int WriteSlot; // Only used by the emulation thread
+	int ReadSlot; // Only used by the present thread
+	std::atomic<int> MiddleSlot; // Slot index, plus FreshFrame if it was published since the present thread last took it
+
+	// Rows changed in published frames that haven't been uploaded yet, a bit per row.
+	// They are set after the frame is published and taken before the present thread swaps, so a row flagged
+	// here is always up to date in the frame that gets uploaded.
+	std::atomic<unsigned int>* DirtyRows;
+	int DirtyWords;
+
+	static const int FreshFrame = 4;
+};
+
+#endif
@@ -0,0 +1,428 @@
+#include "FrameSink.h"
+#include "Video.h"
+#include "Cpu.h"
+#include <cstdio>
+#include <cstring>
+
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+static const int FrameSinkVersion = 1;
+
+FrameSink::FrameSink()
+{
+	Format = FrameSinkIndexed;
+	AttachedVideo = NULL;
+	PipeFd = -1;
+	PipePath = NULL;
+	OwnsPipeFd = false;
+	PendingWritten = 0;
+	SharedName = NULL;
+	SharedBase = NULL;
+	SharedSize = 0;
+	Ring = NULL;
+	FramesWritten = FramesDropped = 0;
+}
+
+FrameSink::~FrameSink()
+{
+	Detach();
+	Close();
+}
+
+void FrameSink::Attach(Video* Source)
+{
+	Detach();
+	AttachedVideo = Source;
+	AttachedVideo->AddFrameListener(FrameCallback, this);
+}
+
+void FrameSink::Detach()
+{
+	if (AttachedVideo != NULL)
+	{
+		AttachedVideo->RemoveFrameListener(FrameCallback, this);
+		AttachedVideo = NULL;
+	}
+}
+
+void FrameSink::FrameCallback(Video* Source, void* Context)
+{
+	((FrameSink*)Context)->WriteFrame(Source);
+}
+
+unsigned int FrameSink::FrameDataSize(Video* Source)
+{
+	int pixels = Source->FrameWidth() * Source->FrameHeight();
+	return Format == FrameSinkArgb ? pixels * 4 : pixels;
+}
+
+void FrameSink::FillFrame(Video* Source, unsigned char* Destination)
+{
+	FrameSinkHeader header;
+	memcpy(header.Magic, "C64F", 4);
+	header.Version = FrameSinkVersion;
+	header.Format = (unsigned short)Format;
+	header.Width = (unsigned short)Source->FrameWidth();
+	header.Height = (unsigned short)Source->FrameHeight();
+	header.DataSize = FrameDataSize(Source);
+	header.FrameNumber = Source->FrameCount;
+	header.Cycle = Source->AttachedCpu->Cycle;
+	memcpy(header.Palette, Source->Model->Palette, sizeof(header.Palette));
+
+	memcpy(Destination, &header, sizeof(header));
+	if (Format == FrameSinkArgb)
+	{
+		memcpy(Destination + sizeof(header), Source->ArgbFrame(), header.DataSize);
+	}
+	else
+	{
+		memcpy(Destination + sizeof(header), Source->IndexedFrame(), header.DataSize);
+	}
+}
+
+bool FrameSink::IsCommandLineOption(const char* Arg)
+{
+	return strcmp(Arg, "--record") == 0 || strcmp(Arg, "--record-shm") == 0 || strcmp(Arg, "--record-format") == 0;
+}
+
+bool FrameSink::OpenFromCommandLine(int argc, char* argv[])
+{
+	const char* path = NULL;
+	const char* shmName = NULL;
+	FrameSinkFormat format = FrameSinkIndexed;
+	for (int i = 0; i + 1 < argc; i++)
+	{
+		if (strcmp(argv[i], "--record") == 0)
+		{
+			path = argv[i + 1];
+		}
+		else if (strcmp(argv[i], "--record-shm") == 0)
+		{
+			shmName = argv[i + 1];
+		}
+		else if (strcmp(argv[i], "--record-format") == 0)
+		{
+			format = strcmp(argv[i + 1], "argb") == 0 ? FrameSinkArgb : FrameSinkIndexed;
+		}
+	}
+
+	if (shmName != NULL)
+	{
+		return OpenSharedMemory(shmName, 8, format);
+	}
+	if (path != NULL)
+	{
+		return OpenPipe(path, format);
+	}
+	return false;
+}
+
+int FrameSink::TakeStdout()
+{
+	static int taken = -1;
+	if (taken < 0)
+	{
+		// Anything already buffered belongs in front of the stream.
+		fflush(stdout);
+#ifdef _WIN32
+		taken = _dup(_fileno(stdout));
+		_setmode(taken, _O_BINARY);
+		_dup2(_fileno(stderr), _fileno(stdout));
+#else
+		taken = dup(1);
+		dup2(2, 1);
+#endif
+		return taken;
+	}
+#ifdef _WIN32
+	return _dup(taken);
+#else
+	return dup(taken);
+#endif
+}
+
+bool FrameSink::CheckStream(FILE* File)
+{
+	long long frames = 0;
+	std::vector<unsigned char> data;
+	FrameSinkHeader header;
+	size_t got;
+	while ((got = fread(&header, 1, sizeof(header), File)) == sizeof(header))
+	{
+		if (memcmp(header.Magic, "C64F", 4) != 0 || header.Version != FrameSinkVersion || header.Format > FrameSinkArgb)
+		{
+			printf("Frame %lld: bad header\n", frames);
+			return false;
+		}
+		unsigned int expected = header.Width * header.Height * (header.Format == FrameSinkArgb ? 4 : 1);
+		if (header.DataSize != expected)
+		{
+			printf("Frame %lld: %u bytes of pixels for %dx%d\n", frames, header.DataSize, header.Width, header.Height);
+			return false;
+		}
+		data.resize(header.DataSize);
+		if (fread(&data[0], 1, header.DataSize, File) != header.DataSize)
+		{
+			printf("Frame %lld: truncated\n", frames);
+			return false;
+		}
+		frames++;
+	}
+	if (got != 0)
+	{
+		printf("Frame %lld: truncated header\n", frames);
+		return false;
+	}
+	printf("Stream OK: %lld frames\n", frames);
+	return true;
+}
+
+int FrameSink::RunCheckCommandLine(int argc, char* argv[])
+{
+	if (argc < 1)
+	{
+		printf("Usage: c64emu --record-check <path|->\n");
+		return 2;
+	}
+	FILE* f = stdin;
+	if (strcmp(argv[0], "-") != 0)
+	{
+		f = fopen(argv[0], "rb");
+		if (f == NULL)
+		{
+			printf("Unable to open %s\n", argv[0]);
+			return 2;
+		}
+	}
+#ifdef _WIN32
+	else
+	{
+		_setmode(_fileno(stdin), _O_BINARY);
+	}
+#endif
+	bool ok = CheckStream(f);
+	if (f != stdin)
+	{
+		fclose(f);
+	}
+	return ok ? 0 : 1;
+}
+
+#ifndef _WIN32
+
+bool FrameSink::OpenPipe(const char* Path, FrameSinkFormat OutputFormat)
+{
+	Close();
+	Format = OutputFormat;
+	PipePath = Path;
+
+	// A reader that goes away should only stop the stream, not the emulator.
+	signal(SIGPIPE, SIG_IGN);
+
+	if (strcmp(Path, "-") == 0)
+	{
+		// Only the private descriptor is made non-blocking, printf goes to stderr and keeps blocking.
+		PipeFd = TakeStdout();
+		OwnsPipeFd = false;
+		fcntl(PipeFd, F_SETFL, fcntl(PipeFd, F_GETFL) | O_NONBLOCK);
+		return true;
+	}
+
+	// Opening a FIFO without a reader fails, it's retried on each frame until a reader shows up.
+	PipeFd = open(Path, O_WRONLY | O_NONBLOCK);
+	OwnsPipeFd = true;
+	if (PipeFd < 0 && errno != ENXIO)
+	{
+		printf("Unable to open frame sink %s: %s\n", Path, strerror(errno));
+		PipePath = NULL;
+		return false;
+	}
+	return true;
+}
+
+bool FrameSink::OpenSharedMemory(const char* Name, int SlotCount, FrameSinkFormat OutputFormat)
+{
+	Close();
+	Format = OutputFormat;
+
+	// Size the slots for the largest frame of any model, so a model change doesn't need a new ring.
+	unsigned int largest = 0;
+	for (int m = 0; m < 2; m++)
+	{
+		const MachineModel* model = GetMachineModel((MachineModelType)m);
+		unsigned int pixels = model->VisibleWidth * model->VisibleLines;
+		if (pixels > largest)
+		{
+			largest = pixels;
+		}
+	}
+	unsigned int slotSize = sizeof(FrameSinkHeader) + largest * (Format == FrameSinkArgb ? 4 : 1);
+	slotSize = (slotSize + 63) & ~63;
+	unsigned int slotOffset = (sizeof(FrameRingHeader) + 63) & ~63;
+
+	int fd = shm_open(Name, O_CREAT | O_RDWR, 0600);
+	if (fd < 0)
+	{
+		printf("Unable to create shared memory %s: %s\n", Name, strerror(errno));
+		return false;
+	}
+	SharedSize = slotOffset + (size_t)slotSize * SlotCount;
+	if (ftruncate(fd, SharedSize) != 0)
+	{
+		printf("Unable to size shared memory %s: %s\n", Name, strerror(errno));
+		close(fd);
+		shm_unlink(Name);
+		return false;
+	}
+	void* base = mmap(NULL, SharedSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED)
+	{
+		printf("Unable to map shared memory %s: %s\n", Name, strerror(errno));
+		shm_unlink(Name);
+		return false;
+	}
+
+	SharedName = Name;
+	SharedBase = (unsigned char*)base;
+	Ring = (FrameRingHeader*)base;
+	memcpy(Ring->Magic, "C64R", 4);
+	Ring->Version = FrameSinkVersion;
+	Ring->SlotCount = SlotCount;
+	Ring->SlotSize = slotSize;
+	Ring->SlotOffset = slotOffset;
+	Ring->Reserved = 0;
+	Ring->ReadCount.store(0);
+	Ring->WriteCount.store(0, std::memory_order_release);
+	return true;
+}
+
+void FrameSink::Close()
+{
+	if (PipeFd >= 0 && OwnsPipeFd)
+	{
+		close(PipeFd);
+	}
+	PipeFd = -1;
+	PipePath = NULL;
+	Pending.clear();
+	PendingWritten = 0;
+
+	if (SharedBase != NULL)
+	{
+		munmap(SharedBase, SharedSize);
+		shm_unlink(SharedName);
+		SharedBase = NULL;
+		Ring = NULL;
+		SharedName = NULL;
+	}
+}
+
+bool FrameSink::FlushPending()
+{
+	while (PendingWritten < Pending.size())
+	{
+		ssize_t written = write(PipeFd, &Pending[PendingWritten], Pending.size() - PendingWritten);
+		if (written < 0)
+		{
+			if (errno == EPIPE && OwnsPipeFd)
+			{
+				// The reader went away. Start over with a whole frame when the next one connects.
+				close(PipeFd);
+				PipeFd = -1;
+				Pending.clear();
+				PendingWritten = 0;
+			}
+			return false;
+		}
+		PendingWritten += written;
+	}
+	Pending.clear();
+	PendingWritten = 0;
+	return true;
+}
+
+void FrameSink::WriteFrame(Video* Source)
+{
+	unsigned int frameSize = sizeof(FrameSinkHeader) + FrameDataSize(Source);
+
+	if (Ring != NULL)
+	{
+		unsigned long long writeCount = Ring->WriteCount.load(std::memory_order_relaxed);
+		unsigned long long readCount = Ring->ReadCount.load(std::memory_order_acquire);
+		if (writeCount - readCount >= Ring->SlotCount || frameSize > Ring->SlotSize)
+		{
+			FramesDropped++;
+			return;
+		}
+		FillFrame(Source, SharedBase + Ring->SlotOffset + (writeCount % Ring->SlotCount) * Ring->SlotSize);
+		Ring->WriteCount.store(writeCount + 1, std::memory_order_release);
+		FramesWritten++;
+		return;
+	}
+
+	if (PipePath == NULL)
+	{
+		return;
+	}
+	if (PipeFd < 0)
+	{
+		PipeFd = open(PipePath, O_WRONLY | O_NONBLOCK);
+		if (PipeFd < 0)
+		{
+			FramesDropped++;
+			return;
+		}
+	}
+	if (!FlushPending())
+	{
+		// Still busy with an earlier frame.
+		FramesDropped++;
+		return;
+	}
+
+	Pending.resize(frameSize);
+	FillFrame(Source, &Pending[0]);
+	PendingWritten = 0;
+	FlushPending();
+	FramesWritten++;
+}
+
+#else
+
+bool FrameSink::OpenPipe(const char* Path, FrameSinkFormat OutputFormat)
+{
+	printf("Frame sinks are not supported on this platform\n");
+	return false;
+}
+
+bool FrameSink::OpenSharedMemory(const char* Name, int SlotCount, FrameSinkFormat OutputFormat)
+{
+	printf("Frame sinks are not supported on this platform\n");
+	return false;
+}
+
+void FrameSink::Close()
+{
+}
+
+bool FrameSink::FlushPending()
+{
+	return false;
+}
+
+void FrameSink::WriteFrame(Video* Source)
+{
+}
+
+#endif
@@ -0,0 +1,104 @@
+#ifndef _FRAMESINK_H
+#define _FRAMESINK_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdio>
+#include <vector>
+
+class Video;
+
+enum FrameSinkFormat
+{
+	FrameSinkIndexed, // 1 byte palette index per pixel
+	FrameSinkArgb // 4 bytes per pixel, 32 bit ARGB in host byte order
+};
+
+// Written before the pixels of every frame, in host byte order.
+struct FrameSinkHeader
+{
+	char Magic[4]; // "C64F"
+	unsigned short Version;
+	unsigned short Format; // FrameSinkFormat
+	unsigned short Width, Height;
+	unsigned int DataSize; // Bytes of pixel data after the header
+	unsigned long long FrameNumber; // Frames since reset
+	unsigned long long Cycle;
+	unsigned int Palette[16]; // ARGB, to decode indexed frames
+};
+
+// Start of the shared memory ring. Slots follow at SlotOffset, each a FrameSinkHeader plus pixel data.
+// The consumer reads slot (ReadCount % SlotCount) while ReadCount < WriteCount, and then increments ReadCount.
+struct FrameRingHeader
+{
+	char Magic[4]; // "C64R"
+	unsigned int Version;
+	unsigned int SlotCount;
+	unsigned int SlotSize;
+	unsigned int SlotOffset;
+	unsigned int Reserved;
+	std::atomic<unsigned long long> WriteCount; // Written by the emulator
+	std::atomic<unsigned long long> ReadCount; // Written by the consumer
+};
+
+// Streams completed frames to a FIFO, stdout or a POSIX shared memory ring, for external encoders.
+// Writing never blocks the emulation. If the consumer falls behind, whole frames are dropped and counted.
+class FrameSink
+{
+public:
+	FrameSink();
+	~FrameSink();
+
+	// Path of a FIFO (or any file), or "-" for stdout.
+	bool OpenPipe(const char* Path, FrameSinkFormat Format);
+	// Create the shared memory object Name (e.g. "/c64frames") with room for SlotCount frames.
+	bool OpenSharedMemory(const char* Name, int SlotCount, FrameSinkFormat Format);
+	void Close();
+
+	// Open the output given by "--record <path|->" or "--record-shm <name>", in the format given by
+	// "--record-format indexed|argb". Returns true if an output was requested and opened.
+	bool OpenFromCommandLine(int argc, char* argv[]);
+	static bool IsCommandLineOption(const char* Arg);
+
+	// Take stdout over for a binary stream. Returns a private descriptor for it, and points descriptor 1 at stderr,
+	// so everything printed from then on (traces, results) stays out of the stream. Later calls return another
+	// descriptor for the same stream.
+	static int TakeStdout();
+
+	// Read a stream written to a pipe from File, checking each frame header. Prints a summary and returns false at
+	// the first bad header or truncated frame.
+	static bool CheckStream(FILE* File);
+	// "--record-check <path|->"
+	static int RunCheckCommandLine(int argc, char* argv[]);
+
+	// Receive the frames completed by a Video.
+	void Attach(Video* Source);
+	void Detach();
+
+	long long FramesWritten, FramesDropped;
+
+protected:
+	FrameSinkFormat Format;
+	Video* AttachedVideo;
+
+	// Pipe output. A frame that was only partly written is finished before any new frame is started.
+	int PipeFd;
+	const char* PipePath;
+	bool OwnsPipeFd;
+	std::vector<unsigned char> Pending;
+	size_t PendingWritten;
+	bool FlushPending();
+
+	// Shared memory output
+	const char* SharedName;
+	unsigned char* SharedBase;
+	size_t SharedSize;
+	FrameRingHeader* Ring;
+
+	static void FrameCallback(Video* Source, void* Context);
+	void WriteFrame(Video* Source);
+	void FillFrame(Video* Source, unsigned char* Destination);
+	unsigned int FrameDataSize(Video* Source);
+};
+
+#endif
@@ -0,0 +1,573 @@
+#include "Fuzzer.h"
+#include "Headless.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+
+// With libFuzzer, the coverage map goes in the section it reads extra counters from, and it clears the map itself.
+#ifdef C64EMU_LIBFUZZER
+#define COVERAGE_SECTION __attribute__((used, section("__libfuzzer_extra_counters")))
+#else
+#define COVERAGE_SECTION
+#endif
+
+unsigned char Fuzzer::CoverageMap[Cpu::CoverageMapSize] COVERAGE_SECTION;
+
+static const char* FaultNames[] = { "none", "undefined-opcode", "brk", "stack-wrap" };
+
+Fuzzer::Fuzzer(MachineModelType Model)
+{
+	ModelType = Model;
+	Machine = NULL;
+	Snapshot = NULL;
+
+	InputMode = InputRam;
+	InputAddress = 0xC000;
+	LengthAddress = -1;
+	EntryPC = -1;
+	MaxLength = 256;
+	MaxCycles = 1000000;
+	KeyFrames = 3;
+	SettleFrames = 50;
+	TimedOut = false;
+	FaultPC = 0;
+
+	Runs = -1;
+	Seed = 1;
+	CrashDirectory = ".";
+
+	Execs = 0;
+	Crashes = 0;
+	Timeouts = 0;
+	EdgesFound = 0;
+	memset(SeenCoverage, 0, sizeof(SeenCoverage));
+}
+
+Fuzzer::~Fuzzer()
+{
+	delete Snapshot;
+	delete Machine;
+}
+
+bool Fuzzer::Setup(const char* Program)
+{
+	delete Snapshot;
+	delete Machine;
+	Snapshot = NULL;
+
+	Machine = new Emulation();
+	Machine->SetModel(ModelType);
+	Machine->SystemSid.OutputEnabled = false;
+
+	int cyclesPerFrame = Machine->Model->CyclesPerFrame();
+	while (Machine->SystemVideo.FrameCount < HeadlessRunner::BootFrames)
+	{
+		Machine->RunCycles(cyclesPerFrame);
+	}
+
+	if (Program != NULL && strcmp(Program, "-") != 0)
+	{
+		int address = HeadlessRunner::LoadPrg(*Machine, Program);
+		if (address < 0)
+		{
+			printf("Fuzz: unable to load %s\n", Program);
+			return false;
+		}
+		if (EntryPC < 0)
+		{
+			// Nothing to call, so start the program and fuzz it from wherever it is after settling.
+			char command[16];
+			if (address == 0x0801)
+			{
+				snprintf(command, sizeof(command), "RUN\r");
+			}
+			else
+			{
+				snprintf(command, sizeof(command), "SYS%d\r", address);
+			}
+			HeadlessRunner::TypeKeys(*Machine, command);
+			for (int i = 0; i < SettleFrames; i++)
+			{
+				Machine->RunCycles(cyclesPerFrame);
+			}
+		}
+	}
+
+	if (!Machine->SystemCpu.Running || Machine->SystemCpu.Fault != CpuFaultNone)
+	{
+		printf("Fuzz: the machine faulted before fuzzing started (%s at $%04X)\n", FaultNames[Machine->SystemCpu.Fault], Machine->SystemCpu.FaultPC);
+		return false;
+	}
+
+	Snapshot = Machine->Fork();
+	Machine->SystemCpu.CoverageMap = CoverageMap;
+	return true;
+}
+
+// Run the machine up to EndCycle. Returns false if it stopped, faulted or reached StopPC first.
+bool Fuzzer::RunUntil(long long EndCycle)
+{
+	Cpu& cpu = Machine->SystemCpu;
+	while (cpu.Cycle < EndCycle)
+	{
+		long long slice = EndCycle - cpu.Cycle;
+		Machine->RunCycles(slice > 20000 ? 20000 : (int)slice);
+		if (!cpu.Running || cpu.Fault != CpuFaultNone || cpu.NextPC() == Machine->StopPC)
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+int Fuzzer::RunInput(const unsigned char* Data, size_t Size)
+{
+	Machine->RestoreFrom(*Snapshot);
+	Execs++;
+	TimedOut = false;
+
+	Cpu& cpu = Machine->SystemCpu;
+	long long endCycle = cpu.Cycle + MaxCycles;
+	if (Size > MaxLength)
+	{
+		Size = MaxLength;
+	}
+
+	if (InputMode == InputRam)
+	{
+		for (size_t i = 0; i < Size; i++)
+		{
+			Machine->SystemMemory.WriteRam((InputAddress + (int)i) & 0xFFFF, Data[i]);
+		}
+		if (LengthAddress >= 0)
+		{
+			Machine->SystemMemory.WriteRam(LengthAddress, (unsigned char)(Size > 255 ? 255 : Size));
+		}
+		Machine->StopPC = -1;
+		if (EntryPC >= 0)
+		{
+			// Call the routine with a return address of $FFFF. RTS adds one, so it returns to $0000, where it stops.
+			CpuRegisters regs;
+			cpu.GetRegisters(regs);
+			Machine->SystemMemory.WriteRam(0x100 | regs.S, 0xFF);
+			regs.S--;
+			Machine->SystemMemory.WriteRam(0x100 | regs.S, 0xFF);
+			regs.S--;
+			regs.PC = (unsigned short)EntryPC;
+			cpu.SetRegisters(regs);
+			Machine->StopPC = 0;
+		}
+		TimedOut = RunUntil(endCycle) && EntryPC >= 0;
+	}
+	else
+	{
+		long long keyCycles = (long long)KeyFrames * Machine->Model->CyclesPerFrame();
+		for (size_t i = 0; i < Size; i++)
+		{
+			C64KeyMap key = (C64KeyMap)(Data[i] & 0x3F);
+			bool shift = (Data[i] & 0x40) != 0;
+			Machine->SystemKeyboard.KeyDown64(key);
+			if (shift)
+			{
+				Machine->SystemKeyboard.KeyDown64(C64Key_LShift);
+			}
+			bool running = RunUntil(cpu.Cycle + keyCycles);
+			Machine->SystemKeyboard.KeyUp64(key);
+			if (shift)
+			{
+				Machine->SystemKeyboard.KeyUp64(C64Key_LShift);
+			}
+			if (!running || !RunUntil(cpu.Cycle + keyCycles) || cpu.Cycle >= endCycle)
+			{
+				break;
+			}
+		}
+	}
+
+	if (cpu.Fault != CpuFaultNone)
+	{
+		FaultPC = cpu.FaultPC;
+	}
+	return cpu.Fault;
+}
+
+// Hit counts are bucketed (1, 2, 3, 4-7, 8-15, 16-31, 32-127, 128+) so that loop counts only matter roughly.
+static unsigned char CountBucket(unsigned char Count)
+{
+	if (Count <= 3) return Count == 3 ? 4 : Count;
+	if (Count <= 7) return 8;
+	if (Count <= 15) return 16;
+	if (Count <= 31) return 32;
+	if (Count <= 127) return 64;
+	return 128;
+}
+
+// Returns true if the last run reached an edge, or an edge's hit count bucket, that no earlier run did.
+bool Fuzzer::CheckCoverage()
+{
+	bool found = false;
+	const unsigned long long* words = (const unsigned long long*)CoverageMap;
+	for (int w = 0; w < Cpu::CoverageMapSize / 8; w++)
+	{
+		if (words[w] == 0)
+		{
+			continue;
+		}
+		for (int i = w * 8; i < w * 8 + 8; i++)
+		{
+			if (CoverageMap[i] == 0)
+			{
+				continue;
+			}
+			unsigned char bucket = CountBucket(CoverageMap[i]);
+			if ((bucket & ~SeenCoverage[i]) != 0)
+			{
+				if (SeenCoverage[i] == 0)
+				{
+					EdgesFound++;
+				}
+				SeenCoverage[i] |= bucket;
+				found = true;
+			}
+		}
+	}
+	return found;
+}
+
+static unsigned int NextRandom(unsigned int& State)
+{
+	State ^= State << 13;
+	State ^= State >> 17;
+	State ^= State << 5;
+	return State;
+}
+
+void Fuzzer::Mutate(std::vector<unsigned char>& Input, unsigned int& Random)
+{
+	static const unsigned char Interesting[] = { 0x00, 0x01, 0x0D, 0x20, 0x40, 0x7F, 0x80, 0xFE, 0xFF };
+
+	int mutations = 1 + NextRandom(Random) % 4;
+	for (int m = 0; m < mutations; m++)
+	{
+		if (Input.empty())
+		{
+			Input.push_back(0);
+		}
+		size_t position = NextRandom(Random) % Input.size();
+		switch (NextRandom(Random) % 7)
+		{
+		case 0:
+			Input[position] ^= (unsigned char)(1 << (NextRandom(Random) % 8));
+			break;
+		case 1:
+			Input[position] = (unsigned char)NextRandom(Random);
+			break;
+		case 2:
+			Input[position] = Interesting[NextRandom(Random) % sizeof(Interesting)];
+			break;
+		case 3:
+			Input[position] += (unsigned char)(NextRandom(Random) % 33) - 16;
+			break;
+		case 4:
+			if (Input.size() < MaxLength)
+			{
+				Input.insert(Input.begin() + position, (unsigned char)NextRandom(Random));
+			}
+			break;
+		case 5:
+			if (Input.size() > 1)
+			{
+				Input.erase(Input.begin() + position);
+			}
+			break;
+		case 6:
+		{
+			// Splice in a piece of another corpus entry.
+			const std::vector<unsigned char>& other = Corpus[NextRandom(Random) % Corpus.size()];
+			if (!other.empty())
+			{
+				size_t from = NextRandom(Random) % other.size();
+				size_t length = 1 + NextRandom(Random) % (other.size() - from);
+				for (size_t i = 0; i < length && position + i < MaxLength; i++)
+				{
+					if (position + i < Input.size())
+					{
+						Input[position + i] = other[from + i];
+					}
+					else
+					{
+						Input.push_back(other[from + i]);
+					}
+				}
+			}
+			break;
+		}
+		}
+	}
+}
+
+void Fuzzer::SaveCrash(int Fault, const std::vector<unsigned char>& Input)
+{
+	unsigned int site = ((unsigned int)Fault << 16) | FaultPC;
+	for (size_t i = 0; i < CrashSites.size(); i++)
+	{
+		if (CrashSites[i] == site)
+		{
+			return;
+		}
+	}
+	CrashSites.push_back(site);
+
+	char filename[512];
+	snprintf(filename, sizeof(filename), "%s/crash-%s-%04X.bin", CrashDirectory, FaultNames[Fault], FaultPC);
+	FILE* f = fopen(filename, "wb");
+	if (f != NULL)
+	{
+		fwrite(Input.data(), 1, Input.size(), f);
+		fclose(f);
+	}
+	printf("Crash: %s at $%04X after %lld execs, input written to %s\n", FaultNames[Fault], FaultPC, Execs, f != NULL ? filename : "(unable to write)");
+}
+
+void Fuzzer::Fuzz()
+{
+	unsigned int random = Seed != 0 ? Seed : 1;
+	if (Corpus.empty())
+	{
+		Corpus.push_back(std::vector<unsigned char>(1, 0));
+	}
+
+	// Run the seeds first so that only inputs that do something new join the corpus.
+	for (size_t i = 0; i < Corpus.size(); i++)
+	{
+		memset(CoverageMap, 0, sizeof(CoverageMap));
+		int fault = RunInput(Corpus[i].data(), Corpus[i].size());
+		if (fault != CpuFaultNone)
+		{
+			Crashes++;
+			SaveCrash(fault, Corpus[i]);
+		}
+		CheckCoverage();
+	}
+
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	std::chrono::steady_clock::time_point lastReport = start;
+	long long startExecs = Execs;
+	std::vector<unsigned char> input;
+	for (long long run = 0; Runs < 0 || run < Runs; run++)
+	{
+		input = Corpus[NextRandom(random) % Corpus.size()];
+		Mutate(input, random);
+
+		memset(CoverageMap, 0, sizeof(CoverageMap));
+		int fault = RunInput(input.data(), input.size());
+		if (fault != CpuFaultNone)
+		{
+			Crashes++;
+			SaveCrash(fault, input);
+		}
+		else if (TimedOut)
+		{
+			Timeouts++;
+		}
+		else if (CheckCoverage())
+		{
+			Corpus.push_back(input);
+		}
+
+		if ((run & 1023) == 0)
+		{
+			std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+			if (now - lastReport >= std::chrono::seconds(2))
+			{
+				double seconds = std::chrono::duration<double>(now - start).count();
+				printf("#%lld edges %d corpus %d crashes %lld timeouts %lld, %.0f execs/sec\n", Execs, EdgesFound, (int)Corpus.size(), Crashes, Timeouts, (Execs - startExecs) / seconds);
+				lastReport = now;
+			}
+		}
+	}
+
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	printf("Done: %lld execs, edges %d, corpus %d, crashes %lld (%d sites), timeouts %lld, %.0f execs/sec\n", Execs, EdgesFound, (int)Corpus.size(), Crashes, (int)CrashSites.size(), Timeouts,
+		seconds > 0 ? (Execs - startExecs) / seconds : 0.0);
+}
+
+static void PrintFuzzUsage()
+{
+	printf("Usage: c64emu --fuzz [--pal | --ntsc] [--keys] [--input <hex address>] [--length-addr <hex address>] [--entry <hex address>]\n");
+	printf("                     [--max-len <n>] [--cycles <n>] [--key-frames <n>] [--settle <frames>] [--runs <n>] [--seed <n>]\n");
+	printf("                     [--crashes <directory>] <program.prg | -> [seed inputs...]\n");
+	printf("  Without --keys, each input is copied to RAM at --input (default C000) and the routine at --entry is called.\n");
+	printf("  Without --entry, the program is started with RUN or SYS and left running.\n");
+}
+
+int Fuzzer::ParseOptions(int argc, char* argv[])
+{
+	for (int i = 0; i < argc; i++)
+	{
+		bool hasValue = i + 1 < argc;
+		if (strcmp(argv[i], "--pal") == 0)
+		{
+			ModelType = MachinePAL;
+		}
+		else if (strcmp(argv[i], "--ntsc") == 0)
+		{
+			ModelType = MachineNTSC;
+		}
+		else if (strcmp(argv[i], "--keys") == 0)
+		{
+			InputMode = InputKeys;
+		}
+		else if (strcmp(argv[i], "--input") == 0 && hasValue)
+		{
+			InputAddress = (int)strtol(argv[++i], nullptr, 16) & 0xFFFF;
+		}
+		else if (strcmp(argv[i], "--length-addr") == 0 && hasValue)
+		{
+			LengthAddress = (int)strtol(argv[++i], nullptr, 16) & 0xFFFF;
+		}
+		else if (strcmp(argv[i], "--entry") == 0 && hasValue)
+		{
+			EntryPC = (int)strtol(argv[++i], nullptr, 16) & 0xFFFF;
+		}
+		else if (strcmp(argv[i], "--max-len") == 0 && hasValue)
+		{
+			MaxLength = (size_t)strtol(argv[++i], nullptr, 10);
+		}
+		else if (strcmp(argv[i], "--cycles") == 0 && hasValue)
+		{
+			MaxCycles = strtoll(argv[++i], nullptr, 10);
+		}
+		else if (strcmp(argv[i], "--key-frames") == 0 && hasValue)
+		{
+			KeyFrames = (int)strtol(argv[++i], nullptr, 10);
+		}
+		else if (strcmp(argv[i], "--settle") == 0 && hasValue)
+		{
+			SettleFrames = (int)strtol(argv[++i], nullptr, 10);
+		}
+		else if (strcmp(argv[i], "--runs") == 0 && hasValue)
+		{
+			Runs = strtoll(argv[++i], nullptr, 10);
+		}
+		else if (strcmp(argv[i], "--seed") == 0 && hasValue)
+		{
+			Seed = (unsigned int)strtoul(argv[++i], nullptr, 10);
+		}
+		else if (strcmp(argv[i], "--crashes") == 0 && hasValue)
+		{
+			CrashDirectory = argv[++i];
+		}
+		else if (strncmp(argv[i], "--", 2) == 0)
+		{
+			printf("Unknown fuzz option %s\n", argv[i]);
+			return -1;
+		}
+		else
+		{
+			return i;
+		}
+	}
+	return -1;
+}
+
+static bool ReadInputFile(const char* Filename, std::vector<unsigned char>& Input)
+{
+	FILE* f = fopen(Filename, "rb");
+	if (f == NULL)
+	{
+		return false;
+	}
+	Input.clear();
+	int c;
+	while ((c = fgetc(f)) != EOF)
+	{
+		Input.push_back((unsigned char)c);
+	}
+	fclose(f);
+	return true;
+}
+
+int Fuzzer::RunCommandLine(int argc, char* argv[])
+{
+	Fuzzer fuzzer(MachinePAL);
+	int programIndex = fuzzer.ParseOptions(argc, argv);
+	if (programIndex < 0)
+	{
+		PrintFuzzUsage();
+		return 2;
+	}
+	if (!fuzzer.Setup(argv[programIndex]))
+	{
+		return 2;
+	}
+	for (int i = programIndex + 1; i < argc; i++)
+	{
+		std::vector<unsigned char> input;
+		if (!ReadInputFile(argv[i], input))
+		{
+			printf("Unable to read seed input %s\n", argv[i]);
+			return 2;
+		}
+		fuzzer.AddSeed(input);
+	}
+	fuzzer.Fuzz();
+	return fuzzer.CrashSites.empty() ? 0 : 1;
+}
+
+#ifdef C64EMU_LIBFUZZER
+// libFuzzer provides main, so link this without c64emu.cpp. It owns the command line as well, so the options of
+// "c64emu --fuzz" are taken from the C64EMU_FUZZ environment variable instead, e.g. "--entry C000 game.prg".
+static Fuzzer* LibFuzzerInstance;
+
+extern "C" int LLVMFuzzerInitialize(int* argc, char*** argv)
+{
+	std::vector<std::string> words;
+	const char* options = getenv("C64EMU_FUZZ");
+	std::string word;
+	for (const char* c = options != NULL ? options : ""; ; c++)
+	{
+		if (*c == ' ' || *c == 0)
+		{
+			if (!word.empty())
+			{
+				words.push_back(word);
+			}
+			word.clear();
+			if (*c == 0)
+			{
+				break;
+			}
+		}
+		else
+		{
+			word += *c;
+		}
+	}
+	std::vector<char*> args;
+	for (size_t i = 0; i < words.size(); i++)
+	{
+		args.push_back(&words[i][0]);
+	}
+
+	LibFuzzerInstance = new Fuzzer(MachinePAL);
+	int programIndex = LibFuzzerInstance->ParseOptions((int)args.size(), args.data());
+	if (!LibFuzzerInstance->Setup(programIndex >= 0 ? args[programIndex] : "-"))
+	{
+		exit(2);
+	}
+	return 0;
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const unsigned char* Data, size_t Size)
+{
+	int fault = LibFuzzerInstance->RunInput(Data, Size);
+	if (fault != CpuFaultNone)
+	{
+		printf("Crash: %s at $%04X\n", FaultNames[fault], LibFuzzerInstance->FaultPC);
+		abort();
+	}
+	return 0;
+}
+#endif
@@ -0,0 +1,77 @@
+#ifndef _FUZZER_H
+#define _FUZZER_H
+
+#include "Emulation.h"
+#include <string>
+#include <vector>
+
+// Coverage guided fuzzing of C64 programs, in process.
+// The machine is booted (and optionally a program loaded) once, then kept as a forked snapshot. Each input restores
+// the working machine from the snapshot, which only copies the chip state and the RAM pages written by the last
+// run, and then runs the input in one of two ways:
+//  RAM mode: the input is copied into RAM (and its length stored, if asked), and a routine is called as if by JSR.
+//   The run ends when the routine returns.
+//  Keys mode: each input byte is a key held for a few frames. The low 6 bits are the matrix position (C64KeyMap),
+//   bit 6 holds shift as well.
+// The CPU records edge coverage into CoverageMap, and an input that makes the CPU fault (undefined opcode, BRK, or
+// stack wrap) is a crash. Built with C64EMU_LIBFUZZER, the map is exposed to libFuzzer as extra counters and
+// LLVMFuzzerTestOneInput is defined. Otherwise "c64emu --fuzz" runs a simple mutation loop.
+class Fuzzer
+{
+public:
+	Fuzzer(MachineModelType Model);
+	~Fuzzer();
+
+	enum InputModes { InputRam, InputKeys };
+	int InputMode;
+	int InputAddress; // RAM mode: where the input is copied.
+	int LengthAddress; // RAM mode: the input length (capped at 255) is stored here, -1 for none.
+	int EntryPC; // RAM mode: routine to call, -1 to leave the CPU where it is.
+	size_t MaxLength;
+	long long MaxCycles; // Cycle budget for one input.
+	int KeyFrames; // Keys mode: frames each key is held, and then released for.
+	int SettleFrames; // Frames to run a program that was started with RUN or SYS before taking the snapshot.
+
+	// Boot and load the program ("-" or NULL for none), then take the snapshot every input starts from.
+	bool Setup(const char* Program);
+
+	// Run one input from the snapshot. Returns the fault (CpuFault), CpuFaultNone if the run was clean.
+	int RunInput(const unsigned char* Data, size_t Size);
+	bool TimedOut; // The last input used up its cycle budget.
+	unsigned short FaultPC; // Instruction the last fault happened on.
+
+	// Mutation loop, for builds without libFuzzer. Runs forever if Runs is negative, and writes an input for each
+	// new crash site (fault and address) to CrashDirectory.
+	void Fuzz();
+	long long Runs;
+	unsigned int Seed;
+	const char* CrashDirectory;
+	void AddSeed(const std::vector<unsigned char>& Input) { Corpus.push_back(Input); }
+
+	long long Execs, Crashes, Timeouts;
+
+	static unsigned char CoverageMap[Cpu::CoverageMapSize];
+
+	// Parse the options of "c64emu --fuzz". Returns the index of the program argument, or -1.
+	int ParseOptions(int argc, char* argv[]);
+
+	// Entry point for "c64emu --fuzz ..."
+	static int RunCommandLine(int argc, char* argv[]);
+
+protected:
+	Emulation* Machine;
+	Emulation* Snapshot;
+	MachineModelType ModelType;
+
+	std::vector<std::vector<unsigned char> > Corpus;
+	unsigned char SeenCoverage[Cpu::CoverageMapSize]; // Hit count buckets seen for each edge.
+	std::vector<unsigned int> CrashSites;
+	int EdgesFound;
+
+	bool RunUntil(long long EndCycle);
+	bool CheckCoverage();
+	void Mutate(std::vector<unsigned char>& Input, unsigned int& Random);
+	void SaveCrash(int Fault, const std::vector<unsigned char>& Input);
+};
+
+#endif
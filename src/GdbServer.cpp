@@ -0,0 +1,649 @@
+#include "GdbServer.h"
+#include "Emulation.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#pragma comment(lib, "ws2_32.lib")
+#define CloseSocket closesocket
+#else
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <fcntl.h>
+#define CloseSocket close
+#endif
+
+// Writing to a closed connection raises SIGPIPE on Linux unless asked not to.
+#ifdef MSG_NOSIGNAL
+#define SEND_FLAGS MSG_NOSIGNAL
+#else
+#define SEND_FLAGS 0
+#endif
+
+static const char* TargetXml =
+	"<?xml version=\"1.0\"?>"
+	"<!DOCTYPE target SYSTEM \"gdb-target.dtd\">"
+	"<target version=\"1.0\">"
+	"<feature name=\"org.c64emu.mos6502\">"
+	"<reg name=\"a\" bitsize=\"8\" type=\"uint8\"/>"
+	"<reg name=\"x\" bitsize=\"8\" type=\"uint8\"/>"
+	"<reg name=\"y\" bitsize=\"8\" type=\"uint8\"/>"
+	"<reg name=\"sp\" bitsize=\"8\" type=\"uint8\"/>"
+	"<reg name=\"p\" bitsize=\"8\" type=\"uint8\"/>"
+	"<reg name=\"pc\" bitsize=\"16\" type=\"code_ptr\"/>"
+	"</feature>"
+	"</target>";
+
+static const char* FeaturesQuery = "qXfer:features:read:target.xml";
+
+static const char HexDigits[] = "0123456789abcdef";
+
+static int HexValue(char c)
+{
+	if (c >= '0' && c <= '9') return c - '0';
+	if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+	return -1;
+}
+
+static void AppendHex8(std::string& Out, unsigned char Value)
+{
+	Out += HexDigits[Value >> 4];
+	Out += HexDigits[Value & 15];
+}
+
+// The last socket call failed only because it would have had to wait.
+static bool WouldBlock()
+{
+#ifdef _WIN32
+	return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+	return errno == EAGAIN || errno == EWOULDBLOCK;
+#endif
+}
+
+static bool SetNonBlocking(unsigned long long Socket)
+{
+#ifdef _WIN32
+	u_long enable = 1;
+	return ioctlsocket((SOCKET)Socket, FIONBIO, &enable) == 0;
+#else
+	int flags = fcntl((int)Socket, F_GETFL, 0);
+	return flags >= 0 && fcntl((int)Socket, F_SETFL, flags | O_NONBLOCK) == 0;
+#endif
+}
+
+GdbServer::GdbServer()
+{
+	Listener = InvalidSocket;
+	Client = InvalidSocket;
+	AttachedDebugger = NULL;
+	NoAck = false;
+	WaitingForStop = false;
+}
+
+GdbServer::~GdbServer()
+{
+	Close();
+}
+
+bool GdbServer::Open(int Port, Debugger* UseDebugger)
+{
+	Close();
+#ifdef _WIN32
+	WSADATA wsaData;
+	if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0)
+	{
+		printf("GDB server: unable to start Winsock\n");
+		return false;
+	}
+#endif
+	Listener = (SocketHandle)socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if (Listener == InvalidSocket)
+	{
+		printf("GDB server: unable to create a socket\n");
+		return false;
+	}
+	int reuse = 1;
+	setsockopt(Listener, SOL_SOCKET, SO_REUSEADDR, (const char*)&reuse, sizeof(reuse));
+
+	sockaddr_in address;
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_port = htons((unsigned short)Port);
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(Listener, (sockaddr*)&address, sizeof(address)) != 0 || listen(Listener, 1) != 0 || !SetNonBlocking(Listener))
+	{
+		printf("GDB server: unable to listen on port %d\n", Port);
+		Close();
+		return false;
+	}
+
+	AttachedDebugger = UseDebugger;
+	AttachedDebugger->CbStop = DebuggerStopped;
+	AttachedDebugger->CbContext = this;
+	printf("GDB server: listening on 127.0.0.1:%d\n", Port);
+	return true;
+}
+
+void GdbServer::Close()
+{
+	Disconnect();
+	if (Listener != InvalidSocket)
+	{
+		CloseSocket(Listener);
+		Listener = InvalidSocket;
+	}
+	if (AttachedDebugger != NULL)
+	{
+		AttachedDebugger->CbStop = NULL;
+		AttachedDebugger->CbContext = NULL;
+		AttachedDebugger = NULL;
+	}
+}
+
+void GdbServer::Disconnect()
+{
+	if (Client == InvalidSocket)
+	{
+		return;
+	}
+	CloseSocket(Client);
+	Client = InvalidSocket;
+	Input.clear();
+	Output.clear();
+	WaitingForStop = false;
+
+	// Leave the machine running without GDB's points.
+	for (size_t i = 0; i < Points.size(); i++)
+	{
+		AttachedDebugger->Remove(Points[i].Id);
+	}
+	Points.clear();
+	if (AttachedDebugger->Stopped)
+	{
+		AttachedDebugger->Continue();
+	}
+	printf("GDB server: disconnected\n");
+}
+
+void GdbServer::DebuggerStopped(Debugger* Source, void* Context)
+{
+	GdbServer* server = (GdbServer*)Context;
+	if (!server->Connected())
+	{
+		// A --break or --watch point with nobody attached.
+		Source->PrintState();
+	}
+	// The stop is reported at the next Poll, which keeps socket writes out of the CPU loop.
+}
+
+void GdbServer::Poll()
+{
+	if (Listener == InvalidSocket)
+	{
+		return;
+	}
+
+	if (Client == InvalidSocket)
+	{
+		SocketHandle client = (SocketHandle)accept(Listener, NULL, NULL);
+		if (client == InvalidSocket)
+		{
+			return;
+		}
+		SetNonBlocking(client);
+		int noDelay = 1;
+		setsockopt(client, IPPROTO_TCP, TCP_NODELAY, (const char*)&noDelay, sizeof(noDelay));
+		Client = client;
+		NoAck = false;
+		printf("GDB server: connected\n");
+		// GDB expects the target to be stopped when it attaches.
+		AttachedDebugger->Stop();
+		WaitingForStop = false;
+	}
+
+	FlushOutput();
+
+	char buffer[4096];
+	while (Client != InvalidSocket)
+	{
+		int received = (int)recv(Client, buffer, sizeof(buffer), 0);
+		if (received < 0 && WouldBlock())
+		{
+			break;
+		}
+		if (received <= 0)
+		{
+			Disconnect();
+			return;
+		}
+		Input.append(buffer, received);
+	}
+
+	// Packets are $data#checksum. Acks are ignored, and a lone 0x03 is an interrupt request.
+	while (!Input.empty() && Client != InvalidSocket)
+	{
+		if (Input[0] == 0x03)
+		{
+			// The stop is reported as the reply to the continue or step that's running.
+			Input.erase(0, 1);
+			AttachedDebugger->Stop();
+			continue;
+		}
+		if (Input[0] != '$')
+		{
+			Input.erase(0, 1);
+			continue;
+		}
+		size_t end = Input.find('#');
+		if (end == std::string::npos || end + 2 >= Input.size())
+		{
+			break; // Incomplete
+		}
+		std::string packet = Input.substr(1, end - 1);
+		int checksum = HexValue(Input[end + 1]) * 16 + HexValue(Input[end + 2]);
+		Input.erase(0, end + 3);
+
+		unsigned char sum = 0;
+		for (size_t i = 0; i < packet.size(); i++)
+		{
+			sum += (unsigned char)packet[i];
+		}
+		if (!NoAck)
+		{
+			Send(sum == checksum ? "+" : "-", 1);
+		}
+		if (sum == checksum)
+		{
+			HandlePacket(packet);
+		}
+	}
+
+	if (WaitingForStop && AttachedDebugger->Stopped && Client != InvalidSocket)
+	{
+		WaitingForStop = false;
+		SendStopReply();
+	}
+}
+
+void GdbServer::SendStopReply()
+{
+	// Signal 5 is SIGTRAP.
+	char reply[64];
+	const char* watch = NULL;
+	switch (AttachedDebugger->StopKind)
+	{
+	case DebugWatchRead: watch = "rwatch"; break;
+	case DebugWatchWrite: watch = "watch"; break;
+	}
+	if (watch != NULL)
+	{
+		snprintf(reply, sizeof(reply), "T05%s:%x;", watch, AttachedDebugger->StopAddress);
+	}
+	else
+	{
+		snprintf(reply, sizeof(reply), "T05");
+	}
+	SendPacket(reply);
+}
+
+void GdbServer::Send(const char* Data, size_t Length)
+{
+	if (Client == InvalidSocket)
+	{
+		return;
+	}
+	if (Output.size() + Length > MaxOutput)
+	{
+		printf("GDB server: client isn't reading, disconnecting\n");
+		Disconnect();
+		return;
+	}
+	Output.append(Data, Length);
+	FlushOutput();
+}
+
+void GdbServer::FlushOutput()
+{
+	size_t done = 0;
+	while (done < Output.size() && Client != InvalidSocket)
+	{
+		int sent = (int)send(Client, Output.data() + done, (int)(Output.size() - done), SEND_FLAGS);
+		if (sent <= 0)
+		{
+			// The socket is non-blocking, so a full send buffer shows up here. The rest goes on the next Poll.
+			if (sent < 0 && WouldBlock())
+			{
+				break;
+			}
+			Disconnect();
+			return;
+		}
+		done += sent;
+	}
+	Output.erase(0, done);
+}
+
+void GdbServer::SendPacket(const std::string& Packet)
+{
+	std::string framed = "$";
+	unsigned char sum = 0;
+	for (size_t i = 0; i < Packet.size(); i++)
+	{
+		char c = Packet[i];
+		if (c == '$' || c == '#' || c == '}' || c == '*')
+		{
+			// Escaped as } followed by the character xor 0x20.
+			framed += '}';
+			c ^= 0x20;
+			sum += '}';
+		}
+		framed += c;
+		sum += (unsigned char)c;
+	}
+	framed += '#';
+	AppendHex8(framed, sum);
+	Send(framed.data(), framed.size());
+}
+
+void GdbServer::HandlePacket(const std::string& Packet)
+{
+	Emulation* machine = AttachedDebugger->Target;
+	const char* arguments = Packet.c_str() + 1;
+	switch (Packet[0])
+	{
+	case '?':
+		// Report once the stop requested on connecting has happened.
+		if (AttachedDebugger->Stopped)
+		{
+			SendStopReply();
+		}
+		else
+		{
+			WaitingForStop = true;
+		}
+		return;
+	case 'g':
+		SendPacket(ReadRegisters());
+		return;
+	case 'G':
+		SendPacket(WriteRegisters(arguments) ? "OK" : "E01");
+		return;
+	case 'p':
+	{
+		std::string all = ReadRegisters();
+		int reg = (int)strtol(arguments, NULL, 16);
+		if (reg < 5)
+		{
+			SendPacket(all.substr(reg * 2, 2));
+		}
+		else if (reg == 5)
+		{
+			SendPacket(all.substr(10, 4));
+		}
+		else
+		{
+			SendPacket("E01");
+		}
+		return;
+	}
+	case 'P':
+	{
+		char* value;
+		int reg = (int)strtol(arguments, &value, 16);
+		std::string all = ReadRegisters();
+		if (*value != '=' || reg > 5)
+		{
+			SendPacket("E01");
+			return;
+		}
+		value++;
+		size_t length = reg < 5 ? 2 : 4;
+		if (strlen(value) < length)
+		{
+			SendPacket("E01");
+			return;
+		}
+		all.replace(reg < 5 ? reg * 2 : 10, length, value, length);
+		SendPacket(WriteRegisters(all.c_str()) ? "OK" : "E01");
+		return;
+	}
+	case 'm':
+		SendPacket(ReadMemory(arguments));
+		return;
+	case 'M':
+		SendPacket(WriteMemory(arguments) ? "OK" : "E01");
+		return;
+	case 'c':
+		if (*arguments != 0)
+		{
+			CpuRegisters regs;
+			machine->SystemCpu.GetRegisters(regs);
+			regs.PC = (unsigned short)strtol(arguments, NULL, 16);
+			machine->SystemCpu.SetRegisters(regs);
+		}
+		AttachedDebugger->Continue();
+		WaitingForStop = true;
+		return;
+	case 's':
+		AttachedDebugger->StepInstruction(1);
+		WaitingForStop = true;
+		return;
+	case 'Z':
+	case 'z':
+		SendPacket(SetPoint(arguments, Packet[0] == 'Z') ? "OK" : "");
+		return;
+	case 'H':
+		SendPacket("OK");
+		return;
+	case 'T':
+		SendPacket("OK");
+		return;
+	case 'k':
+	case 'D':
+		if (Packet[0] == 'D')
+		{
+			SendPacket("OK");
+		}
+		Disconnect();
+		return;
+	case 'q':
+		if (Packet.compare(0, 10, "qSupported") == 0)
+		{
+			SendPacket("PacketSize=4000;qXfer:features:read+;QStartNoAckMode+");
+		}
+		else if (Packet.compare(0, strlen(FeaturesQuery), FeaturesQuery) == 0)
+		{
+			SendPacket(ReadFeatures(Packet.c_str() + strlen(FeaturesQuery)));
+		}
+		else if (Packet == "qAttached")
+		{
+			SendPacket("1");
+		}
+		else if (Packet == "qC")
+		{
+			SendPacket("QC1");
+		}
+		else if (Packet == "qfThreadInfo")
+		{
+			SendPacket("m1");
+		}
+		else if (Packet == "qsThreadInfo")
+		{
+			SendPacket("l");
+		}
+		else
+		{
+			SendPacket("");
+		}
+		return;
+	case 'Q':
+		if (Packet == "QStartNoAckMode")
+		{
+			SendPacket("OK");
+			NoAck = true;
+		}
+		else
+		{
+			SendPacket("");
+		}
+		return;
+	}
+	SendPacket(""); // Not supported
+}
+
+std::string GdbServer::ReadRegisters()
+{
+	CpuRegisters regs;
+	AttachedDebugger->Target->SystemCpu.GetRegisters(regs);
+	std::string out;
+	AppendHex8(out, regs.A);
+	AppendHex8(out, regs.X);
+	AppendHex8(out, regs.Y);
+	AppendHex8(out, regs.S);
+	AppendHex8(out, regs.P);
+	AppendHex8(out, regs.PC & 0xFF); // Target byte order
+	AppendHex8(out, regs.PC >> 8);
+	return out;
+}
+
+bool GdbServer::WriteRegisters(const char* Hex)
+{
+	unsigned char bytes[7];
+	for (int i = 0; i < 7; i++)
+	{
+		int high = HexValue(Hex[i * 2]);
+		int low = high >= 0 ? HexValue(Hex[i * 2 + 1]) : -1;
+		if (low < 0)
+		{
+			return false;
+		}
+		bytes[i] = (unsigned char)(high * 16 + low);
+	}
+	CpuRegisters regs;
+	regs.A = bytes[0];
+	regs.X = bytes[1];
+	regs.Y = bytes[2];
+	regs.S = bytes[3];
+	regs.P = bytes[4];
+	regs.PC = (unsigned short)(bytes[5] | (bytes[6] << 8));
+	AttachedDebugger->Target->SystemCpu.SetRegisters(regs);
+	return true;
+}
+
+std::string GdbServer::ReadMemory(const char* Arguments)
+{
+	char* next;
+	int address = (int)strtol(Arguments, &next, 16);
+	if (*next != ',')
+	{
+		return "E01";
+	}
+	int length = (int)strtol(next + 1, NULL, 16);
+	if (length > 0x1000)
+	{
+		length = 0x1000;
+	}
+	Memory& memory = AttachedDebugger->Target->SystemMemory;
+	std::string out;
+	for (int i = 0; i < length; i++)
+	{
+		AppendHex8(out, memory.Peek8((address + i) & 0xFFFF));
+	}
+	return out;
+}
+
+bool GdbServer::WriteMemory(const char* Arguments)
+{
+	char* next;
+	int address = (int)strtol(Arguments, &next, 16);
+	if (*next != ',')
+	{
+		return false;
+	}
+	int length = (int)strtol(next + 1, &next, 16);
+	if (*next != ':' || (int)strlen(next + 1) < length * 2)
+	{
+		return false;
+	}
+	const char* hex = next + 1;
+	Memory& memory = AttachedDebugger->Target->SystemMemory;
+	for (int i = 0; i < length; i++)
+	{
+		int high = HexValue(hex[i * 2]);
+		int low = HexValue(hex[i * 2 + 1]);
+		if (high < 0 || low < 0)
+		{
+			return false;
+		}
+		memory.Write8((address + i) & 0xFFFF, (unsigned char)(high * 16 + low));
+	}
+	return true;
+}
+
+// Z/z<type>,<address>,<kind or length>. Types: 0 and 1 breakpoints, 2 write, 3 read and 4 access watchpoints.
+bool GdbServer::SetPoint(const char* Arguments, bool Insert)
+{
+	char* next;
+	int type = (int)strtol(Arguments, &next, 10);
+	if (*next != ',' || type < 0 || type > 4)
+	{
+		return false;
+	}
+	int address = (int)strtol(next + 1, &next, 16) & 0xFFFF;
+	int length = *next == ',' ? (int)strtol(next + 1, NULL, 16) : 1;
+	if (type < 2 || length < 1)
+	{
+		length = 1;
+	}
+
+	for (size_t i = 0; i < Points.size(); i++)
+	{
+		GdbPoint& point = Points[i];
+		if (point.Type == type && point.Address == address && point.Length == length)
+		{
+			if (!Insert)
+			{
+				AttachedDebugger->Remove(point.Id);
+				Points.erase(Points.begin() + i);
+			}
+			return true;
+		}
+	}
+	if (!Insert)
+	{
+		return true;
+	}
+
+	static const int Kinds[] = { DebugBreak, DebugBreak, DebugWatchWrite, DebugWatchRead, DebugWatchRead | DebugWatchWrite };
+	GdbPoint point;
+	point.Type = type;
+	point.Address = address;
+	point.Length = length;
+	point.Id = AttachedDebugger->AddWatchpoint(address, address + length - 1, Kinds[type], NULL);
+	Points.push_back(point);
+	return true;
+}
+
+// qXfer read arguments are :<offset>,<length>. Replies start with m (more to come) or l (last part).
+std::string GdbServer::ReadFeatures(const char* Arguments)
+{
+	char* next;
+	size_t offset = (size_t)strtol(Arguments + 1, &next, 16);
+	size_t length = *next == ',' ? (size_t)strtol(next + 1, NULL, 16) : 0;
+	size_t total = strlen(TargetXml);
+	if (offset >= total)
+	{
+		return "l";
+	}
+	std::string part(TargetXml + offset, offset + length < total ? length : total - offset);
+	return (offset + part.size() < total ? "m" : "l") + part;
+}
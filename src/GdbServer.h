@@ -0,0 +1,73 @@
+#ifndef _GDBSERVER_H
+#define _GDBSERVER_H
+
+#include "Debugger.h"
+#include <string>
+#include <vector>
+
+// GDB remote serial protocol server on a loopback TCP port, for one machine.
+// Poll is called by the emulation thread at frame boundaries. It never blocks, so an attached debugger has no
+// effect on pacing until it stops the machine. Breakpoints, watchpoints and stepping go through the Debugger,
+// memory reads use Memory::Peek8 so that looking at IO registers doesn't change them, and writes go through
+// Memory::Write8 like CPU writes.
+// There's no 6502 target in GDB itself, so the register layout is described by target.xml (qXfer): A, X, Y, S
+// and P as 8 bit registers, then the 16 bit PC.
+class GdbServer
+{
+public:
+	GdbServer();
+	~GdbServer();
+
+	// Start listening on 127.0.0.1. Returns false if the port couldn't be opened.
+	bool Open(int Port, Debugger* UseDebugger);
+	void Close();
+
+	// Accept a connection, handle any requests that arrived, and report a stop if the machine stopped.
+	void Poll();
+
+	bool Connected() { return Client != InvalidSocket; }
+
+protected:
+#ifdef _WIN32
+	typedef unsigned long long SocketHandle;
+#else
+	typedef int SocketHandle;
+#endif
+	static const SocketHandle InvalidSocket = (SocketHandle)-1;
+
+	SocketHandle Listener, Client;
+	Debugger* AttachedDebugger;
+
+	std::string Input; // Received bytes not yet handled
+	std::string Output; // Bytes the socket wasn't ready to take, sent on the next Poll
+	bool NoAck;
+	bool WaitingForStop; // A continue or step is in progress, report the next stop.
+
+	// Breakpoints and watchpoints set by GDB, by type and address, with the debugger's id.
+	struct GdbPoint
+	{
+		int Type, Address, Length, Id;
+	};
+	std::vector<GdbPoint> Points;
+
+	void Disconnect();
+	void HandlePacket(const std::string& Packet);
+	void SendPacket(const std::string& Packet);
+	void SendStopReply();
+	void Send(const char* Data, size_t Length);
+	void FlushOutput();
+
+	// A client that has left this much unread is dropped rather than buffered for.
+	static const size_t MaxOutput = 1 << 20;
+
+	std::string ReadRegisters();
+	bool WriteRegisters(const char* Hex);
+	std::string ReadMemory(const char* Arguments);
+	bool WriteMemory(const char* Arguments);
+	bool SetPoint(const char* Arguments, bool Insert);
+	std::string ReadFeatures(const char* Arguments);
+
+	static void DebuggerStopped(Debugger* Source, void* Context);
+};
+
+#endif
@@ -0,0 +1,453 @@
+#include "Headless.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+
+// XXH64, as described in the xxHash specification. Fast enough that checking a frame costs microseconds.
+static const unsigned long long Prime1 = 11400714785074694791ULL;
+static const unsigned long long Prime2 = 14029467366897019727ULL;
+static const unsigned long long Prime3 = 1609587929392839161ULL;
+static const unsigned long long Prime4 = 9650029242287828579ULL;
+static const unsigned long long Prime5 = 2870177450012600261ULL;
+
+static unsigned long long Rotl64(unsigned long long Value, int Bits)
+{
+	return (Value << Bits) | (Value >> (64 - Bits));
+}
+
+static unsigned long long Read64(const unsigned char* Data)
+{
+	unsigned long long value = 0;
+	for (int i = 7; i >= 0; i--)
+	{
+		value = (value << 8) | Data[i];
+	}
+	return value;
+}
+
+static unsigned long long Read32(const unsigned char* Data)
+{
+	return (unsigned long long)Data[0] | ((unsigned long long)Data[1] << 8) | ((unsigned long long)Data[2] << 16) | ((unsigned long long)Data[3] << 24);
+}
+
+static unsigned long long HashRound(unsigned long long Acc, unsigned long long Input)
+{
+	Acc += Input * Prime2;
+	Acc = Rotl64(Acc, 31);
+	return Acc * Prime1;
+}
+
+static unsigned long long HashMerge(unsigned long long Acc, unsigned long long Value)
+{
+	Acc ^= HashRound(0, Value);
+	return Acc * Prime1 + Prime4;
+}
+
+static unsigned long long Hash64(const unsigned char* Data, size_t Length, unsigned long long Seed)
+{
+	const unsigned char* end = Data + Length;
+	unsigned long long h;
+
+	if (Length >= 32)
+	{
+		unsigned long long v1 = Seed + Prime1 + Prime2;
+		unsigned long long v2 = Seed + Prime2;
+		unsigned long long v3 = Seed;
+		unsigned long long v4 = Seed - Prime1;
+		while (Data + 32 <= end)
+		{
+			v1 = HashRound(v1, Read64(Data));
+			v2 = HashRound(v2, Read64(Data + 8));
+			v3 = HashRound(v3, Read64(Data + 16));
+			v4 = HashRound(v4, Read64(Data + 24));
+			Data += 32;
+		}
+		h = Rotl64(v1, 1) + Rotl64(v2, 7) + Rotl64(v3, 12) + Rotl64(v4, 18);
+		h = HashMerge(h, v1);
+		h = HashMerge(h, v2);
+		h = HashMerge(h, v3);
+		h = HashMerge(h, v4);
+	}
+	else
+	{
+		h = Seed + Prime5;
+	}
+	h += Length;
+
+	while (Data + 8 <= end)
+	{
+		h ^= HashRound(0, Read64(Data));
+		h = Rotl64(h, 27) * Prime1 + Prime4;
+		Data += 8;
+	}
+	if (Data + 4 <= end)
+	{
+		h ^= Read32(Data) * Prime1;
+		h = Rotl64(h, 23) * Prime2 + Prime3;
+		Data += 4;
+	}
+	while (Data < end)
+	{
+		h ^= (*Data) * Prime5;
+		h = Rotl64(h, 11) * Prime1;
+		Data++;
+	}
+
+	h ^= h >> 33;
+	h *= Prime2;
+	h ^= h >> 29;
+	h *= Prime3;
+	h ^= h >> 32;
+	return h;
+}
+
+HeadlessRunner::HeadlessRunner(MachineModelType Model)
+{
+	ModelType = Model;
+	DumpDirectory = NULL;
+	Sink = NULL;
+	VideoWriter = NULL;
+	IdleSkip = true;
+	IdleCyclesSkipped = CyclesRun = 0;
+	Passed = Failed = Recorded = 0;
+	NextPending = 0;
+}
+
+bool HeadlessRunner::LoadManifest(const char* Filename)
+{
+	FILE* f = fopen(Filename, "r");
+	if (f == NULL)
+	{
+		printf("Unable to open manifest %s\n", Filename);
+		return false;
+	}
+
+	char line[1024];
+	int lineNumber = 0;
+	bool ok = true;
+	while (fgets(line, sizeof(line), f) != NULL)
+	{
+		lineNumber++;
+		char program[512], hash[64];
+		long long frame;
+		if (line[0] == '#')
+		{
+			continue;
+		}
+		int fields = sscanf(line, "%511s %lld %63s", program, &frame, hash);
+		if (fields <= 0)
+		{
+			continue; // Blank line
+		}
+		if (fields != 3 || frame < 1)
+		{
+			printf("%s:%d: expected <program> <frame> <hash>\n", Filename, lineNumber);
+			ok = false;
+			continue;
+		}
+
+		Check check;
+		check.Program = program;
+		check.Frame = frame;
+		check.HasExpected = strcmp(hash, "-") != 0;
+		check.Expected = check.HasExpected ? strtoull(hash, NULL, 16) : 0;
+		Checks.push_back(check);
+	}
+	fclose(f);
+	return ok;
+}
+
+bool HeadlessRunner::RunChecks()
+{
+	// Each program is run once, in the order it first appears, covering all of its checks.
+	std::vector<std::string> programs;
+	for (size_t i = 0; i < Checks.size(); i++)
+	{
+		if (std::find(programs.begin(), programs.end(), Checks[i].Program) == programs.end())
+		{
+			programs.push_back(Checks[i].Program);
+		}
+	}
+	for (size_t i = 0; i < programs.size(); i++)
+	{
+		RunProgram(programs[i]);
+	}
+	return Failed == 0;
+}
+
+bool HeadlessRunner::CompareFrames(const Check* A, const Check* B)
+{
+	return A->Frame < B->Frame;
+}
+
+void HeadlessRunner::RunProgram(const std::string& Program)
+{
+	Pending.clear();
+	for (size_t i = 0; i < Checks.size(); i++)
+	{
+		if (Checks[i].Program == Program)
+		{
+			Pending.push_back(&Checks[i]);
+		}
+	}
+	std::stable_sort(Pending.begin(), Pending.end(), CompareFrames);
+	NextPending = 0;
+	long long lastFrame = Pending.back()->Frame;
+
+	Emulation* emu = new Emulation();
+	emu->SetModel(ModelType);
+	emu->IdleSkipEnabled = IdleSkip;
+	emu->SystemVideo.AddFrameListener(FrameCallback, this);
+	if (Sink != NULL)
+	{
+		Sink->Attach(&emu->SystemVideo);
+	}
+	if (VideoWriter != NULL)
+	{
+		VideoWriter->Attach(&emu->SystemVideo);
+	}
+	int cyclesPerFrame = emu->Model->CyclesPerFrame();
+
+	while (emu->SystemVideo.FrameCount < BootFrames && emu->SystemVideo.FrameCount < lastFrame)
+	{
+		emu->RunCycles(cyclesPerFrame);
+	}
+
+	if (Program != "-" && emu->SystemVideo.FrameCount < lastFrame)
+	{
+		int address = LoadPrg(*emu, Program.c_str());
+		if (address < 0)
+		{
+			printf("FAIL %s: unable to load\n", Program.c_str());
+			Failed += (int)(Pending.size() - NextPending);
+			if (Sink != NULL)
+			{
+				Sink->Detach();
+			}
+			if (VideoWriter != NULL)
+			{
+				VideoWriter->Detach();
+			}
+			delete emu;
+			return;
+		}
+		if (address == 0x0801)
+		{
+			TypeKeys(*emu, "RUN\r");
+		}
+		else
+		{
+			char command[16];
+			snprintf(command, sizeof(command), "SYS%d\r", address);
+			TypeKeys(*emu, command);
+		}
+	}
+
+	while (emu->SystemVideo.FrameCount < lastFrame)
+	{
+		emu->RunCycles(cyclesPerFrame);
+	}
+	IdleCyclesSkipped += emu->IdleCyclesSkipped;
+	CyclesRun += emu->SystemCpu.Cycle;
+	if (Sink != NULL)
+	{
+		Sink->Detach();
+	}
+	if (VideoWriter != NULL)
+	{
+		VideoWriter->Detach();
+	}
+	delete emu;
+}
+
+void HeadlessRunner::FrameCallback(Video* Source, void* Context)
+{
+	((HeadlessRunner*)Context)->CheckFrame(Source);
+}
+
+void HeadlessRunner::CheckFrame(Video* Source)
+{
+	while (NextPending < Pending.size() && Pending[NextPending]->Frame == Source->FrameCount)
+	{
+		Check* check = Pending[NextPending++];
+		unsigned long long hash = HashFrame(*Source);
+		if (!check->HasExpected)
+		{
+			// Print in manifest format, ready to be pasted in as the golden value.
+			printf("%s %lld %016llx\n", check->Program.c_str(), check->Frame, hash);
+			Recorded++;
+		}
+		else if (hash == check->Expected)
+		{
+			printf("PASS %s %lld %016llx\n", check->Program.c_str(), check->Frame, hash);
+			Passed++;
+		}
+		else
+		{
+			printf("FAIL %s %lld expected %016llx got %016llx\n", check->Program.c_str(), check->Frame, check->Expected, hash);
+			Failed++;
+			if (DumpDirectory != NULL)
+			{
+				std::string name = check->Program;
+				size_t slash = name.find_last_of("/\\");
+				if (slash != std::string::npos)
+				{
+					name = name.substr(slash + 1);
+				}
+				char path[1024];
+				snprintf(path, sizeof(path), "%s/%s_%lld.ppm", DumpDirectory, name.c_str(), check->Frame);
+				if (WritePpm(*Source, path))
+				{
+					printf("  wrote %s\n", path);
+				}
+			}
+		}
+	}
+}
+
+int HeadlessRunner::LoadPrg(Emulation& Emu, const char* Filename)
+{
+	FILE* f = fopen(Filename, "rb");
+	if (f == NULL)
+	{
+		return -1;
+	}
+	unsigned char header[2];
+	if (fread(header, 1, 2, f) != 2)
+	{
+		fclose(f);
+		return -1;
+	}
+	int address = header[0] | (header[1] << 8);
+	int end = address;
+	int c;
+	while (end < 0x10000 && (c = fgetc(f)) != EOF)
+	{
+		Emu.SystemMemory.WriteRam(end++, (unsigned char)c);
+	}
+	fclose(f);
+
+	if (address == 0x0801)
+	{
+		// BASIC program: point the start of variables past it, as LOAD would.
+		Emu.SystemMemory.WriteRam(0x2D, end & 0xFF);
+		Emu.SystemMemory.WriteRam(0x2E, end >> 8);
+	}
+	return address;
+}
+
+void HeadlessRunner::TypeKeys(Emulation& Emu, const char* Text)
+{
+	Emu.SystemKeyboard.PasteText(Text);
+}
+
+unsigned long long HeadlessRunner::HashFrame(Video& Source)
+{
+	return Hash64(Source.IndexedFrame(), Source.FrameWidth() * Source.FrameHeight(), 0);
+}
+
+bool HeadlessRunner::WritePpm(Video& Source, const char* Filename)
+{
+	FILE* f = fopen(Filename, "wb");
+	if (f == NULL)
+	{
+		printf("Unable to write %s\n", Filename);
+		return false;
+	}
+	int width = Source.FrameWidth();
+	int height = Source.FrameHeight();
+	fprintf(f, "P6\n%d %d\n255\n", width, height);
+	const unsigned char* pixels = Source.IndexedFrame();
+	for (int i = 0; i < width * height; i++)
+	{
+		unsigned int color = Source.Model->Palette[pixels[i] & 0x0F];
+		fputc((color >> 16) & 0xFF, f);
+		fputc((color >> 8) & 0xFF, f);
+		fputc(color & 0xFF, f);
+	}
+	fclose(f);
+	return true;
+}
+
+static void PrintHeadlessUsage()
+{
+	printf("Usage: c64emu --headless [--pal | --ntsc] [--no-idle-skip] [--dump <directory>] [--record <path | -> | --record-shm <name>]\n");
+	printf("                         [--record-format indexed | argb] [--y4m <path | -> [--y4m-skip <n>] [--y4m-half]]\n");
+	printf("                         <manifest>\n");
+	printf("  Manifest lines: <program.prg | -> <frame> <expected hash | ->\n");
+}
+
+int HeadlessRunner::RunCommandLine(int argc, char* argv[])
+{
+	MachineModelType model = MachinePAL;
+	const char* dumpDirectory = NULL;
+	const char* manifest = NULL;
+	bool idleSkip = true;
+	for (int i = 0; i < argc; i++)
+	{
+		bool takesValue;
+		if (strcmp(argv[i], "--pal") == 0)
+		{
+			model = MachinePAL;
+		}
+		else if (strcmp(argv[i], "--ntsc") == 0)
+		{
+			model = MachineNTSC;
+		}
+		else if (strcmp(argv[i], "--no-idle-skip") == 0)
+		{
+			idleSkip = false;
+		}
+		else if (strcmp(argv[i], "--dump") == 0 && i + 1 < argc)
+		{
+			dumpDirectory = argv[++i];
+		}
+		else if (FrameSink::IsCommandLineOption(argv[i]))
+		{
+			i++; // Handled by the frame sink
+		}
+		else if (Y4mWriter::IsCommandLineOption(argv[i], &takesValue))
+		{
+			i += takesValue ? 1 : 0; // Handled by the video writer
+		}
+		else
+		{
+			manifest = argv[i];
+		}
+	}
+	if (manifest == NULL)
+	{
+		PrintHeadlessUsage();
+		return 2;
+	}
+
+	FrameSink sink;
+	bool recording = sink.OpenFromCommandLine(argc, argv);
+
+	HeadlessRunner runner(model);
+	runner.DumpDirectory = dumpDirectory;
+	runner.IdleSkip = idleSkip;
+	runner.Sink = recording ? &sink : NULL;
+	Y4mWriter writer;
+	runner.VideoWriter = writer.OpenFromCommandLine(argc, argv) ? &writer : NULL;
+	if (!runner.LoadManifest(manifest))
+	{
+		return 2;
+	}
+	bool allPassed = runner.RunChecks();
+	printf("Total: %d passed, %d failed, %d recorded\n", runner.Passed, runner.Failed, runner.Recorded);
+	if (runner.CyclesRun > 0)
+	{
+		printf("Idle loops skipped %lld of %lld cycles\n", runner.IdleCyclesSkipped, runner.CyclesRun);
+	}
+	if (recording)
+	{
+		printf("Frame sink: %lld frames written, %lld dropped\n", sink.FramesWritten, sink.FramesDropped);
+	}
+	if (runner.VideoWriter != NULL)
+	{
+		printf("Video: %lld frames written\n", writer.FramesWritten);
+	}
+	return allPassed ? 0 : 1;
+}
@@ -0,0 +1,68 @@
+#ifndef _HEADLESS_H
+#define _HEADLESS_H
+
+#include "Emulation.h"
+#include "FrameSink.h"
+#include "Y4mWriter.h"
+#include <string>
+#include <vector>
+
+// Headless regression runner.
+// Boots the machine without a window, loads and runs a program, and hashes the indexed frame buffer at chosen
+// frames, so screens can be compared against golden values without storing images.
+// The manifest has one check per line: <program.prg> <frame> <expected hash>
+// Frames are counted from power on. "-" as the program boots without loading anything, "-" as the hash records
+// the hash instead of checking it. Lines starting with # are comments.
+class HeadlessRunner
+{
+public:
+	HeadlessRunner(MachineModelType Model);
+
+	bool LoadManifest(const char* Filename);
+
+	// Run every check in the manifest. Returns true if all of the hashes matched.
+	bool RunChecks();
+
+	// Load a .prg file into RAM at the address in its first 2 bytes. Returns the load address, or -1.
+	static int LoadPrg(Emulation& Emu, const char* Filename);
+	// Type text by placing it in the KERNAL keyboard buffer (Keyboard::PasteText).
+	static void TypeKeys(Emulation& Emu, const char* Text);
+
+	// 64 bit hash (XXH64) of the palette indexes of the current frame.
+	static unsigned long long HashFrame(Video& Source);
+	static bool WritePpm(Video& Source, const char* Filename);
+
+	// Entry point for "c64emu --headless ..."
+	static int RunCommandLine(int argc, char* argv[]);
+
+	const char* DumpDirectory; // Frames that don't match are written here as PPM images, if set.
+	FrameSink* Sink; // Receives every frame of every program run, if set.
+	Y4mWriter* VideoWriter; // Same, for archival video.
+	bool IdleSkip; // Skip idle loops (see Emulation::IdleSkipEnabled). Results must be the same either way.
+	long long IdleCyclesSkipped, CyclesRun;
+	int Passed, Failed, Recorded;
+
+	static const int BootFrames = 150; // Frames to run before loading, enough for the KERNAL to reach READY.
+
+protected:
+	struct Check
+	{
+		std::string Program;
+		long long Frame;
+		bool HasExpected;
+		unsigned long long Expected;
+	};
+	std::vector<Check> Checks;
+	MachineModelType ModelType;
+
+	// Checks for the program being run, sorted by frame.
+	std::vector<Check*> Pending;
+	size_t NextPending;
+
+	void RunProgram(const std::string& Program);
+	static bool CompareFrames(const Check* A, const Check* B);
+	static void FrameCallback(Video* Source, void* Context);
+	void CheckFrame(Video* Source);
+};
+
+#endif
@@ -1,11 +1,215 @@
 #include "Keyboard.h"
+#include "Emulation.h"
 
-Keyboard::Keyboard()
+// The KERNAL scans the keyboard every 1/60 second. A key held for a bit over two scans, and released for as long,
+// is always seen, and seen as a new key even when the same one repeats.
+static const int DefaultTypeCycles = 40000;
+// How often to look for an empty keyboard buffer while pasting. Echoing a character takes the screen editor
+// a few hundred cycles, so this is about how long 10 take.
+static const int PasteCheckCycles = 4000;
+
+Keyboard::Keyboard() : evtType(CallbackType, this), evtPaste(CallbackPaste, this)
 {
 	for (int i = 0; i < 8; i++)
 	{
 		KeysDown[i] = 0;
 	}
+	RebuildMatrix();
+	AttachedEmulation = nullptr;
+	TypeHoldCycles = DefaultTypeCycles;
+	TypeReleaseCycles = DefaultTypeCycles;
+	TypeKeyHeld = false;
+	TypeHeldKey = 0;
+}
+
+void Keyboard::Setup(Emulation* UseEmulation)
+{
+	AttachedEmulation = UseEmulation;
+	evtType.Context = this;
+	evtPaste.Context = this;
+}
+
+int Keyboard::PetsciiKey(unsigned char Character)
+{
+	static const char* Plain = "@:;=,./-+*";
+	static const C64KeyMap PlainKeys[] = { C64Key_Ampersand, C64Key_Colon, C64Key_Semicolon, C64Key_Equals, C64Key_Comma, C64Key_Period, C64Key_Slash, C64Key_Minus, C64Key_Plus, C64Key_Asterisk };
+	static const char* Shifted = "!\"#$%&'()[]<>?";
+	static const C64KeyMap ShiftedKeys[] = { C64Key_1, C64Key_2, C64Key_3, C64Key_4, C64Key_5, C64Key_6, C64Key_7, C64Key_8, C64Key_9, C64Key_Colon, C64Key_Semicolon, C64Key_Comma, C64Key_Period, C64Key_Slash };
+	static const C64KeyMap Letters[] = { C64Key_A, C64Key_B, C64Key_C, C64Key_D, C64Key_E, C64Key_F, C64Key_G, C64Key_H, C64Key_I, C64Key_J, C64Key_K, C64Key_L, C64Key_M,
+		C64Key_N, C64Key_O, C64Key_P, C64Key_Q, C64Key_R, C64Key_S, C64Key_T, C64Key_U, C64Key_V, C64Key_W, C64Key_X, C64Key_Y, C64Key_Z };
+	static const C64KeyMap Digits[] = { C64Key_0, C64Key_1, C64Key_2, C64Key_3, C64Key_4, C64Key_5, C64Key_6, C64Key_7, C64Key_8, C64Key_9 };
+
+	if (Character >= 'A' && Character <= 'Z') return Letters[Character - 'A'];
+	if (Character >= 'a' && Character <= 'z') return Letters[Character - 'a'];
+	if (Character >= 0xC1 && Character <= 0xDA) return Letters[Character - 0xC1] | TypeShift;
+	if (Character >= '0' && Character <= '9') return Digits[Character - '0'];
+	for (int i = 0; Plain[i] != 0; i++)
+	{
+		if (Plain[i] == Character) return PlainKeys[i];
+	}
+	for (int i = 0; Shifted[i] != 0; i++)
+	{
+		if (Shifted[i] == Character) return ShiftedKeys[i] | TypeShift;
+	}
+
+	switch (Character)
+	{
+	case ' ': return C64Key_Space;
+	case '\r':
+	case '\n': return C64Key_Return;
+	case 0x5C: return C64Key_Pound; // PETSCII pound sign
+	case 0x5E: return C64Key_UpArrow;
+	case 0x5F: return C64Key_BackArrow;
+	case 0x03: return C64Key_Stop;
+	case 0x11: return C64Key_CursorDn;
+	case 0x91: return C64Key_CursorDn | TypeShift; // Cursor up
+	case 0x1D: return C64Key_CursorRt;
+	case 0x9D: return C64Key_CursorRt | TypeShift; // Cursor left
+	case 0x13: return C64Key_Home;
+	case 0x93: return C64Key_Home | TypeShift; // Clear screen
+	case 0x14: return C64Key_Delete;
+	case 0x94: return C64Key_Delete | TypeShift; // Insert
+	case 0x85: return C64Key_F1;
+	case 0x86: return C64Key_F3;
+	case 0x87: return C64Key_F5;
+	case 0x88: return C64Key_F7;
+	case 0x89: return C64Key_F1 | TypeShift; // F2
+	case 0x8A: return C64Key_F3 | TypeShift; // F4
+	case 0x8B: return C64Key_F5 | TypeShift; // F6
+	case 0x8C: return C64Key_F7 | TypeShift; // F8
+	}
+	return -1;
+}
+
+void Keyboard::TypeText(const char* Text)
+{
+	for (; *Text != 0; Text++)
+	{
+		int key = PetsciiKey((unsigned char)*Text);
+		if (key >= 0)
+		{
+			TypeKey(key);
+		}
+	}
+}
+
+void Keyboard::TypeKey(int Key)
+{
+	TypeQueue.push_back((unsigned char)Key);
+	if (!TypeKeyHeld && !evtType.Queued)
+	{
+		TypeNext();
+	}
+}
+
+void Keyboard::CancelTyping()
+{
+	if (TypeKeyHeld)
+	{
+		KeyUp64((C64KeyMap)(TypeHeldKey & 0x3F));
+		if (TypeHeldKey & TypeShift)
+		{
+			KeyUp64(C64Key_LShift);
+		}
+		TypeKeyHeld = false;
+	}
+	TypeQueue.clear();
+	if (evtType.Queued)
+	{
+		AttachedEmulation->CancelEvent(&evtType);
+	}
+	PasteQueue.clear();
+	if (evtPaste.Queued)
+	{
+		AttachedEmulation->CancelEvent(&evtPaste);
+	}
+}
+
+void Keyboard::PasteText(const char* Text)
+{
+	for (; *Text != 0; Text++)
+	{
+		unsigned char c = (unsigned char)*Text;
+		// Same characters as TypeText: either case is an unshifted letter, and a newline is RETURN.
+		if (c >= 'a' && c <= 'z')
+		{
+			c -= 'a' - 'A';
+		}
+		else if (c == '\n')
+		{
+			c = '\r';
+		}
+		PasteQueue.push_back(c);
+	}
+	if (!evtPaste.Queued)
+	{
+		PasteNext();
+	}
+}
+
+void Keyboard::CallbackPaste(EventRequest* Request)
+{
+	((Keyboard*)Request->Context)->PasteNext();
+}
+
+void Keyboard::PasteNext()
+{
+	Memory& memory = AttachedEmulation->SystemMemory;
+	// Only refill an empty buffer. Removing a key shifts the buffer down with interrupts disabled, but an event can
+	// land in the middle of that, and once the count is 0 the shift is done.
+	if (memory.ReadRam(0xC6) == 0)
+	{
+		int count = 0;
+		while (!PasteQueue.empty() && count < 10)
+		{
+			memory.PokeRam(0x0277 + count, PasteQueue.front());
+			PasteQueue.pop_front();
+			count++;
+		}
+		memory.PokeRam(0xC6, count);
+	}
+	if (!PasteQueue.empty())
+	{
+		AttachedEmulation->QueueEvent(AttachedEmulation->SystemCpu.Cycle + PasteCheckCycles, &evtPaste);
+	}
+}
+
+void Keyboard::CallbackType(EventRequest* Request)
+{
+	Keyboard* keyboard = (Keyboard*)Request->Context;
+	if (keyboard->TypeKeyHeld)
+	{
+		keyboard->KeyUp64((C64KeyMap)(keyboard->TypeHeldKey & 0x3F));
+		if (keyboard->TypeHeldKey & TypeShift)
+		{
+			keyboard->KeyUp64(C64Key_LShift);
+		}
+		keyboard->TypeKeyHeld = false;
+		if (!keyboard->TypeQueue.empty())
+		{
+			// Released long enough for the KERNAL to see it, then the next one goes down.
+			keyboard->AttachedEmulation->QueueEvent(keyboard->AttachedEmulation->SystemCpu.Cycle + keyboard->TypeReleaseCycles, &keyboard->evtType);
+		}
+		return;
+	}
+	keyboard->TypeNext();
+}
+
+void Keyboard::TypeNext()
+{
+	if (TypeQueue.empty())
+	{
+		return;
+	}
+	TypeHeldKey = TypeQueue.front();
+	TypeQueue.pop_front();
+	if (TypeHeldKey & TypeShift)
+	{
+		KeyDown64(C64Key_LShift);
+	}
+	KeyDown64((C64KeyMap)(TypeHeldKey & 0x3F));
+	TypeKeyHeld = true;
+	AttachedEmulation->QueueEvent(AttachedEmulation->SystemCpu.Cycle + TypeHoldCycles, &evtType);
 }
 
 void Keyboard::KeyEvent(SDL_KeyboardEvent& keyEvent)
@@ -109,33 +313,62 @@ void Keyboard::KeyDown64(C64KeyMap key)
 {
 	int arrayIndex = key & 7;
 	int arrayBit = (key >> 3) & 7;
-	KeysDown[arrayIndex] |= 1 << arrayBit;
+	if (!(KeysDown[arrayIndex] & (1 << arrayBit)))
+	{
+		KeysDown[arrayIndex] |= 1 << arrayBit;
+		RebuildMatrix();
+	}
 }
 void Keyboard::KeyUp64(C64KeyMap key)
 {
 	int arrayIndex = key & 7;
 	int arrayBit = (key >> 3) & 7;
-	KeysDown[arrayIndex] &= ~(1 << arrayBit);
+	if (KeysDown[arrayIndex] & (1 << arrayBit))
+	{
+		KeysDown[arrayIndex] &= ~(1 << arrayBit);
+		RebuildMatrix();
+	}
 }
 
-void Keyboard::UpdateKeyboardMatrix(unsigned char & PRA, unsigned char & PRB, unsigned char DDRA, unsigned char DDRB)
+void Keyboard::RebuildMatrix()
 {
-	// Figure out if we should modify the port registers based on keyboard state.
-	// I'm making the assumption that the C64 keyboard has diodes;
-	//   So any bit in port A that's driven to 0 will lead to corresponding bits in port B being pulled to 0 if the corresponding key is pressed.
-	//   We'll see if this turns out to be correct.
-
-	unsigned char drivenBits = PRA | (~DDRA);
-	unsigned char matrixOutput = 0xFF;
-
+	// Keys by port B line, for the reverse direction.
+	unsigned char keysByColumn[8] = { 0 };
 	for (int i = 0; i < 8; i++)
 	{
-		if ((drivenBits & (1 << i)) == 0)
+		for (int j = 0; j < 8; j++)
 		{
-			matrixOutput &= ~(KeysDown[i]);
+			if (KeysDown[i] & (1 << j))
+			{
+				keysByColumn[j] |= 1 << i;
+			}
 		}
 	}
 
-	// For any inputs in Port B, overwrite the bits with matrixOutput
-	PRB = (PRB & DDRB) | ((~DDRB) & matrixOutput);
+	// Each entry is the one with its lowest low line released, less the keys on that line. Working down from $FF
+	// (nothing driven), that entry is always already done.
+	ColumnsForRows[0xFF] = 0xFF;
+	RowsForColumns[0xFF] = 0xFF;
+	for (int lines = 0xFE; lines >= 0; lines--)
+	{
+		int line = 0;
+		while (lines & (1 << line))
+		{
+			line++;
+		}
+		ColumnsForRows[lines] = ColumnsForRows[lines | (1 << line)] & ~KeysDown[line];
+		RowsForColumns[lines] = RowsForColumns[lines | (1 << line)] & ~keysByColumn[line];
+	}
+}
+
+void Keyboard::UpdateKeyboardMatrix(unsigned char & PRA, unsigned char & PRB, unsigned char DDRA, unsigned char DDRB)
+{
+	// The C64 keyboard has no diodes, so a pressed key connects its lines both ways: a port A line driven low pulls
+	// down the port B inputs of the keys pressed on it, and a port B line driven low does the same to port A inputs.
+	// Input bits in PRA and PRB are expected to hold the line levels (floating high, or pulled low by a joystick).
+	unsigned char linesA = PRA | (~DDRA);
+	unsigned char linesB = PRB | (~DDRB);
+
+	PRA &= DDRA | RowsForColumns[linesB];
+	PRB &= DDRB | ColumnsForRows[linesA];
 }
\ No newline at end of file
@@ -2,6 +2,10 @@
 #define _KEYBOARD_H
 
 #include "c64emu.h"
+#include "EmulationEvent.h"
+#include <deque>
+
+class Emulation;
 
 
 // Map of key codes to C64 key matrix location. 
@@ -95,10 +99,54 @@ public:
 
 	void UpdateKeyboardMatrix(unsigned char & PRA, unsigned char & PRB, unsigned char DDRA, unsigned char DDRB);
 
+	// Also used to attach a copy.
+	void Setup(Emulation* UseEmulation);
+	Emulation* AttachedEmulation;
+
+	// Scripted typing. Queued keys are pressed for TypeHoldCycles and then released for TypeReleaseCycles, timed
+	// by emulation events, so typing keeps pace with the KERNAL keyboard scan at any emulation speed.
+	// Text is PETSCII (unshifted letters are A-Z or a-z, shifted letters $C1-$DA), \r or \n is RETURN. Characters
+	// without a key are skipped.
+	void TypeText(const char* Text);
+	// Key is a C64KeyMap, add TypeShift to hold shift with it.
+	void TypeKey(int Key);
+	// Bulk text entry. Text goes straight into the KERNAL keyboard buffer ($0277, count in $C6), 10 characters at a
+	// time, and the buffer is refilled each time the machine has emptied it. The matrix isn't involved, so this
+	// only works while the KERNAL is reading the buffer (BASIC input, GETIN), but it takes no scan time per key.
+	void PasteText(const char* Text);
+	// Cancels both typing and pasting.
+	void CancelTyping();
+	bool TypingDone() { return TypeQueue.empty() && !TypeKeyHeld && PasteQueue.empty(); }
+	int TypeHoldCycles, TypeReleaseCycles;
+
+	static const int TypeShift = 0x40;
+	// Key (and TypeShift) that types a PETSCII character, or -1.
+	static int PetsciiKey(unsigned char Character);
+
 	// Stores a bitmap of which keys are currently held down.
 	// Array index is the port A index, the bits are the keys that are pressed.
 	// Here, the bit being set means it's pressed, but when the C64 reads this, it writes a '0' to the Port A line it wants to test, and port B will be '0' for lines where a key is pressed.
 	unsigned char KeysDown[8];
+
+protected:
+	// The matrix as seen from each port, indexed by the line levels on the other one: the port B lines pulled low
+	// for each combination of port A lines, and the other way around. Rebuilt when a key changes.
+	unsigned char ColumnsForRows[256];
+	unsigned char RowsForColumns[256];
+	void RebuildMatrix();
+
+	std::deque<unsigned char> TypeQueue;
+	bool TypeKeyHeld;
+	unsigned char TypeHeldKey;
+
+	EventRequest evtType;
+	static void CallbackType(EventRequest* Request);
+	void TypeNext();
+
+	std::deque<unsigned char> PasteQueue;
+	EventRequest evtPaste;
+	static void CallbackPaste(EventRequest* Request);
+	void PasteNext();
 };
 
 #endif
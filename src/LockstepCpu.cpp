@@ -0,0 +1,398 @@
+#include "LockstepCpu.h"
+#include "Memory.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define LOCKSTEP_USE_SSE 1
+#include <emmintrin.h>
+#else
+#define LOCKSTEP_USE_SSE 0
+#endif
+
+// Status flag bits, as in Cpu.
+static const unsigned char NFlag = 0x80;
+static const unsigned char VFlag = 0x40;
+static const unsigned char DFlag = 0x08;
+static const unsigned char ZFlag = 0x02;
+static const unsigned char CFlag = 0x01;
+
+static int CountBits(int Bits)
+{
+	int count = 0;
+	while (Bits)
+	{
+		Bits &= Bits - 1;
+		count++;
+	}
+	return count;
+}
+
+static int LowestBit(int Bits)
+{
+	int index = 0;
+	while ((Bits & (1 << index)) == 0)
+	{
+		index++;
+	}
+	return index;
+}
+
+#if LOCKSTEP_USE_SSE
+// 0xFF in every byte whose lane bit is set.
+static __m128i ByteMask(int LaneBits)
+{
+	__m128i bits = _mm_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128);
+	__m128i spread = _mm_unpacklo_epi64(_mm_set1_epi8((char)(LaneBits & 0xFF)), _mm_set1_epi8((char)(LaneBits >> 8)));
+	return _mm_cmpeq_epi8(_mm_and_si128(spread, bits), bits);
+}
+
+static __m128i Select(__m128i Mask, __m128i IfSet, __m128i IfClear)
+{
+	return _mm_or_si128(_mm_and_si128(Mask, IfSet), _mm_andnot_si128(Mask, IfClear));
+}
+
+// Replace N and Z with the flags for Result.
+static __m128i ResultFlags(__m128i Status, __m128i Result)
+{
+	__m128i n = _mm_and_si128(Result, _mm_set1_epi8((char)NFlag));
+	__m128i z = _mm_and_si128(_mm_cmpeq_epi8(Result, _mm_setzero_si128()), _mm_set1_epi8(ZFlag));
+	Status = _mm_andnot_si128(_mm_set1_epi8((char)(NFlag | ZFlag)), Status);
+	return _mm_or_si128(Status, _mm_or_si128(n, z));
+}
+
+// 1 in every byte where Value has the bits in Bit set.
+static __m128i BitSet(__m128i Value, unsigned char Bit)
+{
+	__m128i bit = _mm_set1_epi8((char)Bit);
+	return _mm_and_si128(_mm_cmpeq_epi8(_mm_and_si128(Value, bit), bit), _mm_set1_epi8(1));
+}
+
+static __m128i ShiftRight1(__m128i Value)
+{
+	// No 8 bit shifts in SSE2, shift 16 bit words and drop the bit that came from the neighbouring byte.
+	return _mm_and_si128(_mm_srli_epi16(Value, 1), _mm_set1_epi8(0x7F));
+}
+#endif
+
+LockstepCpu::LockstepCpu()
+{
+	DetachAll();
+	VectorSteps = ScalarSteps = 0;
+}
+
+void LockstepCpu::AttachLane(int Lane, Cpu* LaneCpu)
+{
+	LaneCpus[Lane] = LaneCpu;
+	if (Lane >= LaneCount)
+	{
+		LaneCount = Lane + 1;
+	}
+}
+
+void LockstepCpu::DetachAll()
+{
+	for (int i = 0; i < Lanes; i++)
+	{
+		LaneCpus[i] = nullptr;
+		A[i] = X[i] = Y[i] = S[i] = P[i] = 0;
+		PC[i] = 0;
+		Cycle[i] = 0;
+	}
+	LaneCount = 0;
+	ActiveLanes = 0;
+}
+
+void LockstepCpu::LoadLanes()
+{
+	ActiveLanes = 0;
+	for (int i = 0; i < LaneCount; i++)
+	{
+		if (LaneCpus[i] == nullptr)
+		{
+			continue;
+		}
+		CpuRegisters regs;
+		LaneCpus[i]->GetRegisters(regs);
+		A[i] = regs.A;
+		X[i] = regs.X;
+		Y[i] = regs.Y;
+		S[i] = regs.S;
+		P[i] = regs.P;
+		PC[i] = regs.PC;
+		Cycle[i] = LaneCpus[i]->Cycle;
+		if (LaneCpus[i]->Running)
+		{
+			ActiveLanes |= 1 << i;
+		}
+	}
+}
+
+void LockstepCpu::StoreLanes()
+{
+	for (int i = 0; i < LaneCount; i++)
+	{
+		if (LaneCpus[i] == nullptr)
+		{
+			continue;
+		}
+		CpuRegisters regs;
+		regs.A = A[i];
+		regs.X = X[i];
+		regs.Y = Y[i];
+		regs.S = S[i];
+		regs.P = P[i];
+		regs.PC = PC[i];
+		LaneCpus[i]->SetRegisters(regs);
+		LaneCpus[i]->Cycle = Cycle[i];
+	}
+}
+
+void LockstepCpu::ScalarStep(int Lane)
+{
+	Cpu* cpu = LaneCpus[Lane];
+	CpuRegisters regs;
+	regs.A = A[Lane];
+	regs.X = X[Lane];
+	regs.Y = Y[Lane];
+	regs.S = S[Lane];
+	regs.P = P[Lane];
+	regs.PC = PC[Lane];
+	cpu->SetRegisters(regs);
+	cpu->Cycle = Cycle[Lane];
+
+	if (!cpu->Step())
+	{
+		ActiveLanes &= ~(1 << Lane);
+	}
+	ScalarSteps++;
+
+	cpu->GetRegisters(regs);
+	A[Lane] = regs.A;
+	X[Lane] = regs.X;
+	Y[Lane] = regs.Y;
+	S[Lane] = regs.S;
+	P[Lane] = regs.P;
+	PC[Lane] = regs.PC;
+	Cycle[Lane] = cpu->Cycle;
+}
+
+int LockstepCpu::GroupLanes(int Leader)
+{
+	// Lanes at the leader's PC.
+#if LOCKSTEP_USE_SSE
+	__m128i pc = _mm_set1_epi16((short)PC[Leader]);
+	__m128i low = _mm_cmpeq_epi16(_mm_load_si128((const __m128i*)&PC[0]), pc);
+	__m128i high = _mm_cmpeq_epi16(_mm_load_si128((const __m128i*)&PC[8]), pc);
+	return _mm_movemask_epi8(_mm_packs_epi16(low, high)) & ActiveLanes;
+#else
+	int lanes = 0;
+	for (int i = 0; i < Lanes; i++)
+	{
+		if (PC[i] == PC[Leader])
+		{
+			lanes |= 1 << i;
+		}
+	}
+	return lanes & ActiveLanes;
+#endif
+}
+
+bool LockstepCpu::Run(long long Instructions)
+{
+	LoadLanes();
+
+	for (long long n = 0; n < Instructions && ActiveLanes != 0; n++)
+	{
+		// Every set of lanes sharing a PC is a group. Usually that's one group with all of the lanes.
+		int remaining = ActiveLanes;
+		while (remaining != 0)
+		{
+			int leader = LowestBit(remaining);
+			int group = GroupLanes(leader) & remaining;
+			remaining &= ~group;
+
+			// Members also need the instruction bytes on the same RAM pages as the leader (they can differ after
+			// self modifying code), and no interrupt to take first. Lanes with a debugger or coverage map attached
+			// need the per instruction hooks in Cpu::Step, so they always run scalar.
+			Memory* memory = LaneCpus[leader]->AttachedMemory;
+			unsigned short pc = PC[leader];
+			unsigned short next = (pc + 1) & 0xFFFF;
+			RamPageBlock* page = memory->RamPages[pc >> 8];
+			RamPageBlock* nextPage = memory->RamPages[next >> 8];
+			int vectorLanes = group;
+			for (int i = 0; i < LaneCount; i++)
+			{
+				if (vectorLanes & (1 << i))
+				{
+					Memory* laneMemory = LaneCpus[i]->AttachedMemory;
+					if (!laneMemory->FlatMemory || laneMemory->RamPages[pc >> 8] != page || laneMemory->RamPages[next >> 8] != nextPage
+						|| LaneCpus[i]->InterruptPending() || LaneCpus[i]->AttachedDebugger != nullptr || LaneCpus[i]->CoverageMap != nullptr)
+					{
+						vectorLanes &= ~(1 << i);
+					}
+				}
+			}
+
+			int scalarLanes = group;
+			if (vectorLanes != 0 && VectorStep(vectorLanes, page->Data[pc & 0xFF], nextPage->Data[next & 0xFF]))
+			{
+				VectorSteps += CountBits(vectorLanes);
+				scalarLanes &= ~vectorLanes;
+			}
+			for (int i = 0; i < LaneCount; i++)
+			{
+				if (scalarLanes & (1 << i))
+				{
+					ScalarStep(i);
+				}
+			}
+		}
+	}
+
+	StoreLanes();
+	return ActiveLanes != 0;
+}
+
+bool LockstepCpu::VectorStep(int Group, unsigned char Instruction, unsigned char Operand)
+{
+#if LOCKSTEP_USE_SSE
+	// Register-only instructions. These can't branch, touch memory or change the interrupt disable flag, so the
+	// group stays together. Everything else is left to the interpreter.
+	__m128i a = _mm_load_si128((const __m128i*)A);
+	__m128i x = _mm_load_si128((const __m128i*)X);
+	__m128i y = _mm_load_si128((const __m128i*)Y);
+	__m128i s = _mm_load_si128((const __m128i*)S);
+	__m128i p = _mm_load_si128((const __m128i*)P);
+	__m128i imm = _mm_set1_epi8((char)Operand);
+	__m128i one = _mm_set1_epi8(1);
+
+	__m128i result = _mm_setzero_si128();
+	__m128i status = p;
+	unsigned char* destination = nullptr;
+	bool setFlags = true;
+	int length = 1;
+
+	switch (Instruction)
+	{
+	case 0xA9: result = imm; destination = A; length = 2; break; // LDA #
+	case 0xA2: result = imm; destination = X; length = 2; break; // LDX #
+	case 0xA0: result = imm; destination = Y; length = 2; break; // LDY #
+	case 0x29: result = _mm_and_si128(a, imm); destination = A; length = 2; break; // AND #
+	case 0x09: result = _mm_or_si128(a, imm); destination = A; length = 2; break; // ORA #
+	case 0x49: result = _mm_xor_si128(a, imm); destination = A; length = 2; break; // EOR #
+
+	case 0xAA: result = a; destination = X; break; // TAX
+	case 0xA8: result = a; destination = Y; break; // TAY
+	case 0x8A: result = x; destination = A; break; // TXA
+	case 0x98: result = y; destination = A; break; // TYA
+	case 0xBA: result = s; destination = X; break; // TSX
+	case 0x9A: result = x; destination = S; setFlags = false; break; // TXS
+
+	case 0xE8: result = _mm_add_epi8(x, one); destination = X; break; // INX
+	case 0xC8: result = _mm_add_epi8(y, one); destination = Y; break; // INY
+	case 0xCA: result = _mm_sub_epi8(x, one); destination = X; break; // DEX
+	case 0x88: result = _mm_sub_epi8(y, one); destination = Y; break; // DEY
+
+	case 0x0A: // ASL A
+		status = _mm_or_si128(_mm_andnot_si128(one, status), BitSet(a, 0x80));
+		result = _mm_add_epi8(a, a);
+		destination = A;
+		break;
+	case 0x4A: // LSR A
+		status = _mm_or_si128(_mm_andnot_si128(one, status), _mm_and_si128(a, one));
+		result = ShiftRight1(a);
+		destination = A;
+		break;
+	case 0x2A: // ROL A
+		result = _mm_or_si128(_mm_add_epi8(a, a), _mm_and_si128(status, one));
+		status = _mm_or_si128(_mm_andnot_si128(one, status), BitSet(a, 0x80));
+		destination = A;
+		break;
+	case 0x6A: // ROR A
+		result = _mm_or_si128(ShiftRight1(a), _mm_slli_epi16(_mm_and_si128(status, one), 7));
+		status = _mm_or_si128(_mm_andnot_si128(one, status), _mm_and_si128(a, one));
+		destination = A;
+		break;
+
+	case 0x69: // ADC #
+	case 0xE9: // SBC #, which is ADC of the complement (decimal mode isn't emulated)
+	{
+		__m128i m = Instruction == 0x69 ? imm : _mm_set1_epi8((char)~Operand);
+		__m128i carryIn = _mm_and_si128(status, one);
+		__m128i sum = _mm_add_epi8(a, m);
+		// The wrapped and saturated sums differ when the addition carried out.
+		__m128i carry = _mm_andnot_si128(_mm_cmpeq_epi8(_mm_adds_epu8(a, m), sum), one);
+		result = _mm_add_epi8(sum, carryIn);
+		carry = _mm_or_si128(carry, _mm_and_si128(_mm_cmpeq_epi8(sum, _mm_set1_epi8(-1)), carryIn));
+		// Overflow when both inputs have the same sign and the result's differs.
+		__m128i overflow = _mm_andnot_si128(_mm_xor_si128(a, m), _mm_xor_si128(a, result));
+		overflow = _mm_and_si128(_mm_srli_epi16(overflow, 1), _mm_set1_epi8(VFlag));
+		status = _mm_andnot_si128(_mm_set1_epi8(VFlag | CFlag), status);
+		status = _mm_or_si128(status, _mm_or_si128(carry, overflow));
+		destination = A;
+		length = 2;
+		break;
+	}
+
+	case 0xC9: // CMP #
+	case 0xE0: // CPX #
+	case 0xC0: // CPY #
+	{
+		__m128i reg = Instruction == 0xC9 ? a : (Instruction == 0xE0 ? x : y);
+		result = _mm_sub_epi8(reg, imm);
+		// No borrow when reg >= operand.
+		__m128i carry = _mm_and_si128(_mm_cmpeq_epi8(_mm_max_epu8(reg, imm), reg), one);
+		status = _mm_or_si128(_mm_andnot_si128(one, status), carry);
+		length = 2;
+		break;
+	}
+
+	case 0x18: status = _mm_andnot_si128(_mm_set1_epi8(CFlag), status); setFlags = false; break; // CLC
+	case 0x38: status = _mm_or_si128(_mm_set1_epi8(CFlag), status); setFlags = false; break; // SEC
+	case 0xB8: status = _mm_andnot_si128(_mm_set1_epi8(VFlag), status); setFlags = false; break; // CLV
+	case 0xD8: status = _mm_andnot_si128(_mm_set1_epi8(DFlag), status); setFlags = false; break; // CLD
+	case 0xF8: status = _mm_or_si128(_mm_set1_epi8(DFlag), status); setFlags = false; break; // SED
+	case 0xEA: setFlags = false; break; // NOP
+
+	default:
+		return false;
+	}
+
+	__m128i mask = ByteMask(Group);
+	if (setFlags)
+	{
+		status = ResultFlags(status, result);
+	}
+	_mm_store_si128((__m128i*)P, Select(mask, status, p));
+	if (destination != nullptr)
+	{
+		__m128i old = _mm_load_si128((const __m128i*)destination);
+		_mm_store_si128((__m128i*)destination, Select(mask, result, old));
+	}
+
+	// Every instruction takes 2 cycles in the interpreter.
+	for (int i = 0; i < Lanes; i++)
+	{
+		int inGroup = (Group >> i) & 1;
+		PC[i] = (unsigned short)(PC[i] + inGroup * length);
+		Cycle[i] += inGroup * 2;
+	}
+	return true;
+#else
+	// No SSE2, every lane steps through the interpreter.
+	(void)Group;
+	(void)Instruction;
+	(void)Operand;
+	return false;
+#endif
+}
+
+bool LockstepCpu::CpuTestStep(Cpu* cpu, void* context)
+{
+	LockstepCpu* engine = (LockstepCpu*)context;
+	if (engine->LaneCount != 1 || engine->LaneCpus[0] != cpu)
+	{
+		engine->DetachAll();
+		engine->AttachLane(0, cpu);
+	}
+	return engine->Step();
+}
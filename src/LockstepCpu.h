@@ -0,0 +1,56 @@
+#ifndef _LOCKSTEPCPU_H
+#define _LOCKSTEPCPU_H
+
+#include "Cpu.h"
+
+// Runs up to 16 CPUs in lockstep, for many runs of the same program with different inputs.
+// The register files are kept in structure of arrays form, so one SSE2 register holds a register of every lane.
+// Without SSE2 the groups are still formed, but every lane steps through the interpreter.
+// Lanes at the same PC whose code is on the same (shared) RAM page form a group, and register-only instructions
+// execute for the whole group at once. Anything else, and every lane that has diverged from the group, steps
+// through the scalar Cpu::Step. Diverged lanes rejoin as soon as they reach the group's PC again.
+// Lanes are expected to run on flat memory (no banking or IO), typically forked from one image so that code
+// pages stay shared while each lane's data pages are copied on write.
+class LockstepCpu
+{
+public:
+	static const int Lanes = 16;
+
+	LockstepCpu();
+
+	void AttachLane(int Lane, Cpu* LaneCpu);
+	void DetachAll();
+	int LaneCount;
+
+	// Run every lane for a number of instructions. Returns false once every lane has stopped.
+	bool Run(long long Instructions);
+	bool Step() { return Run(1); }
+
+	// Lane-instructions executed by the vector path and by the scalar interpreter.
+	long long VectorSteps, ScalarSteps;
+
+	// Step function for CpuTest. The context is a LockstepCpu, the CPU under test becomes its only lane.
+	static bool CpuTestStep(Cpu* cpu, void* context);
+
+protected:
+	Cpu* LaneCpus[Lanes];
+
+	// Structure of arrays register file. Authoritative while Run is executing.
+	alignas(16) unsigned char A[Lanes];
+	alignas(16) unsigned char X[Lanes];
+	alignas(16) unsigned char Y[Lanes];
+	alignas(16) unsigned char S[Lanes];
+	alignas(16) unsigned char P[Lanes];
+	alignas(16) unsigned short PC[Lanes];
+	long long Cycle[Lanes];
+
+	int ActiveLanes; // Bit per lane that is running and has no interrupt to take.
+
+	void LoadLanes();
+	void StoreLanes();
+	void ScalarStep(int Lane);
+	int GroupLanes(int Leader);
+	bool VectorStep(int Group, unsigned char Instruction, unsigned char Operand);
+};
+
+#endif
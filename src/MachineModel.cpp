@@ -0,0 +1,24 @@
+#include "MachineModel.h"
+
+// The VIC-II generates each color as a luma level plus a chroma phase, and the TV standard changes how the signal
+// is decoded, which is mostly the gamma. The palettes are worked out from the luma levels of the later chip
+// revisions ({ 0, 256, 80, 160, 96, 128, 64, 192, 96, 64, 128, 80, 120, 192, 120, 160 } of 256) and chroma phases
+// in 1/16ths of a circle, with 20% contrast boost, saturation 40, and each model's gamma corrected to 2.2.
+static const MachineModel Models[2] =
+{
+	{ MachinePAL, "PAL 6569", 985248, 50,
+		ModelGeometry<MachinePAL>::CyclesPerLine, ModelGeometry<MachinePAL>::LinesPerFrame,
+		504 - 22, 403, 16, 284, 2.8,
+		{ 0xFF000000, 0xFFFFFFFF, 0xFF813338, 0xFF75CEC8, 0xFF8E3C97, 0xFF56AC4D, 0xFF2E2C9B, 0xFFEDF171,
+		  0xFF8E5029, 0xFF553800, 0xFFC46C71, 0xFF4A4A4A, 0xFF7B7B7B, 0xFFA9FF9F, 0xFF706DEB, 0xFFB2B2B2 } },
+	{ MachineNTSC, "NTSC 6567R8", 1022727, 60,
+		ModelGeometry<MachineNTSC>::CyclesPerLine, ModelGeometry<MachineNTSC>::LinesPerFrame,
+		520 - 25, 418, 28, 235, 2.2,
+		{ 0xFF000000, 0xFFFFFFFF, 0xFF96484D, 0xFF8AD8D3, 0xFFA151A9, 0xFF6CBB63, 0xFF4240AC, 0xFFF1F487,
+		  0xFFA1673D, 0xFF6B4D00, 0xFFCF8287, 0xFF606060, 0xFF909090, 0xFFB9FFB0, 0xFF8583F0, 0xFFC0C0C0 } },
+};
+
+const MachineModel* GetMachineModel(MachineModelType Type)
+{
+	return &Models[Type];
+}
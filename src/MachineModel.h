@@ -0,0 +1,40 @@
+#ifndef _MACHINEMODEL_H
+#define _MACHINEMODEL_H
+
+enum MachineModelType
+{
+	MachinePAL, // 6569 VIC-II, Europe
+	MachineNTSC // 6567R8 VIC-II, North America
+};
+
+// Raster geometry as compile time constants, so the raster loop can be specialized per model.
+template <MachineModelType Type> struct ModelGeometry;
+template <> struct ModelGeometry<MachinePAL> { static const int CyclesPerLine = 63; static const int LinesPerFrame = 312; };
+template <> struct ModelGeometry<MachineNTSC> { static const int CyclesPerLine = 65; static const int LinesPerFrame = 263; };
+
+// Timing and display parameters for one C64 variant.
+struct MachineModel
+{
+	MachineModelType Type;
+	const char* Name;
+
+	int CpuClockHz;
+	int MainsHz; // Drives the CIA time of day clocks.
+
+	int CyclesPerLine;
+	int LinesPerFrame;
+
+	// Visible part of the frame. X is in sprite coordinates, and wraps around the end of the line so the left
+	// border is made of the last pixels of the line. The display window starts at X=24.
+	int FirstVisibleX, VisibleWidth;
+	int FirstVisibleLine, VisibleLines;
+
+	double DecoderGamma; // Gamma of the TV standard, the palette was derived from it.
+	unsigned int Palette[16]; // ARGB8888
+
+	int CyclesPerFrame() const { return CyclesPerLine * LinesPerFrame; }
+};
+
+const MachineModel* GetMachineModel(MachineModelType Type);
+
+#endif
@@ -3,8 +3,12 @@
 #include "Memory.h"
 #include "Video.h"
 #include "Keyboard.h"
+#include "ControlPorts.h"
+#include "Sid.h"
 #include "Emulation.h"
+#include "Debugger.h"
 #include <stdio.h>
+#include <string.h>
 
 #define TRACE_IO_ACCESS 1
 
@@ -19,16 +23,20 @@ static void ignore_args(...)
 #define PRINT_IO ignore_args
 #endif
 
-CIAChip::CIAChip(int CpuInterruptSourceIndex) : evtTimerA(CallbackTimerA, this), evtTimerB(CallbackTimerB, this)
+CIAChip::CIAChip(int CpuInterruptSourceIndex) : evtTimerA(CallbackTimerA, this), evtTimerB(CallbackTimerB, this), evtAlarm(CallbackAlarm, this), evtSerial(CallbackSerial, this)
 {
 	InterruptSourceIndex = CpuInterruptSourceIndex;
+	CpuClockHz = 1022727;
+	MainsHz = 60;
 }
 
-void CIAChip::Setup(Memory* useMemory, FnPtrCiaCallback readFn, FnPtrCiaCallback writeFn)
+void CIAChip::Setup(Memory* useMemory, FnPtrCiaReadCallback readFn, FnPtrCiaCallback writeFn)
 {
 	AttachedMemory = useMemory;
 	CbRead = readFn;
 	CbWrite = writeFn;
+	// A copied chip keeps its events (and their queue state), but they have to call back into this chip.
+	evtTimerA.Context = evtTimerB.Context = evtAlarm.Context = evtSerial.Context = this;
 }
 
 void CIAChip::Reset()
@@ -41,6 +49,20 @@ void CIAChip::Reset()
 	IntFlags = 0;
 	IntMask = 0;
 	MaskedFlags = 0;
+	LastEventA = LastEventB = 0;
+	LastUnderflowA = LastUnderflowB = -1;
+	ToggleA = ToggleB = false;
+
+	// The time of day clock powers up running from 1:00:00.0 AM
+	TodBaseCycle = 0;
+	TodBaseTenths = TodTenthsPerHour;
+	TodAlarm = 0;
+	TodRunning = true;
+	TodLatched = false;
+
+	SDR = 0;
+	SerialShiftCount = 0;
+	SerialPending = false;
 }
 
 
@@ -65,32 +87,60 @@ void CIAChip::Write8(int Address, unsigned char Data8)
 		DDRB = Data8;
 		break;
 	case 4: // TA Lo
+		UpdateTimers();
 		TALatch = (TALatch & 0xFF00) | Data8;
+		ScheduleTimers();
 		break;
 	case 5: // TA Hi
+		UpdateTimers();
 		TALatch = (TALatch & 0xFF) | (Data8 << 8);
 		if ((CRA & CR_START) == 0)
 		{
 			TAValue = TALatch;
 		}
+		ScheduleTimers();
 		break;
 	case 6: // TB Lo
+		UpdateTimers();
 		TBLatch = (TBLatch & 0xFF00) | Data8;
+		ScheduleTimers();
 		break;
 	case 7: // TB Hi
+		UpdateTimers();
 		TBLatch = (TBLatch & 0xFF) | (Data8 << 8);
 		if ((CRB & CR_START) == 0)
 		{
 			TBValue = TBLatch;
 		}
+		ScheduleTimers();
 		break;
 	case 8: // TOD 10ths
 	case 9: // TOD Sec
 	case 10: // TOD Min
 	case 11: // TOD Hr
+		WriteTod(Address & 15, Data8);
+		break;
 	case 12: // SDR
+		UpdateTimers();
+		SDR = Data8;
+		if (CRA & CRA_SPMODE)
+		{
+			// Output mode: the byte shifts out one bit every two timer A underflows.
+			if (SerialShiftCount == 0)
+			{
+				SerialShiftCount = 16;
+			}
+			else
+			{
+				// Already shifting, this byte follows when the current one is done.
+				SerialPending = true;
+			}
+		}
+		ScheduleTimers();
 		break;
 	case 13: // ICR
+		// Bring the interrupt flags up to date before the mask changes.
+		UpdateTimers();
 		if (Data8 & 0x80)
 		{
 			// Set interrupt mask bits
@@ -102,38 +152,55 @@ void CIAChip::Write8(int Address, unsigned char Data8)
 			IntMask &= ~(Data8 & 0x1F);
 		}
 		UpdateInterruptStatus();
+		// Timer events are only needed for unmasked interrupts, so the mask changes what has to be scheduled.
+		ScheduleTimers();
 		break;
 
 	case 14: // CRA
-		// If timer was running, Update its value.
-		if (CRA & CR_START)
+		// Bring both timers up to the current cycle under the old control value.
+		UpdateTimers();
+
+		if ((Data8 & CR_START) && !(CRA & CR_START))
 		{
-			UpdateTimerA();
+			// The toggle output goes high whenever the timer is started.
+			ToggleA = true;
 		}
-
 		if (Data8 & CR_LOAD)
 		{
+			// Force load. This bit is a strobe and isn't stored.
 			TAValue = TALatch;
 		}
+		if ((Data8 ^ CRA) & CRA_TODIN)
+		{
+			// The TOD divider is changing, restart the time of day count from the current time.
+			RebaseTod();
+		}
+		if ((Data8 & CRA_SPMODE) == 0)
+		{
+			// Leaving output mode abandons anything being shifted out.
+			SerialShiftCount = 0;
+			SerialPending = false;
+		}
 
 		CRA = Data8 & (~CR_LOAD);
-		StartTimerA();
+		ScheduleTimers();
+		ScheduleTodAlarm();
 		break;
 
 	case 15: // CRB
-		// If timer was running, Update its value.
-		if (CRA & CR_START)
+		UpdateTimers();
+
+		if ((Data8 & CR_START) && !(CRB & CR_START))
 		{
-			UpdateTimerA();
+			ToggleB = true;
 		}
-
 		if (Data8 & CR_LOAD)
 		{
-			TAValue = TALatch;
+			TBValue = TBLatch;
 		}
 
-		CRA = Data8 & (~CR_LOAD);
-		StartTimerA();
+		CRB = Data8 & (~CR_LOAD);
+		ScheduleTimers();
 		break;
 	}
 }
@@ -145,13 +212,26 @@ unsigned char CIAChip::Read8(int Address)
 		PrevPRA = PRA; PrevPRB = PRB;
 		// Any unconnected bits by default float up to 1.
 		PRA |= ~DDRA;
-		if (CbRead) CbRead(this);
+		if (CbRead) CbRead(this, PRA, PRB);
 		return PRA;
 	case 1: // PRB
 		PrevPRA = PRA; PrevPRB = PRB;
 		// Any unconnected bits by default float up to 1.
 		PRB |= ~DDRB;
-		if (CbRead) CbRead(this);
+		if (CbRead) CbRead(this, PRA, PRB);
+		if ((CRA | CRB) & CR_PBON)
+		{
+			// Timer outputs override PB6 (timer A) and PB7 (timer B).
+			UpdateTimers();
+			if (CRA & CR_PBON)
+			{
+				PRB = (PRB & ~0x40) | (TimerOutput(CRA, ToggleA, LastUnderflowA) ? 0x40 : 0);
+			}
+			if (CRB & CR_PBON)
+			{
+				PRB = (PRB & ~0x80) | (TimerOutput(CRB, ToggleB, LastUnderflowB) ? 0x80 : 0);
+			}
+		}
 		return PRB;
 	case 2: // DDRA
 		return DDRA;
@@ -173,10 +253,13 @@ unsigned char CIAChip::Read8(int Address)
 	case 9: // TOD Sec
 	case 10: // TOD Min
 	case 11: // TOD Hr
+		return ReadTod(Address & 15);
 	case 12: // SDR
-		break;
+		return SDR;
 	case 13: // ICR
 	{
+		// Timers that aren't generating events may have underflowed since they were last looked at.
+		UpdateTimers();
 		unsigned char result = IntFlags;
 		// Reading this register clears the interrupt flags (stops pending interrupts)
 		IntFlags = 0;
@@ -184,13 +267,79 @@ unsigned char CIAChip::Read8(int Address)
 		return result;
 	}
 	case 14: // CRA
+		// One-shot timers clear the start bit when they underflow.
+		UpdateTimers();
 		return CRA;
 	case 15: // CRB
+		UpdateTimers();
 		return CRB;
 	}
 	return 0xFF; // unimplemented.
 }
 
+unsigned char CIAChip::Peek8(int Address)
+{
+	unsigned char tod[4];
+	unsigned char portA = PRA | ~DDRA;
+	unsigned char portB = PRB | ~DDRB;
+	int value;
+	long long lastUnderflow;
+	switch (Address & 15)
+	{
+	case 0: // PRA, with the lines worked out into copies
+		if (CbRead) CbRead(this, portA, portB);
+		return portA;
+	case 1: // PRB
+		if (CbRead) CbRead(this, portA, portB);
+		if (CRA & CR_PBON)
+		{
+			int underflows = PeekTimerA(value, lastUnderflow);
+			portB = (portB & ~0x40) | (TimerOutput(CRA, ToggleA != ((underflows & 1) != 0), lastUnderflow) ? 0x40 : 0);
+		}
+		if (CRB & CR_PBON)
+		{
+			int underflows = PeekTimerB(value, lastUnderflow);
+			portB = (portB & ~0x80) | (TimerOutput(CRB, ToggleB != ((underflows & 1) != 0), lastUnderflow) ? 0x80 : 0);
+		}
+		return portB;
+	case 2: // DDRA
+		return DDRA;
+	case 3: // DDRB
+		return DDRB;
+	case 4: // Timers, counted up to the current cycle
+		PeekTimerA(value, lastUnderflow);
+		return value & 0xFF;
+	case 5:
+		PeekTimerA(value, lastUnderflow);
+		return value >> 8;
+	case 6:
+		PeekTimerB(value, lastUnderflow);
+		return value & 0xFF;
+	case 7:
+		PeekTimerB(value, lastUnderflow);
+		return value >> 8;
+	case 8: // TOD, without latching
+	case 9:
+	case 10:
+	case 11:
+		if (TodLatched)
+		{
+			return TodLatch[(Address & 15) - 8];
+		}
+		TodToRegisters(TodTenths(), tod);
+		return tod[(Address & 15) - 8];
+	case 12: // SDR
+		return SDR;
+	case 13: // ICR, without clearing it
+		return IntFlags;
+	case 14: // CRA
+		return CRA;
+	case 15: // CRB
+		return CRB;
+	}
+	return 0xFF;
+}
+
 void CIAChip::SetIntFlags(int flags)
 {
 	IntFlags |= flags;
@@ -222,132 +371,309 @@ void CIAChip::UpdateInterruptStatus()
 	MaskedFlags = newMaskedFlags;
 }
 
+// Timers are evaluated lazily. Each timer remembers the cycle it was last brought up to date (LastEventA/B),
+// and any access computes the elapsed cycles since then. Events are only scheduled for the cycle of an underflow
+// that has a visible effect (an unmasked interrupt), everything else is worked out when it is read.
+
+void CIAChip::UpdateTimers()
+{
+	// Timer A first, timer B may count its underflows.
+	UpdateTimerA();
+	UpdateTimerB();
+}
+
 void CIAChip::UpdateTimerA()
 {
-	if (CRA & CR_START)
+	long long curCycle = AttachedMemory->AttachedCpu->Cycle;
+	if ((CRA & CR_START) && (CRA & CRA_INMODE) == 0) // use CLK for counting.
 	{
-		if ((CRA & CRA_INMODE) == 0) // use CLK for counting.
+		int ElapsedCycles = (int)(curCycle - LastEventA);
+		if (ElapsedCycles > 0)
 		{
-			long long curCycle = AttachedMemory->AttachedCpu->Cycle;
-			int ElapsedCycles = curCycle - LastEventA;
-			AdvanceTimerA(ElapsedCycles);
-			LastEventA = curCycle;
+			AdvanceTimerA(ElapsedCycles, curCycle);
 		}
 	}
+	// When the timer isn't counting, this keeps the reference point current for when it starts.
+	LastEventA = curCycle;
 }
 void CIAChip::UpdateTimerB()
 {
+	long long curCycle = AttachedMemory->AttachedCpu->Cycle;
 	if (CRB & CR_START)
 	{
-		if ((CRB & CRB_INMODE_MASK) == CRB_INMODE_CLK) // use CLK for counting.
+		int inMode = CRB & CRB_INMODE_MASK;
+		if (inMode == CRB_INMODE_CLK) // use CLK for counting.
 		{
-			long long curCycle = AttachedMemory->AttachedCpu->Cycle;
-			int ElapsedCycles = curCycle - LastEventB;
-
+			int ElapsedCycles = (int)(curCycle - LastEventB);
+			if (ElapsedCycles > 0)
+			{
+				AdvanceTimerB(ElapsedCycles, curCycle, 1);
+			}
 		}
+		else if (inMode == CRB_INMODE_TA || inMode == CRB_INMODE_TACNT)
+		{
+			// Counting timer A underflows. CNT is pulled up on the C64, so both modes count every underflow.
+			UpdateTimerA();
+		}
+		// CNT transitions aren't generated by anything, so CNT mode doesn't count.
 	}
+	LastEventB = curCycle;
 }
 
-void CIAChip::AdvanceTimerA(int counts)
+void CIAChip::AdvanceTimerA(int counts, long long curCycle)
 {
-	if (counts > TAValue)
+	if (counts <= TAValue)
 	{
-		SetIntFlags(1); // Timer A interrupt, underflow.
+		TAValue -= counts;
+		return;
+	}
 
-		if ((CRA & CR_RUNMODE) == 1)
-		{
-			// One-shot. Timer now reloads the latch value and stops.
-			TAValue = TALatch;
-			CRA &= ~(CR_START);
-			TimerAUnderflow(1);
-		}
-		else
-		{
-			// Continuous mode. Compute a new TAValue and proceed.
-			counts -= TAValue + 1; // How many additional cycles after the interrupt
-			int underflowcount = 1 + counts / (TALatch + 1);
-			TimerAUnderflow(underflowcount);
+	// The counter reaches zero after TAValue counts and underflows on the next one.
+	counts -= TAValue + 1; // How many additional cycles after the first underflow
+	int underflowcount = 1;
 
-			counts = counts % (TALatch + 1); // If it overflowed multiple times (unlikely) subtract multiples of the latch value.
-			TAValue = TALatch - counts; // New value accurate to the current cycle.
-		}
+	if (CRA & CR_RUNMODE)
+	{
+		// One-shot. Timer now reloads the latch value and stops.
+		TAValue = TALatch;
+		CRA &= ~(CR_START);
 	}
 	else
 	{
-		TAValue -= counts;
+		// Continuous mode. Compute a new TAValue and proceed.
+		underflowcount += counts / (TALatch + 1);
+		counts = counts % (TALatch + 1); // If it overflowed multiple times subtract multiples of the period.
+		TAValue = TALatch - counts; // New value accurate to the current cycle.
+	}
+	LastUnderflowA = curCycle - counts;
+
+	if (underflowcount & 1)
+	{
+		ToggleA = !ToggleA;
 	}
+	SetIntFlags(INT_TA); // Timer A interrupt, underflow.
+	TimerAUnderflow(underflowcount);
 }
-void CIAChip::AdvanceTimerB(int counts)
+void CIAChip::AdvanceTimerB(int counts, long long lastCountCycle, int countPeriod)
 {
-	if (counts > TBValue)
+	if (counts <= TBValue)
 	{
-		SetIntFlags(1); // Timer A interrupt, underflow.
+		TBValue -= counts;
+		return;
+	}
 
-		if ((CRB & CR_RUNMODE) == 1)
-		{
-			// One-shot. Timer now reloads the latch value and stops.
-			TBValue = TBLatch;
-			CRB &= ~(CR_START);
-		}
-		else
-		{
-			// Continuous mode. Compute a new Value and proceed.
-			counts -= TBValue + 1; // How many additional cycles after the interrupt
-			counts = counts % (TBLatch + 1); // If it overflowed multiple times (unlikely) subtract multiples of the latch value.
-			TBValue = TBLatch - counts; // New value accurate to the current cycle.
-		}
+	counts -= TBValue + 1; // How many additional counts after the first underflow
+	int underflowcount = 1;
+
+	if (CRB & CR_RUNMODE)
+	{
+		// One-shot. Timer now reloads the latch value and stops.
+		TBValue = TBLatch;
+		CRB &= ~(CR_START);
 	}
 	else
 	{
-		TBValue -= counts;
+		// Continuous mode. Compute a new Value and proceed.
+		underflowcount += counts / (TBLatch + 1);
+		counts = counts % (TBLatch + 1);
+		TBValue = TBLatch - counts; // New value accurate to the last count.
 	}
+	// Counts may be timer A underflows rather than cycles, so scale back by the count period.
+	LastUnderflowB = lastCountCycle - (long long)counts * countPeriod;
+
+	if (underflowcount & 1)
+	{
+		ToggleB = !ToggleB;
+	}
+	SetIntFlags(INT_TB); // Timer B interrupt, underflow.
 }
 
+// Counts applied to a timer, as in AdvanceTimerA/B, but only working out the result.
+static int CountTimer(int& Value, int Latch, bool OneShot, long long Counts, long long LastCountCycle, int CountPeriod, long long& LastUnderflow)
+{
+	if (Counts <= Value)
+	{
+		Value -= (int)Counts;
+		return 0;
+	}
+	Counts -= Value + 1;
+	int underflows = 1;
+	if (OneShot)
+	{
+		Value = Latch;
+	}
+	else
+	{
+		underflows += (int)(Counts / (Latch + 1));
+		Counts = Counts % (Latch + 1);
+		Value = Latch - (int)Counts;
+	}
+	LastUnderflow = LastCountCycle - Counts * CountPeriod;
+	return underflows;
+}
 
+int CIAChip::PeekTimerA(int& Value, long long& LastUnderflow)
+{
+	Value = TAValue;
+	LastUnderflow = LastUnderflowA;
+	long long curCycle = AttachedMemory->AttachedCpu->Cycle;
+	if ((CRA & CR_START) && (CRA & CRA_INMODE) == 0 && curCycle > LastEventA)
+	{
+		return CountTimer(Value, TALatch, (CRA & CR_RUNMODE) != 0, curCycle - LastEventA, curCycle, 1, LastUnderflow);
+	}
+	return 0;
+}
 
-void CIAChip::StartTimerA()
+int CIAChip::PeekTimerB(int& Value, long long& LastUnderflow)
 {
-	if (CRA & CR_START)
+	Value = TBValue;
+	LastUnderflow = LastUnderflowB;
+	if ((CRB & CR_START) == 0)
 	{
-		if ((CRA & CRA_INMODE) == 0) // use CLK for counting
+		return 0;
+	}
+	long long curCycle = AttachedMemory->AttachedCpu->Cycle;
+	bool oneShot = (CRB & CR_RUNMODE) != 0;
+	int inMode = CRB & CRB_INMODE_MASK;
+	if (inMode == CRB_INMODE_CLK && curCycle > LastEventB)
+	{
+		return CountTimer(Value, TBLatch, oneShot, curCycle - LastEventB, curCycle, 1, LastUnderflow);
+	}
+	if (inMode == CRB_INMODE_TA || inMode == CRB_INMODE_TACNT)
+	{
+		// Timer A underflows that an update would count.
+		int valueA;
+		long long lastUnderflowA;
+		int underflowsA = PeekTimerA(valueA, lastUnderflowA);
+		if (underflowsA > 0)
 		{
-			LastEventA = AttachedMemory->AttachedCpu->Cycle;
-
-			// Set callback for the time in the future when this timer will underflow.
-			long long underflowCycle = LastEventA + TAValue + 1;
-			AttachedMemory->AttachedEmulation->QueueEvent(underflowCycle, &evtTimerA);
-			return;
+			return CountTimer(Value, TBLatch, oneShot, underflowsA, lastUnderflowA, TALatch + 1, LastUnderflow);
 		}
 	}
-	// Timer isn't running, remove any callback.
-	AttachedMemory->AttachedEmulation->CancelEvent(&evtTimerA);
+	return 0;
 }
-void CIAChip::StartTimerB()
+
+bool CIAChip::TimerOutput(int controlReg, bool toggle, long long lastUnderflow)
 {
-	if (CRB & CR_START)
+	if (controlReg & CR_OUTMODE)
+	{
+		// Toggle mode, flips on every underflow.
+		return toggle;
+	}
+	// Pulse mode, high for the one cycle following an underflow.
+	return AttachedMemory->AttachedCpu->Cycle == lastUnderflow;
+}
+
+
+long long CIAChip::NextUnderflowA()
+{
+	// Only valid right after UpdateTimerA. Returns -1 if timer A isn't counting clock cycles.
+	if ((CRA & CR_START) && (CRA & CRA_INMODE) == 0)
+	{
+		return LastEventA + TAValue + 1;
+	}
+	return -1;
+}
+
+long long CIAChip::NextUnderflowB()
+{
+	// Only valid right after UpdateTimers. Returns -1 if timer B won't underflow without outside input.
+	if ((CRB & CR_START) == 0)
 	{
-		if ((CRB & CRB_INMODE_MASK) == CRB_INMODE_CLK)
+		return -1;
+	}
+
+	int inMode = CRB & CRB_INMODE_MASK;
+	if (inMode == CRB_INMODE_CLK)
+	{
+		return LastEventB + TBValue + 1;
+	}
+	if (inMode == CRB_INMODE_TA || inMode == CRB_INMODE_TACNT)
+	{
+		long long nextA = NextUnderflowA();
+		if (nextA < 0)
 		{
-			LastEventA = AttachedMemory->AttachedCpu->Cycle;
+			return -1;
+		}
+		if (CRA & CR_RUNMODE)
+		{
+			// A one-shot timer A only underflows once more.
+			return TBValue == 0 ? nextA : -1;
+		}
+		// Timer B underflows on timer A underflow number TBValue+1 from now.
+		return nextA + (long long)TBValue * (TALatch + 1);
+	}
+	return -1;
+}
 
-			// Set callback for the time in the future when this timer will underflow.
-			long long underflowCycle = LastEventB + TBValue + 1;
-			AttachedMemory->AttachedEmulation->QueueEvent(underflowCycle, &evtTimerB);
-			return;
+void CIAChip::ScheduleTimers()
+{
+	// Set callbacks for the time in the future when a timer will underflow and raise an unmasked interrupt.
+	long long underflowCycle = (IntMask & INT_TA) ? NextUnderflowA() : -1;
+	if (underflowCycle >= 0)
+	{
+		AttachedMemory->AttachedEmulation->QueueEvent(underflowCycle, &evtTimerA);
+	}
+	else if (evtTimerA.Queued)
+	{
+		// Timer isn't running or nobody will see the underflow, remove any callback.
+		AttachedMemory->AttachedEmulation->CancelEvent(&evtTimerA);
+	}
+
+	underflowCycle = (IntMask & INT_TB) ? NextUnderflowB() : -1;
+	if (underflowCycle >= 0)
+	{
+		AttachedMemory->AttachedEmulation->QueueEvent(underflowCycle, &evtTimerB);
+	}
+	else if (evtTimerB.Queued)
+	{
+		AttachedMemory->AttachedEmulation->CancelEvent(&evtTimerB);
+	}
+
+	// Serial shift completion happens on a known timer A underflow.
+	long long serialCycle = -1;
+	if ((IntMask & INT_SP) && SerialShiftCount > 0)
+	{
+		long long nextA = NextUnderflowA();
+		if (nextA >= 0 && (CRA & CR_RUNMODE) == 0)
+		{
+			serialCycle = nextA + (long long)(SerialShiftCount - 1) * (TALatch + 1);
 		}
 	}
-	// Timer isn't running, remove any callback.
-	AttachedMemory->AttachedEmulation->CancelEvent(&evtTimerB);
+	if (serialCycle >= 0)
+	{
+		AttachedMemory->AttachedEmulation->QueueEvent(serialCycle, &evtSerial);
+	}
+	else if (evtSerial.Queued)
+	{
+		AttachedMemory->AttachedEmulation->CancelEvent(&evtSerial);
+	}
 }
 
 void CIAChip::TimerAUnderflow(int count)
 {
+	// Serial output shifts on timer A underflows.
+	int shiftCount = count;
+	while (SerialShiftCount > 0 && shiftCount > 0)
+	{
+		if (shiftCount < SerialShiftCount)
+		{
+			SerialShiftCount -= shiftCount;
+			break;
+		}
+		shiftCount -= SerialShiftCount;
+		SetIntFlags(INT_SP); // Byte has been shifted out.
+		SerialShiftCount = SerialPending ? 16 : 0;
+		SerialPending = false;
+	}
+
 	// If timer B is counting pulses from timer A, advance timer B.
 	if (CRB & CR_START)
 	{
-		if ((CRB & CRB_INMODE_MASK) == CRB_INMODE_TA)
+		int inMode = CRB & CRB_INMODE_MASK;
+		if (inMode == CRB_INMODE_TA || inMode == CRB_INMODE_TACNT)
 		{
-			AdvanceTimerB(count);
+			AdvanceTimerB(count, LastUnderflowA, TALatch + 1);
 		}
 	}
 }
@@ -356,14 +682,179 @@ void CIAChip::TimerAUnderflow(int count)
 void CIAChip::CallbackTimerA(EventRequest* Request)
 {
 	CIAChip* chip = (CIAChip*)Request->Context;
-	chip->UpdateTimerA();
-	chip->StartTimerA();
+	chip->UpdateTimers();
+	chip->ScheduleTimers();
 }
 void CIAChip::CallbackTimerB(EventRequest* Request)
 {
 	CIAChip* chip = (CIAChip*)Request->Context;
-	chip->UpdateTimerB();
-	chip->StartTimerB();
+	chip->UpdateTimers();
+	chip->ScheduleTimers();
+}
+void CIAChip::CallbackSerial(EventRequest* Request)
+{
+	CIAChip* chip = (CIAChip*)Request->Context;
+	chip->UpdateTimers();
+	chip->ScheduleTimers();
+}
+
+// The time of day clock is derived from the cycle counter when it's read, so it doesn't need an event per tick.
+// TodBaseTenths is the time (in tenths of a second since 12:00:00.0 AM) at TodBaseCycle.
+// The only event is for the cycle that the alarm time will be reached.
+
+long long CIAChip::TodElapsedTenths()
+{
+	// Whole tenths counted since TodBaseCycle. The TOD counts mains cycles, 5 or 6 per tenth depending on CRA.
+	long long elapsedCycles = AttachedMemory->AttachedCpu->Cycle - TodBaseCycle;
+	if (!TodRunning || elapsedCycles <= 0)
+	{
+		return 0;
+	}
+	long long mainsTicks = elapsedCycles * MainsHz / CpuClockHz;
+	return mainsTicks / TodTicksPerTenth();
+}
+
+int CIAChip::TodTicksPerTenth()
+{
+	return (CRA & CRA_TODIN) ? 5 : 6;
+}
+
+int CIAChip::TodTenths()
+{
+	return (int)((TodBaseTenths + TodElapsedTenths()) % TodTenthsPerDay);
+}
+
+void CIAChip::RebaseTod()
+{
+	// Fold the elapsed time into the base, keeping the cycle of the last tenth boundary as the reference.
+	long long tenths = TodElapsedTenths();
+	TodBaseTenths = (int)((TodBaseTenths + tenths) % TodTenthsPerDay);
+	TodBaseCycle += (tenths * TodTicksPerTenth() * CpuClockHz) / MainsHz;
+	if (!TodRunning)
+	{
+		TodBaseCycle = AttachedMemory->AttachedCpu->Cycle;
+	}
+}
+
+static unsigned char ToBcd(int value)
+{
+	return (unsigned char)(((value / 10) << 4) | (value % 10));
+}
+static int FromBcd(unsigned char value)
+{
+	return (value >> 4) * 10 + (value & 15);
+}
+
+void CIAChip::TodToRegisters(int tenths, unsigned char* regs)
+{
+	int hours = tenths / TodTenthsPerHour;
+	int hour12 = hours % 12;
+	regs[0] = tenths % 10;
+	regs[1] = ToBcd((tenths / 10) % 60);
+	regs[2] = ToBcd((tenths / 600) % 60);
+	regs[3] = ToBcd(hour12 == 0 ? 12 : hour12) | (hours >= 12 ? 0x80 : 0); // Bit 7 is PM
+}
+
+int CIAChip::RegistersToTod(const unsigned char* regs)
+{
+	int hour12 = FromBcd(regs[3] & 0x1F) % 12;
+	int hours = hour12 + ((regs[3] & 0x80) ? 12 : 0);
+	int tenths = (regs[0] & 15) + FromBcd(regs[1] & 0x7F) * 10 + FromBcd(regs[2] & 0x7F) * 600 + hours * TodTenthsPerHour;
+	return tenths % TodTenthsPerDay;
+}
+
+unsigned char CIAChip::ReadTod(int reg)
+{
+	unsigned char regs[4];
+	if (TodLatched)
+	{
+		for (int i = 0; i < 4; i++) regs[i] = TodLatch[i];
+	}
+	else
+	{
+		TodToRegisters(TodTenths(), regs);
+	}
+
+	if (reg == 11)
+	{
+		// Reading hours latches all of the TOD registers until 10ths is read, so the time can be read consistently.
+		if (!TodLatched)
+		{
+			for (int i = 0; i < 4; i++) TodLatch[i] = regs[i];
+			TodLatched = true;
+		}
+	}
+	else if (reg == 8)
+	{
+		TodLatched = false;
+	}
+	return regs[reg - 8];
+}
+
+void CIAChip::WriteTod(int reg, unsigned char Data8)
+{
+	unsigned char regs[4];
+
+	if (CRB & CRB_ALARM)
+	{
+		// Writes set the alarm time.
+		TodToRegisters(TodAlarm, regs);
+		regs[reg - 8] = Data8;
+		TodAlarm = RegistersToTod(regs);
+	}
+	else
+	{
+		RebaseTod();
+		TodToRegisters(TodBaseTenths, regs);
+		regs[reg - 8] = Data8;
+		TodBaseTenths = RegistersToTod(regs);
+		TodBaseCycle = AttachedMemory->AttachedCpu->Cycle;
+
+		if (reg == 11)
+		{
+			// Writing hours stops the clock until 10ths is written.
+			TodRunning = false;
+		}
+		else if (reg == 8)
+		{
+			TodRunning = true;
+		}
+	}
+	ScheduleTodAlarm();
+}
+
+void CIAChip::ScheduleTodAlarm()
+{
+	if (!TodRunning)
+	{
+		if (evtAlarm.Queued)
+		{
+			AttachedMemory->AttachedEmulation->CancelEvent(&evtAlarm);
+		}
+		return;
+	}
+
+	// How many tenths until the clock next reads the alarm time (a full day if it's reading it right now).
+	long long elapsed = TodElapsedTenths();
+	int now = (int)((TodBaseTenths + elapsed) % TodTenthsPerDay);
+	int untilAlarm = (TodAlarm - now + TodTenthsPerDay) % TodTenthsPerDay;
+	if (untilAlarm == 0)
+	{
+		untilAlarm = TodTenthsPerDay;
+	}
+
+	// First cycle at which TodElapsedTenths reaches the alarm count.
+	long long targetTicks = (elapsed + untilAlarm) * TodTicksPerTenth();
+	long long alarmCycle = TodBaseCycle + (targetTicks * CpuClockHz + MainsHz - 1) / MainsHz;
+	AttachedMemory->AttachedEmulation->QueueEvent(alarmCycle, &evtAlarm);
+}
+
+void CIAChip::CallbackAlarm(EventRequest* Request)
+{
+	CIAChip* chip = (CIAChip*)Request->Context;
+	// Any change to the time or the alarm reschedules this event, so reaching it means the alarm time was reached.
+	chip->SetIntFlags(chip->INT_ALARM);
+	chip->ScheduleTodAlarm();
 }
 
 
@@ -371,13 +862,31 @@ void CIAChip::CallbackTimerB(EventRequest* Request)
 
 
 
-Memory::Memory() : RAM(nullptr), Kernal(nullptr), Basic(nullptr), Char(nullptr), CIA1(InterruptSourceCIA1), CIA2(InterruptSourceCIA2)
+unsigned char * Memory::SharedKernal = nullptr;
+unsigned char * Memory::SharedBasic = nullptr;
+unsigned char * Memory::SharedChar = nullptr;
+
+Memory::Memory() : Kernal(nullptr), Basic(nullptr), Char(nullptr), CIA1(InterruptSourceCIA1), CIA2(InterruptSourceCIA2), FlatMemory(false)
 {
-	RAM = new unsigned char[65536];
+	ChangeCount = 0;
+	IoAccessCount = 0;
+	for (int i = 0; i < 256; i++)
+	{
+		RamPages[i] = nullptr;
+		PageFlags[i] = 0;
+	}
+	AttachedDebugger = nullptr;
+	AllocateRam();
 
-	Kernal = LoadRom("roms/901227-03.u4", 8192);
-	Basic = LoadRom("roms/901226-01.u3", 8192);
-	Char = LoadRom("roms/901225-01.u5", 4096);
+	if (SharedKernal == nullptr)
+	{
+		SharedKernal = LoadRom("roms/901227-03.u4", 8192);
+		SharedBasic = LoadRom("roms/901226-01.u3", 8192);
+		SharedChar = LoadRom("roms/901225-01.u5", 4096);
+	}
+	Kernal = SharedKernal;
+	Basic = SharedBasic;
+	Char = SharedChar;
 
 	CIA1.Setup(this, Cia1Read, Cia1Write);
 	CIA2.Setup(this, Cia2Read, Cia2Write);
@@ -387,12 +896,138 @@ Memory::Memory() : RAM(nullptr), Kernal(nullptr), Basic(nullptr), Char(nullptr),
 }
 
 
+Memory::Memory(const Memory& Parent) : CIA1(Parent.CIA1), CIA2(Parent.CIA2)
+{
+	AttachedVideo = nullptr;
+	AttachedCpu = nullptr;
+	AttachedKeyboard = nullptr;
+	AttachedControlPorts = nullptr;
+	AttachedSid = nullptr;
+	AttachedEmulation = nullptr;
+	AttachedDebugger = nullptr;
+	for (int i = 0; i < 256; i++)
+	{
+		RamPages[i] = nullptr;
+		PageFlags[i] = 0;
+	}
+	CopyState(Parent);
+}
+
+void Memory::CopyState(const Memory& Source)
+{
+	Kernal = Source.Kernal;
+	Basic = Source.Basic;
+	Char = Source.Char;
+	FlatMemory = Source.FlatMemory;
+	ChangeCount = Source.ChangeCount;
+	IoAccessCount = Source.IoAccessCount;
+	DDR = Source.DDR;
+	PR = Source.PR;
+
+	// The CIA copies still point at the source.
+	CIA1 = Source.CIA1;
+	CIA2 = Source.CIA2;
+	CIA1.Setup(this, Cia1Read, Cia1Write);
+	CIA2.Setup(this, Cia2Read, Cia2Write);
+}
+
 Memory::~Memory()
 {
-	delete[] RAM;
-	delete[] Kernal;
-	delete[] Basic;
-	delete[] Char;
+	ReleaseRam();
+}
+
+void Memory::AllocateRam()
+{
+	for (int i = 0; i < 256; i++)
+	{
+		RamPageBlock* block = new RamPageBlock;
+		block->References = 1;
+		memset(block->Data, 0, sizeof(block->Data));
+		RamPages[i] = block;
+		PageFlags[i] &= ~PAGE_SHARED;
+	}
+}
+
+void Memory::ReleaseRam()
+{
+	for (int i = 0; i < 256; i++)
+	{
+		if (RamPages[i] != nullptr)
+		{
+			ReleasePage(RamPages[i]);
+			RamPages[i] = nullptr;
+		}
+		PageFlags[i] &= ~PAGE_SHARED;
+	}
+}
+
+void Memory::ReleasePage(RamPageBlock* Block)
+{
+	if (Block->References.fetch_sub(1) == 1)
+	{
+		delete Block;
+	}
+}
+
+void Memory::ShareRam(Memory& Target)
+{
+	Target.ReleaseRam();
+	for (int i = 0; i < 256; i++)
+	{
+		RamPages[i]->References++;
+		Target.RamPages[i] = RamPages[i];
+		PageFlags[i] |= PAGE_SHARED;
+		Target.PageFlags[i] |= PAGE_SHARED;
+	}
+}
+
+void Memory::UnsharePage(int Page)
+{
+	RamPageBlock* block = RamPages[Page];
+	PageFlags[Page] &= ~PAGE_SHARED;
+	if (block->References == 1)
+	{
+		// Every other machine has already copied it.
+		return;
+	}
+	RamPageBlock* copy = new RamPageBlock;
+	copy->References = 1;
+	memcpy(copy->Data, block->Data, sizeof(copy->Data));
+	RamPages[Page] = copy;
+	ReleasePage(block);
+}
+
+int Memory::SharedPageCount()
+{
+	int count = 0;
+	for (int i = 0; i < 256; i++)
+	{
+		if (PageFlags[i] & PAGE_SHARED)
+		{
+			count++;
+		}
+	}
+	return count;
+}
+
+void Memory::SaveRam(unsigned char* Destination)
+{
+	for (int i = 0; i < 256; i++)
+	{
+		memcpy(Destination + i * 256, RamPages[i]->Data, 256);
+	}
+}
+
+void Memory::LoadRam(const unsigned char* Source)
+{
+	for (int i = 0; i < 256; i++)
+	{
+		if (PageFlags[i] & PAGE_SHARED)
+		{
+			UnsharePage(i);
+		}
+		memcpy(RamPages[i]->Data, Source + i * 256, 256);
+	}
 }
 
 void Memory::Reset()
@@ -417,6 +1052,25 @@ unsigned char Memory::EffectivePR()
 }
 
 void Memory::Write8(int Address, unsigned char Data8)
+{
+	WriteMapped(Address, Data8);
+	if (PageFlags[(Address >> 8) & 0xFF] & PAGE_WATCH_WRITE)
+	{
+		AttachedDebugger->CheckAccess(DebugWatchWrite, Address, Data8);
+	}
+}
+
+unsigned char Memory::Read8(int Address)
+{
+	unsigned char value = ReadMapped(Address, false);
+	if (PageFlags[(Address >> 8) & 0xFF] & PAGE_WATCH_READ)
+	{
+		AttachedDebugger->CheckAccess(DebugWatchRead, Address, value);
+	}
+	return value;
+}
+
+void Memory::WriteMapped(int Address, unsigned char Data8)
 {
 	int tempPR = 0;
 	if (Address < 0 || Address > 65535)
@@ -425,6 +1079,12 @@ void Memory::Write8(int Address, unsigned char Data8)
 		return;
 	}
 
+	if (FlatMemory)
+	{
+		WriteRam(Address, Data8);
+		return;
+	}
+
 
 	// Side effects
 	if (Address == 0)
@@ -445,10 +1105,12 @@ void Memory::Write8(int Address, unsigned char Data8)
 			PRINT_IO("IO Write 0x%02X => [%04X] (%lld, PC=%04X)\n", Data8, Address, AttachedCpu->Cycle, AttachedCpu->InstructionPC());
 			if (tempPR & CHAREN)
 			{
+				IoAccessCount++;
 				// Write to I/O memory
 				if (Address >= 0xD400 && Address < 0xD800)
 				{
 					// SID range
+					AttachedSid->Write8(Address, Data8);
 				}
 				else if (Address >= 0xDE00)
 				{
@@ -476,11 +1138,119 @@ void Memory::Write8(int Address, unsigned char Data8)
 		}
 	}
 
-	// Write to memory unless above block suppressed it.
-	RAM[Address] = Data8;
+	// Write to memory unless above block suppressed it. Writing the value that's already there leaves a shared page shared.
+	if (ReadRam(Address) != Data8)
+	{
+		ChangeCount++;
+		WriteRam(Address, Data8);
+	}
 }
 
-unsigned char Memory::Read8(int Address)
+unsigned char Memory::Peek8(int Address)
+{
+	return ReadMapped(Address & 0xFFFF, true);
+}
+
+void Memory::CopyOut(int Address, unsigned char* Destination, int Length, MemoryView View)
+{
+	int addressMask = View == ViewVic ? 0x3FFF : 0xFFFF;
+	int bankBase = View == ViewVic ? VicBank() << 14 : 0;
+	int pr = EffectivePR();
+	Address &= addressMask;
+	while (Length > 0)
+	{
+		// Find the source of the run starting at Address, and where it ends.
+		const unsigned char* rom = nullptr;
+		int end;
+		bool io = false;
+		if (View == ViewVic)
+		{
+			end = (Address & 0xF000) + 0x1000;
+			if ((Address & 0x3000) == 0x1000 && (bankBase & 0x4000) == 0)
+			{
+				rom = Char;
+			}
+		}
+		else if (FlatMemory)
+		{
+			end = 0x10000;
+		}
+		else if (Address < 2)
+		{
+			end = 2;
+			io = true;
+		}
+		else if (Address < 0xA000)
+		{
+			end = 0xA000;
+		}
+		else if (Address < 0xC000)
+		{
+			end = 0xC000;
+			if ((pr & (HIRAM | LORAM)) == (HIRAM | LORAM))
+			{
+				rom = Basic;
+			}
+		}
+		else if (Address < 0xD000)
+		{
+			end = 0xD000;
+		}
+		else if (Address < 0xE000)
+		{
+			end = 0xE000;
+			if ((pr & (HIRAM | LORAM)) != 0)
+			{
+				if (pr & CHAREN)
+				{
+					io = true;
+				}
+				else
+				{
+					rom = Char;
+				}
+			}
+		}
+		else
+		{
+			end = 0x10000;
+			if (pr & HIRAM)
+			{
+				rom = Kernal;
+			}
+		}
+
+		int count = end - Address < Length ? end - Address : Length;
+		if (io)
+		{
+			for (int i = 0; i < count; i++)
+			{
+				Destination[i] = Peek8(Address + i);
+			}
+		}
+		else if (rom != nullptr)
+		{
+			// All of the ROM images are 8KB or 4KB and mapped at a multiple of their size.
+			memcpy(Destination, rom + (Address & (rom == Char ? 0xFFF : 0x1FFF)), count);
+		}
+		else
+		{
+			for (int copied = 0; copied < count;)
+			{
+				int ram = bankBase | (Address + copied);
+				int run = 256 - (ram & 0xFF);
+				run = run < count - copied ? run : count - copied;
+				memcpy(Destination + copied, RamPages[ram >> 8]->Data + (ram & 0xFF), run);
+				copied += run;
+			}
+		}
+		Destination += count;
+		Length -= count;
+		Address = (Address + count) & addressMask;
+	}
+}
+
+unsigned char Memory::ReadMapped(int Address, bool Peek)
 {
 	int tempPR = 0;
 	if (Address < 0 || Address > 65535)
@@ -489,6 +1259,11 @@ unsigned char Memory::Read8(int Address)
 		return 0xFF;
 	}
 
+	if (FlatMemory)
+	{
+		return ReadRam(Address);
+	}
+
 	if (Address == 0)
 	{
 		return DDR;
@@ -517,10 +1292,32 @@ unsigned char Memory::Read8(int Address)
 			if (tempPR & CHAREN)
 			{
 				unsigned char IORead = 0xFF;
+				if (Peek)
+				{
+					if (Address >= 0xD400 && Address < 0xD800)
+					{
+						IORead = AttachedSid->Peek8(Address);
+					}
+					else if (Address >= 0xDD00 && Address < 0xDE00)
+					{
+						IORead = CIA2.Peek8(Address);
+					}
+					else if (Address >= 0xDC00 && Address < 0xDD00)
+					{
+						IORead = CIA1.Peek8(Address);
+					}
+					else if (Address < 0xDC00)
+					{
+						IORead = AttachedVideo->Peek8(Address);
+					}
+					return IORead;
+				}
+				IoAccessCount++;
 				// This is I/O memory
 				if (Address >= 0xD400 && Address < 0xD800)
 				{
 					// SID range
+					IORead = AttachedSid->Read8(Address);
 				}
 				else if (Address >= 0xDE00)
 				{
@@ -566,7 +1363,7 @@ unsigned char Memory::Read8(int Address)
 	// Todo: ROM emulation & IO space
 
 
-	return RAM[Address];
+	return ReadRam(Address);
 }
 
 
@@ -583,15 +1380,22 @@ unsigned char * Memory::LoadRom(const char * Filename, int Size)
 	return data;
 }
 
-void Memory::Cia1Read(CIAChip* chip)
+void Memory::Cia1Read(CIAChip* chip, unsigned char& PortA, unsigned char& PortB)
 {
-	chip->AttachedMemory->AttachedKeyboard->UpdateKeyboardMatrix(chip->PRA, chip->PRB, chip->DDRA, chip->DDRB);
+	// Both ports' input bits start from the line levels, whichever port is read, as the keyboard connects them.
+	// The control ports share these lines, so a joystick also selects keyboard rows or columns. Devices only pull
+	// input lines low here, outputs keep their latched values.
+	ControlPorts* ports = chip->AttachedMemory->AttachedControlPorts;
+	PortA = (PortA | ~chip->DDRA) & (ports->Lines(1) | chip->DDRA);
+	PortB = (PortB | ~chip->DDRB) & (ports->Lines(0) | chip->DDRB);
+	chip->AttachedMemory->AttachedKeyboard->UpdateKeyboardMatrix(PortA, PortB, chip->DDRA, chip->DDRB);
 }
 void Memory::Cia1Write(CIAChip* chip)
 {
-
+	// PA6 and PA7 pick the control port the SID measures paddles on.
+	chip->AttachedMemory->AttachedControlPorts->SelectPaddles(chip->PRA | ~chip->DDRA, chip->AttachedMemory->AttachedCpu->Cycle);
 }
-void Memory::Cia2Read(CIAChip* chip)
+void Memory::Cia2Read(CIAChip* chip, unsigned char& PortA, unsigned char& PortB)
 {
 
 }
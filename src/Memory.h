@@ -2,32 +2,42 @@
 #define _MEMORY_H
 
 #include "EmulationEvent.h"
+#include <atomic>
 
 class Emulation;
 class Video;
 class Memory;
 class Keyboard;
+class ControlPorts;
+class Sid;
 class CIAChip;
+class Debugger;
 
-// Function pointer type for CIA Chip callbacks.
+// Function pointer types for CIA Chip callbacks.
 typedef void (*FnPtrCiaCallback)(CIAChip* chip);
+typedef void (*FnPtrCiaReadCallback)(CIAChip* chip, unsigned char& PortA, unsigned char& PortB);
 
 class CIAChip
 {
 public:
 	CIAChip(int CpuInterruptSourceIndex);
 
-	void Setup(Memory* useMemory, FnPtrCiaCallback readFn, FnPtrCiaCallback writeFn);
+	// Also used to attach a copy of a chip.
+	void Setup(Memory* useMemory, FnPtrCiaReadCallback readFn, FnPtrCiaCallback writeFn);
 
 
 	void Reset();
 	void Write8(int Address, unsigned char Data8);
 	unsigned char Read8(int Address);
+	// The register value, without the side effects of reading it.
+	unsigned char Peek8(int Address);
 
 	Memory* AttachedMemory;
 
-	// Callback called pre-read, use this to set the current state of IO lines.
-	FnPtrCiaCallback CbRead;
+	// Callback called pre-read, use this to set the current state of IO lines. PortA and PortB come in with the
+	// port registers, input bits high, and the callback pulls input bits low. They are the chip's PRA and PRB on a
+	// read, and copies when peeking.
+	FnPtrCiaReadCallback CbRead;
 
 	// Callback called post-write, use this to update any hardware that needs to react to a change in IO lines.
 	FnPtrCiaCallback CbWrite;
@@ -41,7 +51,23 @@ public:
 	int IntFlags, IntMask;
 	int MaskedFlags;
 
-	long long LastEventA, LastEventB;
+	long long LastEventA, LastEventB; // Cycle each timer was last brought up to date.
+	long long LastUnderflowA, LastUnderflowB; // Cycle of the most recent underflow, for the PB6/PB7 pulse output.
+	bool ToggleA, ToggleB; // PB6/PB7 toggle mode output state.
+
+	// Clock rates used to derive the time of day from the cycle counter.
+	int CpuClockHz, MainsHz;
+
+	long long TodBaseCycle;
+	int TodBaseTenths; // Time of day at TodBaseCycle, in tenths of a second since 12:00:00.0 AM
+	int TodAlarm; // Alarm time, in tenths
+	bool TodRunning;
+	bool TodLatched;
+	unsigned char TodLatch[4];
+
+	unsigned char SDR;
+	int SerialShiftCount; // Timer A underflows remaining until the serial output byte has been shifted out.
+	bool SerialPending; // Another byte was written while shifting.
 
 protected:
 
@@ -49,71 +75,181 @@ protected:
 	void ClearIntFlags(int flags);
 	void UpdateInterruptStatus();
 
+	void UpdateTimers();
 	void UpdateTimerA();
 	void UpdateTimerB();
-	void AdvanceTimerA(int counts);
-	void AdvanceTimerB(int counts);
-	void StartTimerA();
-	void StartTimerB();
+	void AdvanceTimerA(int counts, long long curCycle);
+	void AdvanceTimerB(int counts, long long lastCountCycle, int countPeriod);
+	// The timers as an update would leave them, without changing anything. Return the underflows since the last
+	// update, with the value and last underflow cycle they would have.
+	int PeekTimerA(int& Value, long long& LastUnderflow);
+	int PeekTimerB(int& Value, long long& LastUnderflow);
 	void TimerAUnderflow(int count);
+	bool TimerOutput(int controlReg, bool toggle, long long lastUnderflow);
+
+	long long NextUnderflowA();
+	long long NextUnderflowB();
+	void ScheduleTimers();
+
+	long long TodElapsedTenths();
+	int TodTicksPerTenth();
+	int TodTenths();
+	void RebaseTod();
+	void TodToRegisters(int tenths, unsigned char* regs);
+	int RegistersToTod(const unsigned char* regs);
+	unsigned char ReadTod(int reg);
+	void WriteTod(int reg, unsigned char Data8);
+	void ScheduleTodAlarm();
 
 	int InterruptSourceIndex;
 
-	EventRequest evtTimerA, evtTimerB;
+	EventRequest evtTimerA, evtTimerB, evtAlarm, evtSerial;
 
 	static void CallbackTimerA(EventRequest* Request);
 	static void CallbackTimerB(EventRequest* Request);
+	static void CallbackAlarm(EventRequest* Request);
+	static void CallbackSerial(EventRequest* Request);
 
 	// CIA specific values
-	const int CR_START = 1;
+	static const int INT_TA = 1;
+	static const int INT_TB = 2;
+	static const int INT_ALARM = 4;
+	static const int INT_SP = 8;
+
+	static const int TodTenthsPerHour = 36000;
+	static const int TodTenthsPerDay = 864000;
+
+	static const int CR_START = 1;
 	// 1 = Ouput to PB6
-	const int CR_PBON = 2;
+	static const int CR_PBON = 2;
 	// 1=Toggle 0=Pulse
-	const int CR_OUTMODE = 4;
+	static const int CR_OUTMODE = 4;
 	// 1 = one-shot, 0 = continuous.
-	const int CR_RUNMODE = 8;
+	static const int CR_RUNMODE = 8;
 	// If bit is set while written, force timer latch into timer value
-	const int CR_LOAD = 16;
+	static const int CR_LOAD = 16;
 	// 1 = Count CNT transitions, 0=count on CLK edges
-	const int CRA_INMODE = 32;
+	static const int CRA_INMODE = 32;
 	// 1 = Serial port output, 0=serial port input (external clock)
-	const int CRA_SPMODE = 64;
+	static const int CRA_SPMODE = 64;
 	// 1 = 50Hz input for RTC, 0 = 60Hz input for RTC.
-	const int CRA_TODIN = 128;
+	static const int CRA_TODIN = 128;
 
-	const int CRB_INMODE_MASK = 0x60;
+	static const int CRB_INMODE_MASK = 0x60;
 
-	const int CRB_INMODE_CLK = 0;
-	const int CRB_INMODE_CNT = 0x20;
-	const int CRB_INMODE_TA = 0x40;
-	const int CRB_INMODE_TACNT = 0x60;
+	static const int CRB_INMODE_CLK = 0;
+	static const int CRB_INMODE_CNT = 0x20;
+	static const int CRB_INMODE_TA = 0x40;
+	static const int CRB_INMODE_TACNT = 0x60;
+	// 1 = TOD writes set the alarm, 0 = TOD writes set the clock.
+	static const int CRB_ALARM = 0x80;
 
 };
 
 
+// A 256 byte page of RAM. Pages are shared copy-on-write between forked machines, and freed with the last reference.
+struct RamPageBlock
+{
+	std::atomic<int> References;
+	unsigned char Data[256];
+};
+
 class Memory
 {
 public:
 	Memory();
+	// Copies the chip state of another machine, without RAM. Follow with ShareRam.
+	Memory(const Memory& Parent);
+	void CopyState(const Memory& Source);
 	~Memory();
 
 	void Reset();
 
 	void Write8(int Address, unsigned char Data8);
 	unsigned char Read8(int Address);
+	// Read as the CPU would see it, but without side effects: IO registers aren't cleared or latched by the read,
+	// and watchpoints don't trigger. For debuggers and monitors.
+	unsigned char Peek8(int Address);
+
+	// Side effect free bulk copy, wrapping at the end of the address space. ViewCpu is the 64KB the CPU sees with the
+	// current banking, ViewVic is the 16KB the VIC sees in its current bank (with the character ROM images).
+	// RAM and ROM are copied in contiguous runs, only IO is read a byte at a time.
+	enum MemoryView { ViewCpu, ViewVic };
+	void CopyOut(int Address, unsigned char* Destination, int Length, MemoryView View);
+
+	// The VIC's view of memory. Address is 14 bits, within the bank selected by CIA 2 port A.
+	int VicBank() { return 3 - ((CIA2.PRA | ~CIA2.DDRA) & 3); }
+	unsigned char PeekVic(int Address)
+	{
+		int bank = VicBank();
+		if ((Address & 0x3000) == 0x1000 && (bank & 1) == 0)
+		{
+			// Character ROM is at $1000-$1FFF in banks 0 and 2.
+			return Char[Address & 0xFFF];
+		}
+		return ReadRam((bank << 14) | (Address & 0x3FFF));
+	}
+
+	// RAM through the page table, ignoring banking.
+	unsigned char ReadRam(int Address) { return RamPages[Address >> 8]->Data[Address & 0xFF]; }
+	void WriteRam(int Address, unsigned char Data8)
+	{
+		int page = Address >> 8;
+		if (PageFlags[page] & PAGE_SHARED)
+		{
+			UnsharePage(page);
+		}
+		RamPages[page]->Data[Address & 0xFF] = Data8;
+	}
+	// A RAM write from outside the CPU, e.g. from an event. Counted in ChangeCount like a CPU write, so a loop
+	// waiting on the value isn't taken for idle.
+	void PokeRam(int Address, unsigned char Data8)
+	{
+		if (ReadRam(Address) != Data8)
+		{
+			ChangeCount++;
+			WriteRam(Address, Data8);
+		}
+	}
+	void SaveRam(unsigned char* Destination);
+	void LoadRam(const unsigned char* Source);
+
+	// Give the target the same RAM, sharing every page until one side writes to it.
+	void ShareRam(Memory& Target);
+	// Free all pages (while hibernated), and allocate fresh zeroed pages.
+	void ReleaseRam();
+	void AllocateRam();
+	int SharedPageCount();
 
 	Video * AttachedVideo;
 	Cpu * AttachedCpu;
 	Keyboard* AttachedKeyboard;
+	ControlPorts* AttachedControlPorts;
+	Sid* AttachedSid;
 	Emulation* AttachedEmulation;
+	Debugger* AttachedDebugger; // Receives accesses to pages with watch flags.
+
+	// The page table. Every RAM access goes through RamPages, PageFlags holds per-page state.
+	RamPageBlock* RamPages[256];
+	unsigned char PageFlags[256];
+	static const unsigned char PAGE_SHARED = 1; // Page is shared with another machine, copy it before writing.
+	static const unsigned char PAGE_WATCH_READ = 2; // Page has a read watchpoint, CPU reads go to the debugger.
+	static const unsigned char PAGE_WATCH_WRITE = 4; // Same for writes.
 
-	unsigned char * RAM;
 	unsigned char * Kernal;
 	unsigned char * Basic;
 	unsigned char * Char;
 
 	CIAChip CIA1, CIA2;
 
+	// When set, the address space is a flat 64KB of RAM with no banking, ROM or IO (used by the CPU test harness).
+	bool FlatMemory;
+
+	// Running counts of RAM writes that changed a value, and of IO register accesses. Used to tell whether a loop
+	// iteration had any effect.
+	unsigned int ChangeCount;
+	unsigned int IoAccessCount;
+
 protected:
 
 	const unsigned char LORAM = 1;
@@ -122,14 +258,24 @@ protected:
 
 	unsigned char EffectivePR();
 
+	void WriteMapped(int Address, unsigned char Data8);
+	unsigned char ReadMapped(int Address, bool Peek);
+
 	unsigned char DDR, PR;
 
 	unsigned char * LoadRom(const char * Filename, int Size);
+	void UnsharePage(int Page);
+	static void ReleasePage(RamPageBlock* Block);
+
+	// ROM images never change, so every instance shares one copy.
+	static unsigned char * SharedKernal;
+	static unsigned char * SharedBasic;
+	static unsigned char * SharedChar;
 
 
-	static void Cia1Read(CIAChip* chip);
+	static void Cia1Read(CIAChip* chip, unsigned char& PortA, unsigned char& PortB);
 	static void Cia1Write(CIAChip* chip);
-	static void Cia2Read(CIAChip* chip);
+	static void Cia2Read(CIAChip* chip, unsigned char& PortA, unsigned char& PortB);
 	static void Cia2Write(CIAChip* chip);
 
 };
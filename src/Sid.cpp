@@ -0,0 +1,603 @@
+#include "Sid.h"
+#include "Cpu.h"
+#include "ControlPorts.h"
+#include <math.h>
+#include <string.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define SID_USE_SSE 1
+#include <emmintrin.h>
+#else
+#define SID_USE_SSE 0
+#endif
+
+// SID reference: the 6581 datasheet.
+// This is not a cycle exact model of the chip, it aims for the right sound at a low cost.
+
+// Cycles between envelope counter steps, for each of the 16 ADSR rate settings.
+static const int EnvelopeRatePeriods[16] = { 9, 32, 63, 95, 149, 220, 267, 313, 392, 977, 1954, 3126, 3907, 11720, 19532, 31251 };
+
+Sid::Sid()
+{
+	AttachedCpu = nullptr;
+	AttachedControlPorts = nullptr;
+	OutputEnabled = true;
+	FirTable = new float[ResamplerPhases * ResamplerTaps];
+	SampleRate = 44100;
+	ClockHz = 1022727;
+	BuildFirTable();
+	Reset();
+}
+
+Sid::Sid(const Sid& Parent)
+{
+	AttachedCpu = nullptr;
+	AttachedControlPorts = nullptr;
+	FirTable = nullptr;
+	SampleRate = Parent.SampleRate;
+	ClockHz = Parent.ClockHz;
+	CopyState(Parent);
+}
+
+void Sid::CopyState(const Sid& Source)
+{
+	if (FirTable != nullptr && (SampleRate != Source.SampleRate || ClockHz != Source.ClockHz))
+	{
+		SampleRate = Source.SampleRate;
+		ClockHz = Source.ClockHz;
+		BuildFirTable();
+	}
+	SampleRate = Source.SampleRate;
+	ClockHz = Source.ClockHz;
+	OutputEnabled = Source.OutputEnabled;
+	WriteLog = Source.WriteLog;
+	memcpy(Registers, Source.Registers, sizeof(Registers));
+	memcpy(Voices, Source.Voices, sizeof(Voices));
+	SynthCycle = Source.SynthCycle;
+	FilterLow = Source.FilterLow;
+	FilterBand = Source.FilterBand;
+	FilterW = Source.FilterW;
+	FilterQ = Source.FilterQ;
+	ResampleStep = Source.ResampleStep;
+	ResamplePos = Source.ResamplePos;
+	memcpy(History, Source.History, sizeof(History));
+	HistoryCount = Source.HistoryCount;
+	// Samples the source hasn't read yet belong to the source.
+	Output.clear();
+	OutputRead = 0;
+}
+
+Sid::~Sid()
+{
+	delete[] FirTable;
+}
+
+void Sid::Reset()
+{
+	for (int i = 0; i < 32; i++)
+	{
+		Registers[i] = 0;
+	}
+	for (int i = 0; i < 3; i++)
+	{
+		SidVoice& v = Voices[i];
+		v.Frequency = 0;
+		v.PulseWidth = 0;
+		v.Control = 0;
+		v.AttackDecay = v.SustainRelease = 0;
+		v.Accumulator = 0;
+		v.Noise = 0x7FFFF8;
+		v.MsbRising = false;
+		v.EnvelopeState = EnvRelease;
+		v.EnvelopeLevel = 0;
+		v.EnvelopeCounter = 0;
+		v.ExponentialCounter = 0;
+	}
+
+	WriteLog.clear();
+	SynthCycle = 0;
+
+	FilterLow = FilterBand = 0;
+	UpdateFilter();
+
+	for (int i = 0; i < ResamplerTaps + BlockSize; i++)
+	{
+		History[i] = 0;
+	}
+	HistoryCount = ResamplerTaps;
+	ResamplePos = ResamplerTaps / 2 - 1;
+
+	Output.clear();
+	OutputRead = 0;
+}
+
+void Sid::SetClock(int CpuClockHz, int HostSampleRate)
+{
+	ClockHz = CpuClockHz;
+	SampleRate = HostSampleRate;
+	BuildFirTable();
+	UpdateFilter();
+}
+
+void Sid::ReleaseBuffers()
+{
+	delete[] FirTable;
+	FirTable = nullptr;
+	std::vector<short>().swap(Output);
+	OutputRead = 0;
+	std::vector<SidWrite>().swap(WriteLog);
+}
+
+void Sid::AllocateBuffers()
+{
+	if (FirTable == nullptr)
+	{
+		FirTable = new float[ResamplerPhases * ResamplerTaps];
+		BuildFirTable();
+	}
+}
+
+void Sid::Write8(int Address, unsigned char Data8)
+{
+	// Registers are mirrored every 32 bytes. The write takes effect when the block containing it is synthesized.
+	SidWrite write;
+	write.Cycle = AttachedCpu->Cycle;
+	write.Reg = Address & 0x1F;
+	write.Value = Data8;
+	WriteLog.push_back(write);
+}
+
+unsigned char Sid::Read8(int Address)
+{
+	switch (Address & 0x1F)
+	{
+	case 0x19: // POTX
+	case 0x1A: // POTY
+		return AttachedControlPorts->ReadPot((Address & 0x1F) - 0x19, AttachedCpu->Cycle);
+	case 0x1B: // OSC3
+		// Bring the oscillators up to the current cycle so the value is current.
+		Synthesize(AttachedCpu->Cycle);
+		return VoiceWaveform(2) >> 4;
+	case 0x1C: // ENV3
+		Synthesize(AttachedCpu->Cycle);
+		return Voices[2].EnvelopeLevel;
+	default:
+		return 0; // Write-only registers.
+	}
+}
+
+unsigned char Sid::Peek8(int Address)
+{
+	switch (Address & 0x1F)
+	{
+	case 0x1B: // OSC3
+		return VoiceWaveform(2) >> 4;
+	case 0x1C: // ENV3
+		return Voices[2].EnvelopeLevel;
+	default:
+		return Read8(Address);
+	}
+}
+
+void Sid::Synthesize(long long UntilCycle)
+{
+	for (size_t i = 0; i < WriteLog.size(); i++)
+	{
+		const SidWrite& write = WriteLog[i];
+		if (write.Cycle > SynthCycle)
+		{
+			int steps = (int)((write.Cycle - SynthCycle) / StepCycles);
+			RenderSteps(steps);
+			SynthCycle += (long long)steps * StepCycles;
+		}
+		ApplyWrite(write.Reg, write.Value);
+	}
+	WriteLog.clear();
+
+	if (UntilCycle > SynthCycle)
+	{
+		int steps = (int)((UntilCycle - SynthCycle) / StepCycles);
+		RenderSteps(steps);
+		SynthCycle += (long long)steps * StepCycles;
+	}
+}
+
+int Sid::AvailableSamples()
+{
+	return (int)(Output.size() - OutputRead);
+}
+
+int Sid::ReadSamples(short* Buffer, int MaxSamples)
+{
+	int count = AvailableSamples();
+	if (count > MaxSamples)
+	{
+		count = MaxSamples;
+	}
+	if (count > 0)
+	{
+		memcpy(Buffer, &Output[OutputRead], count * sizeof(short));
+		OutputRead += count;
+	}
+	if (OutputRead == Output.size())
+	{
+		Output.clear();
+		OutputRead = 0;
+	}
+	return count;
+}
+
+void Sid::ApplyWrite(int Reg, unsigned char Value)
+{
+	Registers[Reg] = Value;
+
+	if (Reg < 21)
+	{
+		SidVoice& v = Voices[Reg / 7];
+		switch (Reg % 7)
+		{
+		case 0: // Frequency Lo
+			v.Frequency = (v.Frequency & 0xFF00) | Value;
+			break;
+		case 1: // Frequency Hi
+			v.Frequency = (v.Frequency & 0xFF) | (Value << 8);
+			break;
+		case 2: // Pulse width Lo
+			v.PulseWidth = (v.PulseWidth & 0xF00) | Value;
+			break;
+		case 3: // Pulse width Hi
+			v.PulseWidth = (v.PulseWidth & 0xFF) | ((Value & 0x0F) << 8);
+			break;
+		case 4: // Control
+			if ((Value & CTRL_GATE) && !(v.Control & CTRL_GATE))
+			{
+				v.EnvelopeState = EnvAttack;
+			}
+			else if (!(Value & CTRL_GATE) && (v.Control & CTRL_GATE))
+			{
+				v.EnvelopeState = EnvRelease;
+			}
+			if (Value & CTRL_TEST)
+			{
+				// Test bit holds the oscillator at zero and resets the noise generator.
+				v.Accumulator = 0;
+				v.Noise = 0x7FFFF8;
+			}
+			v.Control = Value;
+			break;
+		case 5:
+			v.AttackDecay = Value;
+			break;
+		case 6:
+			v.SustainRelease = Value;
+			break;
+		}
+	}
+	else if (Reg <= 23)
+	{
+		// Cutoff and resonance
+		UpdateFilter();
+	}
+}
+
+void Sid::UpdateFilter()
+{
+	// 11 bit cutoff, roughly 30Hz - 12kHz on the 6581.
+	int cutoff = (Registers[22] << 3) | (Registers[21] & 7);
+	float internalRate = (float)ClockHz / StepCycles;
+	float frequency = 30.0f + cutoff * 5.8f;
+	FilterW = 2.0f * (float)sin(3.14159265 * frequency / internalRate);
+	FilterQ = 1.0f / (0.707f + (Registers[23] >> 4) / 15.0f);
+}
+
+void Sid::BuildFirTable()
+{
+	// Windowed sinc low pass at just under the host Nyquist frequency (or 20kHz, whichever is lower).
+	double inputRate = (double)ClockHz / StepCycles;
+	double cutoff = SampleRate * 0.45;
+	if (cutoff > 20000)
+	{
+		cutoff = 20000;
+	}
+	double fc = cutoff / inputRate; // Normalized to the input rate
+	const int half = ResamplerTaps / 2;
+
+	for (int p = 0; p < ResamplerPhases; p++)
+	{
+		double frac = (double)p / ResamplerPhases;
+		double sum = 0;
+		float* taps = FirTable + p * ResamplerTaps;
+		for (int k = 0; k < ResamplerTaps; k++)
+		{
+			double t = k - (half - 1) - frac; // Distance from the output position, in input samples.
+			double x = 2 * fc * t;
+			double sinc = (fabs(x) < 1e-9) ? 1.0 : sin(3.14159265358979 * x) / (3.14159265358979 * x);
+			double w = 0.42 + 0.5 * cos(3.14159265358979 * t / half) + 0.08 * cos(2 * 3.14159265358979 * t / half); // Blackman
+			if (fabs(t) >= half) w = 0;
+			taps[k] = (float)(sinc * w);
+			sum += taps[k];
+		}
+		for (int k = 0; k < ResamplerTaps; k++)
+		{
+			taps[k] = (float)(taps[k] / sum); // Unity gain at DC for every phase.
+		}
+	}
+
+	ResampleStep = inputRate / SampleRate;
+}
+
+int Sid::VoiceWaveform(int Index)
+{
+	SidVoice& v = Voices[Index];
+	const SidVoice& source = Voices[(Index + 2) % 3]; // Ring modulation and sync come from the previous voice.
+	unsigned int acc = v.Accumulator;
+	int waveform = 0xFFF;
+	int selected = v.Control & (CTRL_TRIANGLE | CTRL_SAWTOOTH | CTRL_PULSE | CTRL_NOISE);
+
+	if (selected == 0)
+	{
+		return 0x800; // No waveform, silent.
+	}
+
+	// Combined waveforms are approximated as the AND of the individual waveforms.
+	if (v.Control & CTRL_TRIANGLE)
+	{
+		unsigned int msb = acc & 0x800000;
+		if (v.Control & CTRL_RING)
+		{
+			msb ^= source.Accumulator & 0x800000;
+		}
+		waveform &= ((msb ? ~acc : acc) >> 11) & 0xFFF;
+	}
+	if (v.Control & CTRL_SAWTOOTH)
+	{
+		waveform &= acc >> 12;
+	}
+	if (v.Control & CTRL_PULSE)
+	{
+		waveform &= ((v.Control & CTRL_TEST) || (int)(acc >> 12) >= v.PulseWidth) ? 0xFFF : 0;
+	}
+	if (v.Control & CTRL_NOISE)
+	{
+		unsigned int n = v.Noise;
+		waveform &= (((n >> 22) & 1) << 11) | (((n >> 20) & 1) << 10) | (((n >> 16) & 1) << 9) | (((n >> 13) & 1) << 8)
+			| (((n >> 11) & 1) << 7) | (((n >> 7) & 1) << 6) | (((n >> 4) & 1) << 5) | (((n >> 2) & 1) << 4);
+	}
+	return waveform;
+}
+
+void Sid::ClockEnvelope(SidVoice& Voice)
+{
+	int rate;
+	switch (Voice.EnvelopeState)
+	{
+	case EnvAttack: rate = Voice.AttackDecay >> 4; break;
+	case EnvDecaySustain: rate = Voice.AttackDecay & 0x0F; break;
+	default: rate = Voice.SustainRelease & 0x0F; break;
+	}
+	int period = EnvelopeRatePeriods[rate];
+
+	Voice.EnvelopeCounter += StepCycles;
+	while (Voice.EnvelopeCounter >= period)
+	{
+		Voice.EnvelopeCounter -= period;
+
+		if (Voice.EnvelopeState == EnvAttack)
+		{
+			// Attack is linear.
+			Voice.EnvelopeLevel++;
+			if (Voice.EnvelopeLevel >= 0xFF)
+			{
+				Voice.EnvelopeLevel = 0xFF;
+				Voice.EnvelopeState = EnvDecaySustain;
+			}
+			continue;
+		}
+
+		int target = (Voice.EnvelopeState == EnvDecaySustain) ? (Voice.SustainRelease >> 4) * 0x11 : 0;
+		if (Voice.EnvelopeLevel <= target)
+		{
+			continue;
+		}
+
+		// Decay and release approximate an exponential curve by slowing down as the level falls.
+		int level = Voice.EnvelopeLevel;
+		int expPeriod = level > 0x5D ? 1 : level > 0x36 ? 2 : level > 0x1A ? 4 : level > 0x0E ? 8 : level > 0x06 ? 16 : 30;
+		if (++Voice.ExponentialCounter >= expPeriod)
+		{
+			Voice.ExponentialCounter = 0;
+			Voice.EnvelopeLevel--;
+		}
+	}
+}
+
+void Sid::ClockVoices(float* VoiceOut0, float* VoiceOut1, float* VoiceOut2, int Steps)
+{
+	float* outputs[3] = { VoiceOut0, VoiceOut1, VoiceOut2 };
+	const float scale = 1.0f / (0x800 * 255.0f);
+
+	for (int s = 0; s < Steps; s++)
+	{
+		// Advance all three oscillators first, sync depends on the neighboring voice.
+		for (int i = 0; i < 3; i++)
+		{
+			SidVoice& v = Voices[i];
+			if (v.Control & CTRL_TEST)
+			{
+				v.MsbRising = false;
+				continue;
+			}
+			unsigned int prev = v.Accumulator;
+			v.Accumulator = (prev + v.Frequency * StepCycles) & 0xFFFFFF;
+			v.MsbRising = !(prev & 0x800000) && (v.Accumulator & 0x800000);
+
+			// Noise shifts when bit 19 of the accumulator goes high.
+			if (!(prev & 0x080000) && (v.Accumulator & 0x080000))
+			{
+				unsigned int bit = ((v.Noise >> 22) ^ (v.Noise >> 17)) & 1;
+				v.Noise = ((v.Noise << 1) | bit) & 0x7FFFFF;
+			}
+		}
+		for (int i = 0; i < 3; i++)
+		{
+			SidVoice& v = Voices[i];
+			if ((v.Control & CTRL_SYNC) && Voices[(i + 2) % 3].MsbRising)
+			{
+				v.Accumulator = 0;
+			}
+
+			ClockEnvelope(v);
+			outputs[i][s] = (VoiceWaveform(i) - 0x800) * v.EnvelopeLevel * scale;
+		}
+	}
+}
+
+void Sid::RenderSteps(int Steps)
+{
+	float voice0[BlockSize], voice1[BlockSize], voice2[BlockSize];
+	float filterIn[BlockSize], mixed[BlockSize];
+
+	while (Steps > 0)
+	{
+		int count = Steps > BlockSize ? BlockSize : Steps;
+		Steps -= count;
+
+		ClockVoices(voice0, voice1, voice2, count);
+		if (!OutputEnabled)
+		{
+			continue;
+		}
+
+		// Voice routing: each voice goes either through the filter or directly to the output.
+		unsigned char filt = Registers[23];
+		unsigned char mode = Registers[24];
+		float route[3], direct[3];
+		for (int i = 0; i < 3; i++)
+		{
+			route[i] = (filt & (1 << i)) ? 1.0f : 0.0f;
+			direct[i] = 1.0f - route[i];
+		}
+		if (mode & MODE_3OFF)
+		{
+			// Voice 3 off only disconnects the direct path.
+			direct[2] = 0;
+		}
+		float volume = (mode & 0x0F) / 15.0f / 3.0f; // Divide by the voice count for headroom.
+
+		int i = 0;
+#if SID_USE_SSE
+		__m128 r0 = _mm_set1_ps(route[0]), r1 = _mm_set1_ps(route[1]), r2 = _mm_set1_ps(route[2]);
+		__m128 d0 = _mm_set1_ps(direct[0]), d1 = _mm_set1_ps(direct[1]), d2 = _mm_set1_ps(direct[2]);
+		for (; i + 4 <= count; i += 4)
+		{
+			__m128 v0 = _mm_loadu_ps(voice0 + i), v1 = _mm_loadu_ps(voice1 + i), v2 = _mm_loadu_ps(voice2 + i);
+			__m128 f = _mm_add_ps(_mm_add_ps(_mm_mul_ps(v0, r0), _mm_mul_ps(v1, r1)), _mm_mul_ps(v2, r2));
+			__m128 d = _mm_add_ps(_mm_add_ps(_mm_mul_ps(v0, d0), _mm_mul_ps(v1, d1)), _mm_mul_ps(v2, d2));
+			_mm_storeu_ps(filterIn + i, f);
+			_mm_storeu_ps(mixed + i, d);
+		}
+#endif
+		for (; i < count; i++)
+		{
+			filterIn[i] = voice0[i] * route[0] + voice1[i] * route[1] + voice2[i] * route[2];
+			mixed[i] = voice0[i] * direct[0] + voice1[i] * direct[1] + voice2[i] * direct[2];
+		}
+
+		// The filter is recursive, so it runs one sample at a time.
+		if (filt & 7)
+		{
+			float lpGain = (mode & MODE_LP) ? 1.0f : 0.0f;
+			float bpGain = (mode & MODE_BP) ? 1.0f : 0.0f;
+			float hpGain = (mode & MODE_HP) ? 1.0f : 0.0f;
+			for (i = 0; i < count; i++)
+			{
+				float high = filterIn[i] - FilterLow - FilterQ * FilterBand;
+				FilterBand += FilterW * high;
+				FilterLow += FilterW * FilterBand;
+				mixed[i] += FilterLow * lpGain + FilterBand * bpGain + high * hpGain;
+			}
+		}
+
+		i = 0;
+#if SID_USE_SSE
+		__m128 vol = _mm_set1_ps(volume);
+		for (; i + 4 <= count; i += 4)
+		{
+			_mm_storeu_ps(mixed + i, _mm_mul_ps(_mm_loadu_ps(mixed + i), vol));
+		}
+#endif
+		for (; i < count; i++)
+		{
+			mixed[i] *= volume;
+		}
+
+		Resample(mixed, count);
+	}
+}
+
+void Sid::Resample(const float* Input, int Count)
+{
+	const int half = ResamplerTaps / 2;
+
+	memcpy(History + HistoryCount, Input, Count * sizeof(float));
+	HistoryCount += Count;
+
+	while (true)
+	{
+		int index = (int)ResamplePos;
+		if (index + half >= HistoryCount)
+		{
+			break;
+		}
+		int phase = (int)((ResamplePos - index) * ResamplerPhases);
+		const float* taps = FirTable + phase * ResamplerTaps;
+		const float* src = History + index - (half - 1);
+
+		float sum;
+		int k = 0;
+#if SID_USE_SSE
+		__m128 acc = _mm_setzero_ps();
+		for (; k + 4 <= ResamplerTaps; k += 4)
+		{
+			acc = _mm_add_ps(acc, _mm_mul_ps(_mm_loadu_ps(src + k), _mm_loadu_ps(taps + k)));
+		}
+		float partial[4];
+		_mm_storeu_ps(partial, acc);
+		sum = partial[0] + partial[1] + partial[2] + partial[3];
+#else
+		sum = 0;
+#endif
+		for (; k < ResamplerTaps; k++)
+		{
+			sum += src[k] * taps[k];
+		}
+
+		int sample = (int)(sum * 32767.0f);
+		if (sample > 32767) sample = 32767;
+		if (sample < -32768) sample = -32768;
+		Output.push_back((short)sample);
+
+		ResamplePos += ResampleStep;
+	}
+
+	// Drop input samples that no later output needs.
+	int consumed = (int)ResamplePos - (half - 1);
+	if (consumed > HistoryCount) consumed = HistoryCount;
+	if (consumed > 0)
+	{
+		memmove(History, History + consumed, (HistoryCount - consumed) * sizeof(float));
+		HistoryCount -= consumed;
+		ResamplePos -= consumed;
+	}
+
+	// If nothing is draining the output, keep only the most recent second.
+	if (Output.size() - OutputRead > (size_t)SampleRate)
+	{
+		OutputRead = Output.size() - SampleRate;
+	}
+	if (OutputRead > (size_t)SampleRate)
+	{
+		Output.erase(Output.begin(), Output.begin() + OutputRead);
+		OutputRead = 0;
+	}
+}
@@ -0,0 +1,132 @@
+#ifndef _SID_H
+#define _SID_H
+
+#include <cstddef>
+#include <vector>
+
+class Cpu;
+class ControlPorts;
+
+// One of the 3 SID oscillators with its envelope generator.
+struct SidVoice
+{
+	int Frequency; // 16 bit
+	int PulseWidth; // 12 bit
+	unsigned char Control; // Waveform select, test, ring mod, sync, gate
+	unsigned char AttackDecay, SustainRelease;
+
+	unsigned int Accumulator; // 24 bit phase accumulator
+	unsigned int Noise; // 23 bit noise LFSR
+	bool MsbRising; // Accumulator MSB went 0->1 during the last step (for hard sync)
+
+	int EnvelopeState;
+	int EnvelopeLevel; // 0-255
+	int EnvelopeCounter; // Cycles accumulated towards the next envelope step
+	int ExponentialCounter; // Extra divider for decay/release
+};
+
+// SID (6581) sound chip.
+// Register writes are logged with the cycle they happened on, and audio is synthesized in blocks (at the end of
+// each batch of emulated cycles) rather than clocking the chip every cycle. Synthesis runs at an internal rate of
+// one step per StepCycles CPU cycles, then a band-limited FIR resampler converts to the host sample rate.
+class Sid
+{
+public:
+	Sid();
+	// Copies the chip state of another machine, without buffers. Call AllocateBuffers before running it.
+	Sid(const Sid& Parent);
+	// Copy the chip state of another machine, keeping this one's buffers.
+	void CopyState(const Sid& Source);
+	~Sid();
+
+	void Reset();
+
+	void Write8(int Address, unsigned char Data8);
+	unsigned char Read8(int Address);
+	unsigned char Peek8(int Address); // As of the last synthesis, without running it.
+
+	void SetClock(int CpuClockHz, int HostSampleRate);
+
+	// Free the resampler table and sample buffers while hibernated.
+	void ReleaseBuffers();
+	void AllocateBuffers();
+
+	// Synthesize audio up to the given cycle, applying logged register writes at the cycle they happened.
+	void Synthesize(long long UntilCycle);
+
+	// Take synthesized samples (16 bit signed mono, host rate). Returns the number of samples copied.
+	int ReadSamples(short* Buffer, int MaxSamples);
+	int AvailableSamples();
+
+	Cpu * AttachedCpu;
+	ControlPorts * AttachedControlPorts;
+
+	unsigned char Registers[32];
+
+	// Set false when nothing consumes the audio; register state is still tracked but no samples are produced.
+	bool OutputEnabled;
+
+	static const int StepCycles = 8; // CPU cycles per internal synthesis step
+	static const int BlockSize = 256; // Internal steps processed per block
+	static const int ResamplerTaps = 32; // FIR length, in internal steps
+	static const int ResamplerPhases = 256; // Fractional positions in the FIR table
+
+protected:
+
+	struct SidWrite
+	{
+		long long Cycle;
+		unsigned char Reg;
+		unsigned char Value;
+	};
+
+	std::vector<SidWrite> WriteLog;
+
+	SidVoice Voices[3];
+
+	long long SynthCycle; // Cycle the synthesis has reached.
+
+	// Filter state (state variable filter)
+	float FilterLow, FilterBand;
+	float FilterW, FilterQ;
+
+	// Resampler state
+	int SampleRate, ClockHz;
+	double ResampleStep; // Internal steps per output sample
+	double ResamplePos; // Position of the next output sample, relative to the start of History
+	float History[ResamplerTaps + BlockSize];
+	int HistoryCount;
+	float* FirTable; // ResamplerPhases x ResamplerTaps coefficients
+
+	std::vector<short> Output;
+	size_t OutputRead;
+
+	void ApplyWrite(int Reg, unsigned char Value);
+	void RenderSteps(int Steps);
+	void ClockVoices(float* VoiceOut0, float* VoiceOut1, float* VoiceOut2, int Steps);
+	void ClockEnvelope(SidVoice& Voice);
+	int VoiceWaveform(int Index);
+	void Resample(const float* Input, int Count);
+	void UpdateFilter();
+	void BuildFirTable();
+
+	enum EnvelopeStates { EnvAttack, EnvDecaySustain, EnvRelease };
+
+	// Control register bits
+	const unsigned char CTRL_GATE = 0x01;
+	const unsigned char CTRL_SYNC = 0x02;
+	const unsigned char CTRL_RING = 0x04;
+	const unsigned char CTRL_TEST = 0x08;
+	const unsigned char CTRL_TRIANGLE = 0x10;
+	const unsigned char CTRL_SAWTOOTH = 0x20;
+	const unsigned char CTRL_PULSE = 0x40;
+	const unsigned char CTRL_NOISE = 0x80;
+
+	// $D418 mode/volume bits
+	const unsigned char MODE_LP = 0x10;
+	const unsigned char MODE_BP = 0x20;
+	const unsigned char MODE_HP = 0x40;
+	const unsigned char MODE_3OFF = 0x80;
+};
+
+#endif
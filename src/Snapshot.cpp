@@ -0,0 +1,155 @@
+#include "Snapshot.h"
+#include <cstring>
+
+RamSnapshot::RamSnapshot()
+{
+	Clear();
+}
+
+void RamSnapshot::Clear()
+{
+	CapturedLength = 0;
+	std::vector<unsigned char>().swap(Kinds);
+	std::vector<unsigned int>().swap(Offsets);
+	std::vector<unsigned char>().swap(Data);
+	Reference.reset();
+}
+
+// Run length encoding, a control byte then data:
+// 0-127: the next (control + 1) bytes are literals. 128-255: the next byte repeats (control - 125) times (3-130).
+int RamSnapshot::EncodePage(const unsigned char* Page, unsigned char* Output)
+{
+	int in = 0, out = 0;
+	while (in < PageSize)
+	{
+		int run = 1;
+		while (in + run < PageSize && run < 130 && Page[in + run] == Page[in])
+		{
+			run++;
+		}
+		if (run >= 3)
+		{
+			Output[out++] = (unsigned char)(run + 125);
+			Output[out++] = Page[in];
+			in += run;
+			continue;
+		}
+
+		// Literals, up to the next run of 3 or more.
+		int start = in;
+		while (in < PageSize && in - start < 128)
+		{
+			if (in + 2 < PageSize && Page[in] == Page[in + 1] && Page[in] == Page[in + 2])
+			{
+				break;
+			}
+			in++;
+		}
+		Output[out++] = (unsigned char)(in - start - 1);
+		memcpy(Output + out, Page + start, in - start);
+		out += in - start;
+	}
+	return out;
+}
+
+void RamSnapshot::DecodePage(const unsigned char* Input, unsigned char* Page)
+{
+	int out = 0;
+	while (out < PageSize)
+	{
+		int control = *Input++;
+		if (control < 128)
+		{
+			memcpy(Page + out, Input, control + 1);
+			Input += control + 1;
+			out += control + 1;
+		}
+		else
+		{
+			memset(Page + out, *Input++, control - 125);
+			out += control - 125;
+		}
+	}
+}
+
+void RamSnapshot::Capture(const unsigned char* Source, size_t Length, SharedRamImage ReferenceImage)
+{
+	Clear();
+	Reference = ReferenceImage;
+	CapturedLength = Length;
+
+	size_t pages = (Length + PageSize - 1) / PageSize;
+	Kinds.resize(pages);
+	Offsets.resize(pages);
+
+	static const unsigned char zeroPage[PageSize] = {};
+	unsigned char page[PageSize];
+	unsigned char encoded[PageSize * 2];
+	std::vector<unsigned char> data;
+	for (size_t i = 0; i < pages; i++)
+	{
+		// A partial last page is padded with zeros.
+		size_t offset = i * PageSize;
+		size_t length = Length - offset < (size_t)PageSize ? Length - offset : PageSize;
+		memset(page, 0, PageSize);
+		memcpy(page, Source + offset, length);
+
+		Offsets[i] = 0;
+		if (memcmp(page, zeroPage, PageSize) == 0)
+		{
+			Kinds[i] = PageZero;
+			continue;
+		}
+		if (Reference && memcmp(page, &(*Reference)[offset], length) == 0)
+		{
+			Kinds[i] = PageReference;
+			continue;
+		}
+
+		Offsets[i] = (unsigned int)data.size();
+		int encodedLength = EncodePage(page, encoded);
+		if (encodedLength < PageSize)
+		{
+			Kinds[i] = PageEncoded;
+			data.insert(data.end(), encoded, encoded + encodedLength);
+		}
+		else
+		{
+			Kinds[i] = PageRaw;
+			data.insert(data.end(), page, page + PageSize);
+		}
+	}
+	// Copy so the capacity is exactly what's used.
+	Data.assign(data.begin(), data.end());
+}
+
+void RamSnapshot::Restore(unsigned char* Destination) const
+{
+	unsigned char page[PageSize];
+	for (size_t i = 0; i < Kinds.size(); i++)
+	{
+		size_t offset = i * PageSize;
+		size_t length = CapturedLength - offset < (size_t)PageSize ? CapturedLength - offset : PageSize;
+		switch (Kinds[i])
+		{
+		case PageZero:
+			memset(page, 0, PageSize);
+			break;
+		case PageReference:
+			memcpy(page, &(*Reference)[offset], length);
+			break;
+		case PageEncoded:
+			DecodePage(&Data[Offsets[i]], page);
+			break;
+		case PageRaw:
+			memcpy(page, &Data[Offsets[i]], PageSize);
+			break;
+		}
+		memcpy(Destination + offset, page, length);
+	}
+}
+
+size_t RamSnapshot::Size() const
+{
+	return sizeof(*this) + Kinds.capacity() + Offsets.capacity() * sizeof(unsigned int) + Data.capacity();
+}
@@ -0,0 +1,43 @@
+#ifndef _SNAPSHOT_H
+#define _SNAPSHOT_H
+
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+// RAM image shared between instances, e.g. the RAM of a freshly booted machine.
+typedef std::shared_ptr<const std::vector<unsigned char> > SharedRamImage;
+
+// A compact copy of a block of memory (RAM, or a frame buffer), kept per 256 byte page. Pages that are all zero
+// or identical to the reference image take no space, other pages are run length encoded (or stored as is if
+// that's smaller).
+class RamSnapshot
+{
+public:
+	RamSnapshot();
+
+	// The reference image, if any, must be at least Length bytes.
+	void Capture(const unsigned char* Source, size_t Length, SharedRamImage ReferenceImage);
+	void Restore(unsigned char* Destination) const;
+	void Clear();
+
+	// Bytes used by the snapshot, including its page table.
+	size_t Size() const;
+	bool Empty() const { return Kinds.empty(); }
+
+	static const int PageSize = 256;
+
+protected:
+	enum PageKinds { PageZero, PageReference, PageEncoded, PageRaw };
+
+	size_t CapturedLength;
+	std::vector<unsigned char> Kinds;
+	std::vector<unsigned int> Offsets; // Start of each page's data in Data
+	std::vector<unsigned char> Data;
+	SharedRamImage Reference;
+
+	static int EncodePage(const unsigned char* Page, unsigned char* Output);
+	static void DecodePage(const unsigned char* Input, unsigned char* Page);
+};
+
+#endif
@@ -1,45 +1,184 @@
 #include "Video.h"
 #include "Memory.h"
 #include "Cpu.h"
+#include "Emulation.h"
 #include <cstdio>
+#include <cstring>
+
+Video::Video() : evtRaster(CallbackRaster, this), evtBadLine(CallbackBadLine, this)
+{
+	AttachedWindow = NULL;
+	ScreenData = NULL;
+	IndexData = NULL;
+	DirtyLines = NULL;
+	SharedFrameCycle = -1;
+
+	SetModel(GetMachineModel(MachinePAL));
+}
 
-#define GENERATE_COLOR(r,g,b) (((r)<<16) | ((g)<<8) | (b) | 0xFF000000)
 
-Video::Video()
+Video::Video(const Video& Parent) : evtRaster(Parent.evtRaster), evtBadLine(Parent.evtBadLine)
 {
-	ScreenWidth = 411;
-	ScreenHeight = 234;
+	AttachedMemory = NULL;
+	AttachedCpu = NULL;
+	AttachedEmulation = NULL;
+	AttachedWindow = NULL;
+	ScreenData = NULL;
+	IndexData = NULL;
+	DirtyLines = NULL;
+	AnyDirty = false;
+	SharedFrameCycle = -1;
+	Model = Parent.Model;
+	CopyState(Parent);
+}
 
+void Video::CopyState(const Video& Source)
+{
+	if (Model != Source.Model && ScreenData != NULL)
+	{
+		// Frame size changes with the model.
+		Model = Source.Model;
+		ReleaseBuffers();
+		AllocateBuffers();
+	}
+	Model = Source.Model;
+	StepFunction = Source.StepFunction;
+	CyclesPerLine = Source.CyclesPerLine;
+	LinesPerFrame = Source.LinesPerFrame;
+	ScreenWidth = Source.ScreenWidth;
+	ScreenHeight = Source.ScreenHeight;
+	memcpy(Colors, Source.Colors, sizeof(Colors));
+
+	// Events keep their queue state, but call back into this chip.
+	evtRaster = Source.evtRaster;
+	evtBadLine = Source.evtBadLine;
+	evtRaster.Context = evtBadLine.Context = this;
+
+	FrameCount = Source.FrameCount;
+	CursorX = Source.CursorX;
+	CursorY = Source.CursorY;
+	PrevCycle = Source.PrevCycle;
+	StartX = Source.StartX;
+	EndX = Source.EndX;
+	StartY = Source.StartY;
+	EndY = Source.EndY;
+	IrqFlags = Source.IrqFlags;
+	IrqMask = Source.IrqMask;
+	IrqRequested = Source.IrqRequested;
+	memcpy(Registers, Source.Registers, sizeof(Registers));
+	memcpy(ColorRam, Source.ColorRam, sizeof(ColorRam));
+
+	memcpy(SpriteLine, Source.SpriteLine, sizeof(SpriteLine));
+	memcpy(SpriteMasks, Source.SpriteMasks, sizeof(SpriteMasks));
+	memcpy(BackgroundMask, Source.BackgroundMask, sizeof(BackgroundMask));
+	SpritesOnLine = Source.SpritesOnLine;
+	SpriteSpriteCollision = Source.SpriteSpriteCollision;
+	SpriteBackgroundCollision = Source.SpriteBackgroundCollision;
+}
+
+Video::~Video()
+{
+	delete[] ScreenData;
+	delete[] IndexData;
+	delete[] DirtyLines;
+}
+
+void Video::SetModel(const MachineModel* NewModel)
+{
+	Model = NewModel;
+	CyclesPerLine = Model->CyclesPerLine;
+	LinesPerFrame = Model->LinesPerFrame;
+	if (Model->Type == MachineNTSC)
+	{
+		StepFunction = &Video::RasterStep<MachineNTSC>;
+	}
+	else
+	{
+		StepFunction = &Video::RasterStep<MachinePAL>;
+	}
+
+	for (int i = 0; i < 16; i++)
+	{
+		Colors[i] = Model->Palette[i];
+	}
+
+	ReleaseBuffers();
+	AllocateBuffers();
+}
+
+void Video::ReleaseBuffers()
+{
+	delete[] ScreenData;
+	delete[] IndexData;
+	delete[] DirtyLines;
+	ScreenData = NULL;
+	IndexData = NULL;
+	DirtyLines = NULL;
+	SharedFrame.reset();
+	Presenter.Stop();
+}
+
+void Video::AllocateBuffers()
+{
+	ScreenWidth = Model->VisibleWidth;
+	ScreenHeight = Model->VisibleLines;
 	ScreenData = new unsigned int[ScreenWidth * ScreenHeight];
+	IndexData = new unsigned char[ScreenWidth * ScreenHeight];
+	DirtyLines = new bool[ScreenHeight];
+	memset(ScreenData, 0, ScreenWidth * ScreenHeight * sizeof(unsigned int));
+	MarkAllDirty();
 
-	// Colors randomly entered, probably way off.
-	Colors[0] = GENERATE_COLOR(0, 0, 0); // Black
-	Colors[1] = GENERATE_COLOR(255, 255, 255); // White
-	Colors[2] = GENERATE_COLOR(255, 0, 0); // Red
-	Colors[3] = GENERATE_COLOR(0, 255, 255); // Cyan
-	Colors[4] = GENERATE_COLOR(255, 192, 192); // Pink
-	Colors[5] = GENERATE_COLOR(0, 255, 0); // Green
-	Colors[6] = GENERATE_COLOR(0, 0, 255); // Blue
-	Colors[7] = GENERATE_COLOR(255, 255, 0); // Yellow
-	Colors[8] = GENERATE_COLOR(255, 128, 0); // Orange
-	Colors[9] = GENERATE_COLOR(128, 128, 0); // Brown
-	Colors[10] = GENERATE_COLOR(255, 128, 128); // Light Red
-	Colors[11] = GENERATE_COLOR(64, 64, 64); // Dark Grey
-	Colors[12] = GENERATE_COLOR(128, 128, 128); // Medium Gray
-	Colors[13] = GENERATE_COLOR(128, 255, 128); // Light Green
-	Colors[14] = GENERATE_COLOR(128, 128, 255); // Light Blue
-	Colors[15] = GENERATE_COLOR(192, 192, 192); // Light Gray
+	if (AttachedWindow != NULL)
+	{
+		// Rendering to a window, the presenter needs frame buffers and a texture of the new size.
+		Presenter.Start(AttachedWindow, ScreenWidth, ScreenHeight);
+	}
 }
 
+void Video::Hibernate()
+{
+	HibernatedFrame = ShareFrame();
+	ReleaseBuffers();
+}
 
-Video::~Video()
+void Video::Resume()
+{
+	AllocateBuffers();
+	if (HibernatedFrame)
+	{
+		HibernatedFrame->Restore(IndexData);
+		HibernatedFrame.reset();
+	}
+
+	// Rebuild the ARGB frame from the indexes. Rows still need uploading.
+	for (int i = 0; i < ScreenWidth * ScreenHeight; i++)
+	{
+		ScreenData[i] = IndexData[i] < 16 ? Colors[IndexData[i]] : 0;
+	}
+}
+
+std::shared_ptr<const RamSnapshot> Video::ShareFrame()
 {
+	if (IndexData == NULL)
+	{
+		// Hibernated, the frame is already in a snapshot.
+		return HibernatedFrame;
+	}
+	if (!SharedFrame || SharedFrameCycle != AttachedCpu->Cycle)
+	{
+		std::shared_ptr<RamSnapshot> frame = std::make_shared<RamSnapshot>();
+		frame->Capture(IndexData, ScreenWidth * ScreenHeight, SharedRamImage());
+		SharedFrame = frame;
+		SharedFrameCycle = AttachedCpu->Cycle;
+	}
+	return SharedFrame;
 }
 
 void Video::Reset()
 {
 	CursorX = 0;
 	CursorY = 0;
+	FrameCount = 0;
 	PrevCycle = 0;
 
 	for (int i = 0; i < 64; i++)
@@ -52,22 +191,28 @@ void Video::Reset()
 		ColorRam[i] = i;
 	}
 
+	SpriteSpriteCollision = SpriteBackgroundCollision = 0;
+	IrqFlags = 0;
+	IrqMask = 0;
+	IrqRequested = false;
+	memset(SpriteLine, 0, sizeof(SpriteLine));
+
 	UpdateMode();
+	PrepareSpriteLine();
 }
 
 // Video emulation reference http://www.cebix.net/VIC-Article.txt
-// Just picking one of the variants to emulate and will make it more generic later.
-// Details being used here:
-// 64 cycles per line, 411 visible pixels per line
-// 234 visible lines, 262 lines total, 262*64 = 16768  cyeles per frame
-// With a system clock of 1022.7khz is 60.991 Hz
+// Line and frame timing comes from the machine model:
+// PAL 6569: 63 cycles per line, 312 lines, 19656 cycles per frame. With a system clock of 985.2khz is 50.125 Hz
+// NTSC 6567R8: 65 cycles per line, 263 lines, 17095 cycles per frame. With a system clock of 1022.7khz is 59.826 Hz
+// CursorY is the raster line and CursorX is the X position in sprite coordinates, both starting at 0 on cycle 0.
 // Every clock cycle, the code will advance the raster cursor and fill in the pixels that were rendered in that time
 // This approximates what the real hardware would do. It's not quite as precise for a few reasons.
 
 void Video::UpdateMode()
 {
 	StartX = 24; EndX = 343;
-	StartY = 51 - 28; EndY = 250 - 28;
+	StartY = 51; EndY = 250;
 	if ((Registers[0x11] & 0x08) == 0)
 	{ 
 		// RSEL = 0
@@ -85,14 +230,281 @@ void Video::UpdateMode()
 unsigned char Video::ReadVicMemory(int Address)
 {
 	// The VIC-II chip sees memory with a different map than the C64 cpu.
-	// Emulate that map here.
+	return AttachedMemory->PeekVic(Address);
+}
+
+int Video::RasterAtCycle(long long Cycle)
+{
+	return (int)((Cycle / CyclesPerLine) % LinesPerFrame);
+}
+
+long long Video::NextLineStart(int Raster, long long AfterCycle)
+{
+	// First cycle after AfterCycle that the given raster line starts on.
+	long long line = AfterCycle / CyclesPerLine;
+	int currentRaster = (int)(line % LinesPerFrame);
+	int ahead = (Raster - currentRaster + LinesPerFrame) % LinesPerFrame;
+	if (ahead == 0)
+	{
+		ahead = LinesPerFrame;
+	}
+	return (line + ahead) * CyclesPerLine;
+}
+
+int Video::RasterCompare()
+{
+	// Bit 7 of $D011 is bit 8 of the compare line when written.
+	return Registers[0x12] | ((Registers[0x11] & 0x80) << 1);
+}
+
+long long Video::IdleSkipLimit(long long Cycle)
+{
+	if ((IrqMask & (IRQ_SPRITE_SPRITE | IRQ_SPRITE_BACKGROUND)) != 0 && Registers[0x15] != 0)
+	{
+		// Collisions are found at the end of each line.
+		return (Cycle / CyclesPerLine + 1) * CyclesPerLine;
+	}
+	return Cycle + 0x7FFFFFFF;
+}
+
+void Video::ScheduleEvents()
+{
+	ScheduleRasterIrq();
+	ScheduleBadLine();
+}
+
+void Video::ScheduleRasterIrq()
+{
+	int compare = RasterCompare();
+	if (compare >= LinesPerFrame)
+	{
+		// Line never reached.
+		if (evtRaster.Queued)
+		{
+			AttachedEmulation->CancelEvent(&evtRaster);
+		}
+		return;
+	}
+	AttachedEmulation->QueueEvent(NextLineStart(compare, AttachedCpu->Cycle), &evtRaster);
+}
+
+void Video::ScheduleBadLine()
+{
+	// A bad line is a line in the display area where the bottom 3 bits of the raster match YSCROLL, while the display is enabled.
+	// The VIC fetches a row of character pointers then, and the CPU is stopped for 40 cycles.
+	if ((Registers[0x11] & 0x10) == 0)
+	{
+		if (evtBadLine.Queued)
+		{
+			AttachedEmulation->CancelEvent(&evtBadLine);
+		}
+		return;
+	}
+
+	int yscroll = Registers[0x11] & 7;
+	int raster = RasterAtCycle(AttachedCpu->Cycle);
+	for (int i = 1; i <= LinesPerFrame; i++)
+	{
+		int line = (raster + i) % LinesPerFrame;
+		if (line >= 0x30 && line <= 0xF7 && (line & 7) == yscroll)
+		{
+			AttachedEmulation->QueueEvent(NextLineStart(line, AttachedCpu->Cycle), &evtBadLine);
+			return;
+		}
+	}
+}
+
+void Video::CallbackRaster(EventRequest* Request)
+{
+	Video* video = (Video*)Request->Context;
+	video->SetIrqFlags(video->IRQ_RASTER);
+	video->ScheduleRasterIrq();
+}
+
+void Video::CallbackBadLine(EventRequest* Request)
+{
+	Video* video = (Video*)Request->Context;
+	video->AttachedCpu->StealCycles(BadLineStealCycles);
+	video->ScheduleBadLine();
+}
+
+void Video::SetIrqFlags(int Flags)
+{
+	IrqFlags |= Flags;
+	UpdateIrq();
+}
+
+void Video::UpdateIrq()
+{
+	bool request = (IrqFlags & IrqMask & 0x0F) != 0;
+	if (request != IrqRequested)
+	{
+		IrqRequested = request;
+		if (request)
+		{
+			AttachedCpu->RequestIrq(InterruptSourceVIC);
+		}
+		else
+		{
+			AttachedCpu->UnrequestIrq(InterruptSourceVIC);
+		}
+	}
+}
+
+void Video::PrepareSpriteLine()
+{
+	SpritesOnLine = 0;
+	for (int i = 0; i < LineWords; i++)
+	{
+		BackgroundMask[i] = 0;
+	}
+
+	unsigned char enabled = Registers[0x15];
+	if (enabled == 0)
+	{
+		return;
+	}
+
+	int raster = CursorY;
+	int VM = Registers[0x18] >> 4; // Sprite pointers are in the last 8 bytes of video memory.
+
+	// Draw sprite 7 first, so lower numbered sprites end up in front.
+	for (int n = 7; n >= 0; n--)
+	{
+		int bit = 1 << n;
+		if ((enabled & bit) == 0)
+		{
+			continue;
+		}
+
+		int row = raster - (Registers[1 + n * 2] + 1);
+		if (Registers[0x17] & bit)
+		{
+			row >>= 1; // Y expansion shows each row twice.
+		}
+		if (row < 0 || row >= 21)
+		{
+			continue;
+		}
+
+		int pointer = ReadVicMemory((VM << 10) | 0x3F8 | n);
+		int dataAddress = pointer * 64 + row * 3;
+		int data = (ReadVicMemory(dataAddress) << 16) | (ReadVicMemory(dataAddress + 1) << 8) | ReadVicMemory(dataAddress + 2);
+		if (data == 0)
+		{
+			continue;
+		}
+
+		int x = Registers[n * 2] | ((Registers[0x10] & bit) ? 0x100 : 0);
+		int pixelWidth = (Registers[0x1D] & bit) ? 2 : 1; // X expansion
+		bool multicolor = (Registers[0x1C] & bit) != 0;
+		unsigned char flags = SPRITE_PIXEL | ((Registers[0x1B] & bit) ? SPRITE_BEHIND : 0);
+		unsigned char colors[4];
+		colors[1] = Registers[0x25] & 0x0F; // Multicolor 0
+		colors[2] = Registers[0x27 + n] & 0x0F; // Sprite color
+		colors[3] = Registers[0x26] & 0x0F; // Multicolor 1
+
+		unsigned long long* mask = SpriteMasks[n];
+		for (int i = 0; i < LineWords; i++)
+		{
+			mask[i] = 0;
+		}
+
+		for (int p = 0; p < 24; p++)
+		{
+			int color;
+			if (multicolor)
+			{
+				// Pairs of bits select one of 3 colors, each pair is 2 pixels wide.
+				color = (data >> (22 - (p & ~1))) & 3;
+			}
+			else
+			{
+				color = ((data >> (23 - p)) & 1) ? 2 : 0;
+			}
+			if (color == 0)
+			{
+				continue;
+			}
+			for (int w = 0; w < pixelWidth; w++)
+			{
+				int px = x + p * pixelWidth + w;
+				if (px >= LineWidth)
+				{
+					break;
+				}
+				SpriteLine[px] = flags | colors[color];
+				mask[px >> 6] |= 1ULL << (px & 63);
+			}
+		}
+		SpritesOnLine |= bit;
+	}
+}
+
+void Video::FinishSpriteLine()
+{
+	if (SpritesOnLine == 0)
+	{
+		return;
+	}
+
+	// Sprite-sprite: find pixels covered by 2 or more sprites, then which sprites cover any of them.
+	unsigned long long seen[LineWords] = {}, multiple[LineWords] = {};
+	for (int n = 0; n < 8; n++)
+	{
+		if (SpritesOnLine & (1 << n))
+		{
+			for (int i = 0; i < LineWords; i++)
+			{
+				multiple[i] |= seen[i] & SpriteMasks[n][i];
+				seen[i] |= SpriteMasks[n][i];
+			}
+		}
+	}
+
+	for (int n = 0; n < 8; n++)
+	{
+		if ((SpritesOnLine & (1 << n)) == 0)
+		{
+			continue;
+		}
+		unsigned long long hitSprite = 0, hitBackground = 0;
+		for (int i = 0; i < LineWords; i++)
+		{
+			hitSprite |= multiple[i] & SpriteMasks[n][i];
+			hitBackground |= BackgroundMask[i] & SpriteMasks[n][i];
+		}
+		if (hitSprite)
+		{
+			// The interrupt is only raised by the first collision after the register was cleared.
+			if (SpriteSpriteCollision == 0)
+			{
+				SetIrqFlags(IRQ_SPRITE_SPRITE);
+			}
+			SpriteSpriteCollision |= 1 << n;
+		}
+		if (hitBackground)
+		{
+			if (SpriteBackgroundCollision == 0)
+			{
+				SetIrqFlags(IRQ_SPRITE_BACKGROUND);
+			}
+			SpriteBackgroundCollision |= 1 << n;
+		}
+	}
 
-	if ((Address >= 0x1000 && Address < 0x2000) || (Address >= 0x9000 && Address < 0xA000))
+	// Clear the pixels this line used, ready for the next one.
+	for (int i = 0; i < LineWords; i++)
 	{
-		// Character ROM
-		return AttachedMemory->Char[Address & 0xFFF];
+		unsigned long long bits = seen[i];
+		while (bits)
+		{
+			int b = 0;
+			while (((bits >> b) & 1) == 0) b++;
+			SpriteLine[i * 64 + b] = 0;
+			bits &= bits - 1;
+		}
 	}
-	return AttachedMemory->RAM[Address];
 }
 
 
@@ -101,7 +513,18 @@ void Video::VideoStep()
 	int cycles = (int)(AttachedCpu->Cycle - PrevCycle);
 	PrevCycle += cycles;
 
-	int pixels = cycles * 8;
+	(this->*StepFunction)(cycles);
+}
+
+template <MachineModelType Type>
+void Video::RasterStep(int Cycles)
+{
+	const int linePixels = ModelGeometry<Type>::CyclesPerLine * 8;
+	const int frameLines = ModelGeometry<Type>::LinesPerFrame;
+	const int firstVisibleX = Model->FirstVisibleX;
+	const int firstVisibleLine = Model->FirstVisibleLine;
+
+	int pixels = Cycles * 8;
 	while (pixels-- > 0)
 	{
 		int paletteColor = 0;
@@ -139,25 +562,54 @@ void Video::VideoStep()
 			{
 				// Bit is set!
 				paletteColor = tileColor;
+				if (SpritesOnLine)
+				{
+					BackgroundMask[CursorX >> 6] |= 1ULL << (CursorX & 63);
+				}
 			}
 
+			// The border covers sprites, so they only show in the display window. Sprite to sprite collisions are
+			// still found under the border, when the line is finished.
+			if (SpritesOnLine)
+			{
+				unsigned char sprite = SpriteLine[CursorX];
+				if (sprite)
+				{
+					// Sprites with background priority only show over background colored pixels.
+					bool behind = (sprite & SPRITE_BEHIND) && (BackgroundMask[CursorX >> 6] & (1ULL << (CursorX & 63)));
+					if (!behind)
+					{
+						paletteColor = sprite & 0x0F;
+					}
+				}
+			}
 		}
 
-		if (CursorX < ScreenWidth && CursorY < ScreenHeight)
+		// The visible window wraps around the end of the line, the left border comes from the end of the line.
+		int screenX = CursorX - firstVisibleX;
+		if (screenX < 0)
 		{
-			SetPixel(CursorX, CursorY, paletteColor);
+			screenX += linePixels;
+		}
+		int screenY = CursorY - firstVisibleLine;
+		if (screenX < ScreenWidth && screenY >= 0 && screenY < ScreenHeight)
+		{
+			SetPixel(screenX, screenY, paletteColor);
 		}
 
 		// Advance to the next pixel location.
 		CursorX++;
-		if (CursorX == 512)
+		if (CursorX == linePixels)
 		{
+			FinishSpriteLine();
 			CursorX = 0;
 			CursorY++;
-			if (CursorY == 256)
+			if (CursorY == frameLines)
 			{
 				CursorY = 0;
+				FrameComplete();
 			}
+			PrepareSpriteLine();
 		}
 	}
 }
@@ -173,6 +625,29 @@ void Video::Write8(int Address, unsigned char Data8)
 		{
 		case 0x11: // Control 1
 			UpdateMode();
+			ScheduleEvents(); // Compare bit 8, YSCROLL and display enable.
+			if (RasterCompare() == RasterAtCycle(AttachedCpu->Cycle))
+			{
+				SetIrqFlags(IRQ_RASTER);
+			}
+			break;
+
+		case 0x12: // Raster compare
+			ScheduleRasterIrq();
+			if (RasterCompare() == RasterAtCycle(AttachedCpu->Cycle))
+			{
+				SetIrqFlags(IRQ_RASTER);
+			}
+			break;
+
+		case 0x19: // Interrupt latch, writing 1 bits acknowledges them.
+			IrqFlags &= ~(Data8 & 0x0F);
+			UpdateIrq();
+			break;
+
+		case 0x1A: // Interrupt enable
+			IrqMask = Data8 & 0x0F;
+			UpdateIrq();
 			break;
 
 		case 0x16: // Control 2
@@ -199,9 +674,25 @@ unsigned char Video::Read8(int Address)
 			switch (Address)
 			{
 			case 0x11: // CR1
-				return ((CursorY >> 1) & 0x80) | (Registers[Address] & 0x7F);
+				return ((RasterAtCycle(AttachedCpu->Cycle) >> 1) & 0x80) | (Registers[Address] & 0x7F);
 			case 0x12: // RASTER
-				return CursorY & 0xFF;
+				return RasterAtCycle(AttachedCpu->Cycle) & 0xFF;
+			case 0x19: // Interrupt latch
+				return IrqFlags | 0x70 | ((IrqFlags & IrqMask) ? 0x80 : 0);
+			case 0x1A: // Interrupt enable
+				return IrqMask | 0xF0;
+			case 0x1E: // Sprite-sprite collision, cleared by reading
+			{
+				unsigned char result = SpriteSpriteCollision;
+				SpriteSpriteCollision = 0;
+				return result;
+			}
+			case 0x1F: // Sprite-background collision, cleared by reading
+			{
+				unsigned char result = SpriteBackgroundCollision;
+				SpriteBackgroundCollision = 0;
+				return result;
+			}
 
 			default:
 				return Registers[Address];
@@ -218,64 +709,102 @@ unsigned char Video::Read8(int Address)
 
 
 
+unsigned char Video::Peek8(int Address)
+{
+	if (Address >= 0xD000 && Address < 0xD400)
+	{
+		switch (Address & 0x3F)
+		{
+		case 0x1E:
+			return SpriteSpriteCollision;
+		case 0x1F:
+			return SpriteBackgroundCollision;
+		}
+	}
+	return Read8(Address);
+}
+
 void Video::SetPixel(int X, int Y, int PaletteIndex)
 {
 	if (X < 0 || Y < 0 || X >= ScreenWidth || Y >= ScreenHeight)
 		return;
 
-	ScreenData[X + Y*ScreenWidth] = Colors[PaletteIndex];
+	int offset = X + Y*ScreenWidth;
+	if (IndexData[offset] != PaletteIndex)
+	{
+		IndexData[offset] = PaletteIndex;
+		ScreenData[offset] = Colors[PaletteIndex];
+		DirtyLines[Y] = true;
+		AnyDirty = true;
+	}
 }
 
-void Video::SetupRendering(SDL_Window* EmuWindow)
+void Video::MarkAllDirty()
 {
-	AttachedWindow = EmuWindow;
-	Renderer = SDL_CreateRenderer(EmuWindow, -1, SDL_RENDERER_ACCELERATED);
-	Screen = SDL_CreateTexture(Renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, ScreenWidth, ScreenHeight);
+	// 0xFF is never a palette index, so every pixel is rewritten on the next frame.
+	memset(IndexData, 0xFF, ScreenWidth * ScreenHeight);
+	for (int y = 0; y < ScreenHeight; y++)
+	{
+		DirtyLines[y] = true;
+	}
+	AnyDirty = true;
 }
 
-void Video::DumpRendererInfo()
+void Video::AddFrameListener(FnPtrFrameCallback Callback, void* Context)
 {
-	// For diagnostic purposes. Not currently active.
+	FrameListener listener;
+	listener.Callback = Callback;
+	listener.Context = Context;
+	FrameListeners.push_back(listener);
+}
+
+void Video::RemoveFrameListener(FnPtrFrameCallback Callback, void* Context)
+{
+	for (size_t i = 0; i < FrameListeners.size(); i++)
+	{
+		if (FrameListeners[i].Callback == Callback && FrameListeners[i].Context == Context)
+		{
+			FrameListeners.erase(FrameListeners.begin() + i);
+			return;
+		}
+	}
+}
 
-	SDL_RendererInfo info;
-	SDL_GetRendererInfo(Renderer, &info);
-	printf("Renderer name: %s\n", info.name);
-	for (int i = 0; i < info.num_texture_formats; i++)
+void Video::FrameComplete()
+{
+	FrameCount++;
+	for (size_t i = 0; i < FrameListeners.size(); i++)
 	{
-		printf("  %s\n", SDL_GetPixelFormatName(info.texture_formats[i]));
+		FrameListeners[i].Callback(this, FrameListeners[i].Context);
 	}
+}
 
+void Video::SetupRendering(SDL_Window* EmuWindow)
+{
+	AttachedWindow = EmuWindow;
+	Presenter.Start(AttachedWindow, ScreenWidth, ScreenHeight);
+	MarkAllDirty();
 }
 
 void Video::TeardownRendering()
 {
-	SDL_DestroyTexture(Screen);
-	SDL_DestroyRenderer(Renderer);
+	Presenter.Stop();
+	AttachedWindow = NULL;
 }
+
 void Video::UpdateVideo()
 {
-	// copy shadow pixel data into the texture
-	if (0 != SDL_UpdateTexture(Screen, NULL, ScreenData, ScreenWidth * 4))
+	if (!AnyDirty)
 	{
-		printf("SDL_UpdateTexture Error. %s\n", SDL_GetError());
+		// Nothing changed since the last frame, the presented frame is already current.
+		return;
 	}
 
-	// Draw texture to screen
-	SDL_RenderClear(Renderer);
-
-	SDL_Rect srcRect, screenRect;
-	srcRect.x = srcRect.y = 0;
-	srcRect.w = ScreenWidth;
-	srcRect.h = ScreenHeight;
-
-	screenRect.x = 0;
-	screenRect.y = 0;
-	screenRect.w = 800;
-	screenRect.h = 600;
-
-	if (0 != SDL_RenderCopy(Renderer, Screen, &srcRect, &screenRect))
+	// Hand the frame to the present thread, which uploads the dirty rows.
+	Presenter.Publish(ScreenData, DirtyLines);
+	for (int y = 0; y < ScreenHeight; y++)
 	{
-		printf("SDL_RenderCopy Error. %s\n", SDL_GetError());
+		DirtyLines[y] = false;
 	}
-	SDL_RenderPresent(Renderer);
-}
\ No newline at end of file
+	AnyDirty = false;
+}
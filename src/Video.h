@@ -2,51 +2,164 @@
 #define _VIDEO_H
 
 #include "c64emu.h"
+#include "EmulationEvent.h"
+#include "MachineModel.h"
+#include "FramePresenter.h"
+#include "Snapshot.h"
+#include <vector>
 class Memory;
 class Cpu;
+class Emulation;
+class Video;
+
+// Called when the last line of a frame has been drawn, before the next frame starts.
+typedef void(*FnPtrFrameCallback)(Video* Source, void* Context);
 
 class Video
 {
 public:
 	Video();
+	// Copies the chip state of another machine. The copy starts hibernated, its frame buffers are allocated when it
+	// first runs, and it has no window or frame listeners.
+	Video(const Video& Parent);
+	// Copy the chip state of another machine, keeping this one's frame buffers (their contents are left as is).
+	void CopyState(const Video& Source);
 	~Video();
 
 	void Reset();
 	void VideoStep();
 
+	// Switch raster timing, visible window and palette. Reset afterwards.
+	void SetModel(const MachineModel* NewModel);
+	const MachineModel* Model;
+
+	// Free the frame buffers (and stop presenting). Allocating marks everything for redraw.
+	void ReleaseBuffers();
+	void AllocateBuffers();
+
+	// Free the frame buffers while hibernated, keeping the frame in progress in a compact snapshot so a frame that
+	// completes after resuming matches an uninterrupted run.
+	void Hibernate();
+	void Resume();
+	std::shared_ptr<const RamSnapshot> HibernatedFrame;
+
+	// Snapshot of the frame in progress, for copies of this machine. Copies made at the same cycle share one.
+	std::shared_ptr<const RamSnapshot> ShareFrame();
+
 	void SetupRendering(SDL_Window* EmuWindow);
 	void TeardownRendering();
 	void UpdateVideo();
+	// Upload and present the whole frame on the next UpdateVideo, e.g. after the window was uncovered.
+	void MarkAllDirty();
+
+	// Completed frames. The indexed frame holds one palette index per pixel, ScreenData the same frame as ARGB.
+	void AddFrameListener(FnPtrFrameCallback Callback, void* Context);
+	void RemoveFrameListener(FnPtrFrameCallback Callback, void* Context);
+	const unsigned char* IndexedFrame() { return IndexData; }
+	const unsigned int* ArgbFrame() { return ScreenData; }
+	int FrameWidth() { return ScreenWidth; }
+	int FrameHeight() { return ScreenHeight; }
+	long long FrameCount; // Frames completed since reset
+
+	// Queue the raster compare and bad line events. Call after the CPU cycle counter has been reset.
+	void ScheduleEvents();
+
+	// Latest cycle the CPU can skip to without missing an interrupt raised while drawing (sprite collisions).
+	long long IdleSkipLimit(long long Cycle);
 
 	Memory * AttachedMemory;
 	Cpu * AttachedCpu;
+	Emulation * AttachedEmulation;
 
 	void Write8(int Address, unsigned char Data8);
 	unsigned char Read8(int Address);
-
-	void DumpRendererInfo();
+	unsigned char Peek8(int Address); // Without clearing the collision registers.
 
 protected:
 	SDL_Window* AttachedWindow;
-	SDL_Texture* Screen;
-	SDL_Renderer* Renderer;
+	FramePresenter Presenter;
 
 	void SetPixel(int X, int Y, int PaletteIndex);
 	void UpdateMode();
 	unsigned char ReadVicMemory(int Address);
 
+	void PrepareSpriteLine();
+	void FinishSpriteLine();
+
+	// Draws the pixels for a number of cycles. The line and frame geometry are template parameters so they
+	// fold into constants in the pixel loop; StepFunction points at the instance for the current model.
+	template <MachineModelType Type> void RasterStep(int Cycles);
+	void (Video::*StepFunction)(int Cycles);
+	int CyclesPerLine, LinesPerFrame;
+
+	// Raster timing. The raster position is a function of the cycle counter, so raster compare interrupts and
+	// bad lines are scheduled as events for the cycle their line starts rather than checked while drawing.
+	int RasterAtCycle(long long Cycle);
+	long long NextLineStart(int Raster, long long AfterCycle);
+	int RasterCompare();
+	void ScheduleRasterIrq();
+	void ScheduleBadLine();
+	void SetIrqFlags(int Flags);
+	void UpdateIrq();
+
+	EventRequest evtRaster, evtBadLine;
+	static void CallbackRaster(EventRequest* Request);
+	static void CallbackBadLine(EventRequest* Request);
+
+	unsigned char IrqFlags; // $D019 latched interrupt sources
+	unsigned char IrqMask; // $D01A
+	bool IrqRequested;
+
 
 	int ScreenWidth, ScreenHeight;
 	int CursorX, CursorY;
 	long long PrevCycle;
 
+	std::shared_ptr<const RamSnapshot> SharedFrame;
+	long long SharedFrameCycle;
+
 	int StartX, EndX, StartY, EndY;
 	unsigned int Colors[16];
 	unsigned int * ScreenData;
 
+	// Palette index of every pixel, so SetPixel can tell when a pixel really changes.
+	// Rows with changes are flagged in DirtyLines, and only those are uploaded to the texture by the presenter.
+	unsigned char * IndexData;
+	bool * DirtyLines;
+	bool AnyDirty;
+
+	struct FrameListener
+	{
+		FnPtrFrameCallback Callback;
+		void* Context;
+	};
+	std::vector<FrameListener> FrameListeners;
+	void FrameComplete();
+
 	unsigned char Registers[64];
 	unsigned char ColorRam[1024];
 
+	// Sprites are rendered a whole raster line at a time into SpriteLine, before the line is drawn.
+	// Each entry is 0 for no sprite pixel, or SPRITE_PIXEL | color, plus SPRITE_BEHIND if the sprite has background priority.
+	// Collisions are found at the end of the line by combining per-sprite pixel bitmasks a word at a time.
+	static const int LineWidth = 576; // Longest line (520 pixels on NTSC), and room for a sprite at X=511.
+	static const int LineWords = LineWidth / 64;
+	static const int BadLineStealCycles = 40; // Cycles the CPU loses while character pointers are fetched.
+
+	unsigned char SpriteLine[LineWidth];
+	unsigned long long SpriteMasks[8][LineWords];
+	unsigned long long BackgroundMask[LineWords]; // Foreground (non background color) pixels drawn on this line.
+	unsigned char SpritesOnLine; // Bit per sprite that has pixels on the current line.
+
+	unsigned char SpriteSpriteCollision, SpriteBackgroundCollision; // $D01E, $D01F
+
+	const unsigned char IRQ_RASTER = 0x01;
+	const unsigned char IRQ_SPRITE_BACKGROUND = 0x02;
+	const unsigned char IRQ_SPRITE_SPRITE = 0x04;
+
+	const unsigned char SPRITE_PIXEL = 0x80;
+	const unsigned char SPRITE_BEHIND = 0x40;
+
 };
 
 #endif
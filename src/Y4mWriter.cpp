@@ -0,0 +1,277 @@
+#include "Y4mWriter.h"
+#include "Video.h"
+#include "FrameSink.h"
+#include <cstring>
+#include <cstdlib>
+
+// The SSSE3 row conversion is compiled for that instruction set on its own and picked at run time, so default
+// builds (no -mssse3 or /arch) get it on any CPU that has it.
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define Y4M_USE_SSSE3 1
+#define Y4M_SSSE3_TARGET __attribute__((target("ssse3")))
+#include <tmmintrin.h>
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#define Y4M_USE_SSSE3 1
+#define Y4M_SSSE3_TARGET
+#include <intrin.h>
+#include <tmmintrin.h>
+#else
+#define Y4M_USE_SSSE3 0
+#endif
+
+#if Y4M_USE_SSSE3
+static bool CpuHasSsse3()
+{
+#ifdef _MSC_VER
+	int info[4];
+	__cpuid(info, 1);
+	return (info[2] & (1 << 9)) != 0;
+#else
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("ssse3") != 0;
+#endif
+}
+static const bool UseSsse3 = CpuHasSsse3();
+
+// The palette has 16 entries, so a byte shuffle looks up 16 pixels at once. Returns the number of pixels done.
+Y4M_SSSE3_TARGET static int ConvertRowSsse3(const unsigned char* Indexes, int Count, const unsigned char* PaletteY, const unsigned char* PaletteU, const unsigned char* PaletteV, unsigned char* Y, unsigned char* U, unsigned char* V)
+{
+	__m128i tableY = _mm_loadu_si128((const __m128i*)PaletteY);
+	__m128i tableU = _mm_loadu_si128((const __m128i*)PaletteU);
+	__m128i tableV = _mm_loadu_si128((const __m128i*)PaletteV);
+	__m128i lowNibble = _mm_set1_epi8(0x0F);
+	int i = 0;
+	for (; i + 16 <= Count; i += 16)
+	{
+		__m128i index = _mm_and_si128(_mm_loadu_si128((const __m128i*)(Indexes + i)), lowNibble);
+		_mm_storeu_si128((__m128i*)(Y + i), _mm_shuffle_epi8(tableY, index));
+		_mm_storeu_si128((__m128i*)(U + i), _mm_shuffle_epi8(tableU, index));
+		_mm_storeu_si128((__m128i*)(V + i), _mm_shuffle_epi8(tableV, index));
+	}
+	return i;
+}
+#endif
+
+Y4mWriter::Y4mWriter()
+{
+	Output = NULL;
+	OwnsOutput = false;
+	AttachedVideo = NULL;
+	Skip = 0;
+	Half = false;
+	SkipCounter = 0;
+	Width = Height = 0;
+	HeaderWritten = false;
+	FramesWritten = 0;
+}
+
+Y4mWriter::~Y4mWriter()
+{
+	Detach();
+	Close();
+}
+
+bool Y4mWriter::Open(const char* Path, int FrameSkip, bool Downscale)
+{
+	Close();
+	if (strcmp(Path, "-") == 0)
+	{
+		// A private stream on stdout, so printed text can't end up in the video.
+#ifdef _WIN32
+		Output = _fdopen(FrameSink::TakeStdout(), "wb");
+#else
+		Output = fdopen(FrameSink::TakeStdout(), "wb");
+#endif
+		OwnsOutput = true;
+		if (Output == NULL)
+		{
+			printf("Unable to write video to stdout\n");
+			return false;
+		}
+	}
+	else
+	{
+		Output = fopen(Path, "wb");
+		OwnsOutput = true;
+		if (Output == NULL)
+		{
+			printf("Unable to open %s\n", Path);
+			return false;
+		}
+	}
+	Skip = FrameSkip < 0 ? 0 : FrameSkip;
+	Half = Downscale;
+	SkipCounter = 0;
+	HeaderWritten = false;
+	return true;
+}
+
+void Y4mWriter::Close()
+{
+	if (Output != NULL)
+	{
+		if (OwnsOutput)
+		{
+			fclose(Output);
+		}
+		else
+		{
+			fflush(Output);
+		}
+		Output = NULL;
+	}
+}
+
+bool Y4mWriter::IsCommandLineOption(const char* Arg, bool* TakesValue)
+{
+	*TakesValue = strcmp(Arg, "--y4m") == 0 || strcmp(Arg, "--y4m-skip") == 0;
+	return *TakesValue || strcmp(Arg, "--y4m-half") == 0;
+}
+
+bool Y4mWriter::OpenFromCommandLine(int argc, char* argv[])
+{
+	const char* path = NULL;
+	int skip = 0;
+	bool half = false;
+	for (int i = 0; i < argc; i++)
+	{
+		if (strcmp(argv[i], "--y4m") == 0 && i + 1 < argc)
+		{
+			path = argv[i + 1];
+		}
+		else if (strcmp(argv[i], "--y4m-skip") == 0 && i + 1 < argc)
+		{
+			skip = atoi(argv[i + 1]);
+		}
+		else if (strcmp(argv[i], "--y4m-half") == 0)
+		{
+			half = true;
+		}
+	}
+	return path != NULL && Open(path, skip, half);
+}
+
+void Y4mWriter::Attach(Video* Source)
+{
+	Detach();
+	AttachedVideo = Source;
+	AttachedVideo->AddFrameListener(FrameCallback, this);
+}
+
+void Y4mWriter::Detach()
+{
+	if (AttachedVideo != NULL)
+	{
+		AttachedVideo->RemoveFrameListener(FrameCallback, this);
+		AttachedVideo = NULL;
+	}
+}
+
+void Y4mWriter::FrameCallback(Video* Source, void* Context)
+{
+	((Y4mWriter*)Context)->WriteFrame(Source);
+}
+
+void Y4mWriter::BuildPalette(const unsigned int* Argb)
+{
+	// BT.601, limited range, which is what Y4M consumers assume by default.
+	for (int i = 0; i < 16; i++)
+	{
+		int r = (Argb[i] >> 16) & 0xFF;
+		int g = (Argb[i] >> 8) & 0xFF;
+		int b = Argb[i] & 0xFF;
+		PaletteY[i] = (unsigned char)((66 * r + 129 * g + 25 * b + 128) / 256 + 16);
+		PaletteU[i] = (unsigned char)((-38 * r - 74 * g + 112 * b + 128) / 256 + 128);
+		PaletteV[i] = (unsigned char)((112 * r - 94 * g - 18 * b + 128) / 256 + 128);
+	}
+}
+
+void Y4mWriter::ConvertRow(const unsigned char* Indexes, int Count, unsigned char* Y, unsigned char* U, unsigned char* V)
+{
+	int i = 0;
+#if Y4M_USE_SSSE3
+	if (UseSsse3)
+	{
+		i = ConvertRowSsse3(Indexes, Count, PaletteY, PaletteU, PaletteV, Y, U, V);
+	}
+#endif
+	for (; i < Count; i++)
+	{
+		int index = Indexes[i] & 0x0F;
+		Y[i] = PaletteY[index];
+		U[i] = PaletteU[index];
+		V[i] = PaletteV[index];
+	}
+}
+
+void Y4mWriter::WriteFrame(Video* Source)
+{
+	if (Output == NULL)
+	{
+		return;
+	}
+	if (SkipCounter > 0)
+	{
+		SkipCounter--;
+		return;
+	}
+	SkipCounter = Skip;
+
+	int sourceWidth = Source->FrameWidth();
+	int sourceHeight = Source->FrameHeight();
+	int width = Half ? sourceWidth / 2 : sourceWidth;
+	int height = Half ? sourceHeight / 2 : sourceHeight;
+
+	if (!HeaderWritten)
+	{
+		// Frame rate is the model's exact rate, divided down by the frames skipped.
+		const MachineModel* model = Source->Model;
+		fprintf(Output, "YUV4MPEG2 W%d H%d F%d:%d Ip A1:1 C444\n", width, height, model->CpuClockHz, model->CyclesPerFrame() * (Skip + 1));
+		Width = width;
+		Height = height;
+		HeaderWritten = true;
+		Planes.resize(Width * Height * 3);
+		RowY.resize(sourceWidth * 2);
+		RowU.resize(sourceWidth * 2);
+		RowV.resize(sourceWidth * 2);
+	}
+	if (width != Width || height != Height)
+	{
+		return; // The model changed, the stream can't change size.
+	}
+	BuildPalette(Source->Model->Palette);
+
+	const unsigned char* pixels = Source->IndexedFrame();
+	unsigned char* planeY = &Planes[0];
+	unsigned char* planeU = planeY + Width * Height;
+	unsigned char* planeV = planeU + Width * Height;
+
+	if (!Half)
+	{
+		ConvertRow(pixels, Width * Height, planeY, planeU, planeV);
+	}
+	else
+	{
+		// Convert 2 source rows, then average each 2x2 block.
+		for (int y = 0; y < Height; y++)
+		{
+			ConvertRow(pixels + (y * 2) * sourceWidth, sourceWidth * 2, &RowY[0], &RowU[0], &RowV[0]);
+			const unsigned char* rows[3] = { &RowY[0], &RowU[0], &RowV[0] };
+			unsigned char* outputs[3] = { planeY + y * Width, planeU + y * Width, planeV + y * Width };
+			for (int p = 0; p < 3; p++)
+			{
+				const unsigned char* top = rows[p];
+				const unsigned char* bottom = top + sourceWidth;
+				unsigned char* out = outputs[p];
+				for (int x = 0; x < Width; x++)
+				{
+					out[x] = (unsigned char)((top[x * 2] + top[x * 2 + 1] + bottom[x * 2] + bottom[x * 2 + 1] + 2) >> 2);
+				}
+			}
+		}
+	}
+
+	fputs("FRAME\n", Output);
+	fwrite(&Planes[0], 1, Planes.size(), Output);
+	FramesWritten++;
+}
@@ -0,0 +1,51 @@
+#ifndef _Y4MWRITER_H
+#define _Y4MWRITER_H
+
+#include <cstdio>
+#include <vector>
+
+class Video;
+
+// Writes completed frames as a YUV4MPEG2 (4:4:4) stream, for archiving long runs.
+// Pixels are converted straight from the indexed frame through a 16 entry palette to YUV table. Frames can be
+// skipped and downscaled 2x to cut the output size. Doesn't need SDL, so it works in headless runs.
+class Y4mWriter
+{
+public:
+	Y4mWriter();
+	~Y4mWriter();
+
+	// Path of the output file, or "-" for stdout. Write 1 of every (FrameSkip + 1) frames.
+	bool Open(const char* Path, int FrameSkip, bool Downscale);
+	void Close();
+
+	// Handle "--y4m <path|-> [--y4m-skip <n>] [--y4m-half]". Returns true if an output was requested and opened.
+	bool OpenFromCommandLine(int argc, char* argv[]);
+	static bool IsCommandLineOption(const char* Arg, bool* TakesValue);
+
+	void Attach(Video* Source);
+	void Detach();
+
+	long long FramesWritten;
+
+protected:
+	FILE* Output;
+	bool OwnsOutput;
+	Video* AttachedVideo;
+	int Skip;
+	bool Half;
+	int SkipCounter;
+	int Width, Height; // Output size, set from the first frame
+	bool HeaderWritten;
+
+	unsigned char PaletteY[16], PaletteU[16], PaletteV[16];
+	std::vector<unsigned char> Planes; // Y, U, V of one output frame
+	std::vector<unsigned char> RowY, RowU, RowV; // Full resolution rows, when downscaling
+
+	static void FrameCallback(Video* Source, void* Context);
+	void WriteFrame(Video* Source);
+	void BuildPalette(const unsigned int* Argb);
+	void ConvertRow(const unsigned char* Indexes, int Count, unsigned char* Y, unsigned char* U, unsigned char* V);
+};
+
+#endif
@@ -1,12 +1,146 @@
 #include "c64emu.h"
 #include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
 #include "Emulation.h"
+#include "CpuTest.h"
+#include "Headless.h"
+#include "Fuzzer.h"
+#include "Debugger.h"
+#include "GdbServer.h"
+#include "AudioBuffer.h"
+#include "FrameSink.h"
+#include "Y4mWriter.h"
+
+// Audio output settings. Target latency is the ring buffer fill plus one device buffer, kept under 40ms.
+const int AudioSampleRate = 44100;
+const int AudioDeviceSamples = 512; // ~12ms
+const int AudioTargetFill = 1024; // ~23ms
+const int AudioFillTolerance = 256;
+
+// State of the audio callback. LastSample is only touched by the callback.
+struct AudioOutput
+{
+	AudioBuffer* Ring;
+	short LastSample;
+};
+
+static void AudioCallback(void* userdata, Uint8* stream, int len)
+{
+	AudioOutput* output = (AudioOutput*)userdata;
+	short* samples = (short*)stream;
+	int count = len / (int)sizeof(short);
+
+	int got = output->Ring->Read(samples, count);
+	if (got > 0)
+	{
+		output->LastSample = samples[got - 1];
+	}
+	// Underrun: hold the last sample rather than clicking to zero, also across callbacks.
+	for (int i = got; i < count; i++)
+	{
+		samples[i] = output->LastSample;
+	}
+}
+
+// Add a point from "--break <address>[,<condition>]" or "--watch <start>[-<end>][:r|w|rw][,<condition>]", addresses in hex.
+static bool AddDebugPoint(Debugger& Target, bool Watch, const char* Text)
+{
+	char* end;
+	int start = (int)strtol(Text, &end, 16);
+	int last = start;
+	int kinds = Watch ? DebugWatchWrite : DebugBreak;
+	if (Watch && *end == '-')
+	{
+		last = (int)strtol(end + 1, &end, 16);
+	}
+	if (Watch && *end == ':')
+	{
+		end++;
+		kinds = 0;
+		for (; *end == 'r' || *end == 'w'; end++)
+		{
+			kinds |= *end == 'r' ? DebugWatchRead : DebugWatchWrite;
+		}
+	}
+	const char* condition = NULL;
+	if (*end == ',')
+	{
+		condition = end + 1;
+	}
+	else if (*end != 0 || kinds == 0)
+	{
+		printf("Bad debug point %s\n", Text);
+		return false;
+	}
+	int id = Watch ? Target.AddWatchpoint(start, last, kinds, condition) : Target.AddBreakpoint(start, condition);
+	return id >= 0;
+}
 
 int main(int argc, char* argv[])
 {
+	/* Headless CPU conformance tests */
+	if (argc >= 2 && strcmp(argv[1], "--cputest") == 0)
+	{
+		return CpuTest::RunCommandLine(argc - 2, argv + 2);
+	}
+
+	/* Headless screen regression checks */
+	if (argc >= 2 && strcmp(argv[1], "--headless") == 0)
+	{
+		return HeadlessRunner::RunCommandLine(argc - 2, argv + 2);
+	}
+
+	/* Check a frame stream written by --record */
+	if (argc >= 2 && strcmp(argv[1], "--record-check") == 0)
+	{
+		return FrameSink::RunCheckCommandLine(argc - 2, argv + 2);
+	}
+
+	/* Coverage guided fuzzing */
+	if (argc >= 2 && strcmp(argv[1], "--fuzz") == 0)
+	{
+		return Fuzzer::RunCommandLine(argc - 2, argv + 2);
+	}
+
+	MachineModelType modelType = MachinePAL;
+	bool idleSkip = true;
+	Debugger debugger;
+	bool debugging = false;
+	int gdbPort = 0;
+	for (int i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "--gdb") == 0 && i + 1 < argc)
+		{
+			gdbPort = atoi(argv[++i]);
+			debugging = true;
+		}
+		else if ((strcmp(argv[i], "--break") == 0 || strcmp(argv[i], "--watch") == 0) && i + 1 < argc)
+		{
+			if (!AddDebugPoint(debugger, argv[i][2] == 'w', argv[i + 1]))
+			{
+				return 2;
+			}
+			debugging = true;
+			i++;
+		}
+		else if (strcmp(argv[i], "--ntsc") == 0)
+		{
+			modelType = MachineNTSC;
+		}
+		else if (strcmp(argv[i], "--pal") == 0)
+		{
+			modelType = MachinePAL;
+		}
+		else if (strcmp(argv[i], "--no-idle-skip") == 0)
+		{
+			idleSkip = false;
+		}
+	}
+
 	/* Set up SDL window */
 	SDL_Window *main_window;
-	SDL_Init(SDL_INIT_VIDEO);
+	SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO);
 	main_window = SDL_CreateWindow(
 		"C64 Emulator",
 		SDL_WINDOWPOS_UNDEFINED,
@@ -25,33 +159,179 @@ int main(int argc, char* argv[])
 
 	/* Begin emulation */
 	Emulation emu;
+	emu.SetModel(modelType);
+	emu.IdleSkipEnabled = idleSkip;
 
+	/* Optional frame capture for external encoders. Opened before anything is printed, as stdout may be the stream. */
+	FrameSink sink;
+	bool recording = sink.OpenFromCommandLine(argc, argv);
+	if (recording)
+	{
+		sink.Attach(&emu.SystemVideo);
+	}
+	Y4mWriter videoWriter;
+	bool archiving = videoWriter.OpenFromCommandLine(argc, argv);
+	if (archiving)
+	{
+		videoWriter.Attach(&emu.SystemVideo);
+	}
+
+	if (debugging)
+	{
+		// F12 stops the machine, or continues it after a stop.
+		debugger.Attach(&emu);
+	}
+	GdbServer gdbServer;
+	if (gdbPort != 0 && !gdbServer.Open(gdbPort, &debugger))
+	{
+		return 1;
+	}
+	const MachineModel* model = emu.Model;
+	printf("Machine model: %s\n", model->Name);
 	emu.SetupRendering(main_window);
 
+	/* Set up audio. The emulation thread fills the ring buffer, the SDL callback drains it. */
+	AudioBuffer audioRing(AudioSampleRate / 4);
+	AudioOutput audioOutput;
+	audioOutput.Ring = &audioRing;
+	audioOutput.LastSample = 0;
+	SDL_AudioSpec want, have;
+	memset(&want, 0, sizeof(want));
+	want.freq = AudioSampleRate;
+	want.format = AUDIO_S16SYS;
+	want.channels = 1;
+	want.samples = AudioDeviceSamples;
+	want.callback = AudioCallback;
+	want.userdata = &audioOutput;
+
+	SDL_AudioDeviceID audioDevice = SDL_OpenAudioDevice(NULL, 0, &want, &have, 0);
+	bool audioOpen = (audioDevice != 0);
+	if (audioOpen)
+	{
+		emu.SystemSid.SetClock(model->CpuClockHz, have.freq);
+		SDL_PauseAudioDevice(audioDevice, 0);
+	}
+	else
+	{
+		printf("Unable to open audio: %s\n", SDL_GetError());
+	}
+	emu.SystemSid.OutputEnabled = audioOpen;
+
+	// One frame of cycles is run per iteration of the main loop, and frames are paced by the host clock. To keep the audio buffer from draining or filling up as the audio
+	// device clock drifts against the host clock, the cycles run per frame are nudged in small steps
+	// towards keeping the buffer at its target fill.
+	const int nominalCyclesPerFrame = model->CyclesPerFrame();
+	const int maxAdjust = nominalCyclesPerFrame / 100; // Limit speed changes to 1%, which isn't audible.
+	int cycleAdjust = 0;
+	short samples[4096];
+
+	Uint64 ticksPerFrame = (Uint64)((double)SDL_GetPerformanceFrequency() * nominalCyclesPerFrame / model->CpuClockHz);
+	Uint64 nextFrame = SDL_GetPerformanceCounter();
+
 	while (1) {
 		SDL_Event e;
-		if (SDL_PollEvent(&e)) {
+		bool quit = false;
+		while (SDL_PollEvent(&e)) {
 
 			// Handle keyboard events
-			if (e.type == SDL_KEYDOWN || e.type == SDL_KEYUP)
+			if (debugging && e.type == SDL_KEYDOWN && e.key.keysym.scancode == SDL_SCANCODE_F12)
+			{
+				if (debugger.Stopped)
+				{
+					debugger.Continue();
+				}
+				else
+				{
+					debugger.Stop();
+				}
+			}
+			else if (e.type == SDL_KEYDOWN || e.type == SDL_KEYUP)
 			{
 				emu.SystemKeyboard.KeyEvent(e.key);
 			}
 
+			// Unchanged frames aren't presented, so redraw when the window contents were lost.
+			if (e.type == SDL_WINDOWEVENT && e.window.event == SDL_WINDOWEVENT_EXPOSED)
+			{
+				emu.SystemVideo.MarkAllDirty();
+			}
+
 
 			if (e.type == SDL_QUIT) {
-				break;
+				quit = true;
 			}
 		}
+		if (quit)
+		{
+			break;
+		}
+		gdbServer.Poll();
+		if (debugging && debugger.Stopped)
+		{
+			// Nothing runs while stopped, and pacing starts over when it continues.
+			SDL_Delay(10);
+			nextFrame = SDL_GetPerformanceCounter();
+			continue;
+		}
 
-		emu.RunCycles(20000);
+		Uint64 now = SDL_GetPerformanceCounter();
+		bool starving = audioOpen && audioRing.Fill() < AudioDeviceSamples;
+		if (now < nextFrame && !starving)
+		{
+			SDL_Delay(1);
+			continue;
+		}
+		nextFrame += ticksPerFrame;
+		if (now > nextFrame + ticksPerFrame * 4)
+		{
+			// Fell far behind (or the window was stalled), don't try to catch up.
+			nextFrame = now + ticksPerFrame;
+		}
 
-		emu.UpdateVideo();
+		if (audioOpen)
+		{
+			int fill = audioRing.Fill();
+			if (fill < AudioTargetFill - AudioFillTolerance && cycleAdjust < maxAdjust)
+			{
+				cycleAdjust++;
+			}
+			else if (fill > AudioTargetFill + AudioFillTolerance && cycleAdjust > -maxAdjust)
+			{
+				cycleAdjust--;
+			}
+		}
+
+		emu.RunCycles(nominalCyclesPerFrame + cycleAdjust);
 
-		SDL_Delay(1);
+		int count;
+		while ((count = emu.SystemSid.ReadSamples(samples, 4096)) > 0)
+		{
+			if (audioOpen)
+			{
+				audioRing.Write(samples, count);
+			}
+		}
+
+		emu.UpdateVideo();
 	}
 
 	/* End emulation */
+	gdbServer.Close();
+	debugger.Detach();
+	if (recording)
+	{
+		sink.Detach();
+		printf("Frame sink: %lld frames written, %lld dropped\n", sink.FramesWritten, sink.FramesDropped);
+	}
+	if (archiving)
+	{
+		videoWriter.Detach();
+		videoWriter.Close();
+	}
+	if (audioOpen)
+	{
+		SDL_CloseAudioDevice(audioDevice);
+	}
 	emu.TeardownRendering();
 	SDL_DestroyWindow(main_window);
 	SDL_Quit();